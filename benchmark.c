@@ -0,0 +1,535 @@
+/* Parse benchmark, plus smr_compute_stats over each parse. Prints JSON results
+   to stdout, for comparing versions:
+
+       cc -O2 benchmark.c -o benchmark -lpthread
+       ./benchmark [--runs N] [--warmup N] [--label NAME] [file.mid ...]
+
+   Without files it runs the bundled MIDI files plus two generated ones. */
+#include "profiler.h"
+
+#define SMR_ENABLE_THREADS
+#define SMR_IMPLEMENTATION
+#include "simple_midi_read.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#define MAX_RUNS 1000
+
+struct benchmark_mode
+{
+    const char* name;
+    uint32_t flags;
+};
+
+static const struct benchmark_mode modes[] =
+{
+    { "two_pass", 0 },
+    { "single_pass", SMRE_read_single_pass },
+    { "parallel", SMRE_read_parallel },
+    { "borrow_payloads", SMRE_read_borrow_payloads },
+    { "columns", SMRE_read_columns }
+};
+
+/* Counts what a parse allocates. */
+struct allocation_stats
+{
+    uint64_t allocated;
+    uint64_t allocations;
+    uint64_t current;
+    uint64_t peak;
+};
+
+static void* counting_alloc(size_t size, void* user)
+{
+    struct allocation_stats* stats;
+
+    stats = (struct allocation_stats*)user;
+    stats->allocated += size;
+    stats->allocations += 1;
+    stats->current += size;
+    if (stats->current > stats->peak)
+    {
+        stats->peak = stats->current;
+    }
+
+    return malloc(size);
+}
+
+static void* counting_realloc(void* ptr, size_t old_size, size_t new_size, void* user)
+{
+    struct allocation_stats* stats;
+
+    stats = (struct allocation_stats*)user;
+    stats->allocations += 1;
+    stats->current = stats->current - old_size + new_size;
+    if (new_size > old_size)
+    {
+        stats->allocated += new_size - old_size;
+    }
+    if (stats->current > stats->peak)
+    {
+        stats->peak = stats->current;
+    }
+
+    return realloc(ptr, new_size);
+}
+
+static void counting_free(void* ptr, size_t size, void* user)
+{
+    struct allocation_stats* stats;
+
+    stats = (struct allocation_stats*)user;
+    stats->current -= size;
+
+    free(ptr);
+}
+
+/* Growable byte buffer for generating files. */
+struct byte_writer
+{
+    uint8_t* bytes;
+    uint64_t length;
+    uint64_t capacity;
+};
+
+static void write_bytes(struct byte_writer* writer, const uint8_t* bytes, uint64_t length)
+{
+    if (writer->length + length > writer->capacity)
+    {
+        writer->capacity = (writer->length + length) * 2;
+        writer->bytes = (uint8_t*)realloc(writer->bytes, writer->capacity);
+    }
+
+    memcpy(writer->bytes + writer->length, bytes, length);
+    writer->length += length;
+}
+
+static void write_byte(struct byte_writer* writer, uint8_t byte)
+{
+    write_bytes(writer, &byte, 1);
+}
+
+static void write_variable_length_int(struct byte_writer* writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    int length;
+
+    length = 0;
+    do
+    {
+        bytes[length++] = value & 0x7F;
+        value >>= 7;
+    } while (value > 0);
+
+    while (length > 1)
+    {
+        write_byte(writer, bytes[--length] | 0x80);
+    }
+    write_byte(writer, bytes[0]);
+}
+
+static void write_uint32(struct byte_writer* writer, uint32_t value)
+{
+    write_byte(writer, (uint8_t)(value >> 24));
+    write_byte(writer, (uint8_t)(value >> 16));
+    write_byte(writer, (uint8_t)(value >> 8));
+    write_byte(writer, (uint8_t)value);
+}
+
+/* A format 1 file with ntracks tracks of nnotes notes each, mixing running
+   status, one and two byte delta times, controllers and pitch bends the way
+   recorded performances do. */
+static uint8_t* make_synthetic_file(uint16_t ntracks, uint32_t nnotes, uint64_t* length)
+{
+    static const uint8_t header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1 };
+    struct byte_writer writer;
+    uint16_t track_index;
+
+    memset(&writer, 0, sizeof(writer));
+    write_bytes(&writer, header, sizeof(header));
+    write_byte(&writer, (uint8_t)(ntracks >> 8));
+    write_byte(&writer, (uint8_t)ntracks);
+    write_byte(&writer, 0x01);
+    write_byte(&writer, 0xE0);
+
+    for (track_index = 0; track_index < ntracks; ++track_index)
+    {
+        static const uint8_t track_name[] = { 0x00, 0xFF, 0x03, 0x09, 'S', 'y', 'n', 't', 'h', 'e', 't', 'i', 'c' };
+        static const uint8_t tempo[] = { 0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20 };
+        static const uint8_t end_of_track[] = { 0x00, 0xFF, 0x2F, 0x00 };
+        uint64_t length_offset;
+        uint8_t channel;
+        uint8_t last_status_byte;
+        uint32_t i;
+
+        write_bytes(&writer, (const uint8_t*)"MTrk", 4);
+        length_offset = writer.length;
+        write_uint32(&writer, 0);
+
+        write_bytes(&writer, track_name, sizeof(track_name));
+        if (track_index == 0)
+        {
+            write_bytes(&writer, tempo, sizeof(tempo));
+        }
+
+        channel = track_index & 0x0F;
+        last_status_byte = 0;
+        for (i = 0; i < nnotes; ++i)
+        {
+            uint8_t note;
+
+            note = (uint8_t)(36 + (i * 7 + track_index) % 48);
+
+            if (i % 16 == 0)
+            {
+                write_byte(&writer, 0);
+                write_byte(&writer, 0xB0 | channel);
+                write_byte(&writer, 64);
+                write_byte(&writer, (i / 16) % 2 ? 127 : 0);
+                last_status_byte = 0xB0 | channel;
+            }
+
+            if (i % 64 == 32)
+            {
+                write_byte(&writer, 0);
+                write_byte(&writer, 0xE0 | channel);
+                write_byte(&writer, (uint8_t)(i & 0x7F));
+                write_byte(&writer, 0x40);
+                last_status_byte = 0xE0 | channel;
+            }
+
+            /* Chords share a tick, melody notes don't. */
+            write_variable_length_int(&writer, i % 4 == 0 ? 0 : 60 + (i * 37) % 400);
+            if (last_status_byte != (0x90 | channel))
+            {
+                last_status_byte = 0x90 | channel;
+                write_byte(&writer, last_status_byte);
+            }
+            write_byte(&writer, note);
+            write_byte(&writer, (uint8_t)(40 + i % 80));
+
+            /* Note off as a zero velocity note on, to keep running status. */
+            write_variable_length_int(&writer, 30 + (i * 13) % 200);
+            write_byte(&writer, note);
+            write_byte(&writer, 0);
+        }
+
+        write_bytes(&writer, end_of_track, sizeof(end_of_track));
+        writer.bytes[length_offset] = (uint8_t)((writer.length - length_offset - 4) >> 24);
+        writer.bytes[length_offset + 1] = (uint8_t)((writer.length - length_offset - 4) >> 16);
+        writer.bytes[length_offset + 2] = (uint8_t)((writer.length - length_offset - 4) >> 8);
+        writer.bytes[length_offset + 3] = (uint8_t)(writer.length - length_offset - 4);
+    }
+
+    *length = writer.length;
+    return writer.bytes;
+}
+
+static uint8_t* read_whole_file(const char* filename, uint64_t* length)
+{
+    FILE* file_ptr;
+    long int file_size;
+    uint8_t* buffer;
+
+    file_ptr = fopen(filename, "rb");
+    if (!file_ptr)
+    {
+        return NULL;
+    }
+
+    fseek(file_ptr, 0L, SEEK_END);
+    file_size = ftell(file_ptr);
+    fseek(file_ptr, 0L, SEEK_SET);
+
+    buffer = file_size > 0 ? (uint8_t*)malloc(file_size) : NULL;
+    if (buffer && fread(buffer, 1, file_size, file_ptr) != (size_t)file_size)
+    {
+        free(buffer);
+        buffer = NULL;
+    }
+
+    fclose(file_ptr);
+    *length = file_size;
+    return buffer;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    double x;
+    double y;
+
+    x = *(const double*)a;
+    y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t count_events(const struct smr_midi_data* midi_data)
+{
+    uint64_t nevents;
+    int i;
+
+    nevents = 0;
+    for (i = 0; i < midi_data->ntracks; ++i)
+    {
+        nevents += midi_data->columns ? midi_data->columns[i].nevents : midi_data->tracks[i].nevents;
+    }
+
+    return nevents;
+}
+
+/* Prints the JSON result object for one set of timed runs, which get sorted. */
+static void print_result(const char* name, const char* mode, uint64_t length, uint64_t nevents, double* times, int runs, const struct allocation_stats* stats, int* first)
+{
+    double total;
+    double median;
+    int run;
+
+    total = 0.0;
+    for (run = 0; run < runs; ++run)
+    {
+        total += times[run];
+    }
+    qsort(times, runs, sizeof(double), compare_doubles);
+    median = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2.0;
+
+    printf("%s    {\"file\": \"%s\", \"mode\": \"%s\", \"bytes\": %llu, \"events\": %llu, ", *first ? "" : ",\n", name, mode, (unsigned long long)length, (unsigned long long)nevents);
+    printf("\"min_ms\": %.4f, \"median_ms\": %.4f, \"mean_ms\": %.4f, ", times[0] * 1000.0, median * 1000.0, total / runs * 1000.0);
+    printf("\"mb_per_s\": %.2f, \"events_per_s\": %.0f, ", length / median / 1000000.0, nevents / median);
+    printf("\"bytes_allocated\": %llu, \"allocations\": %llu, \"peak_bytes\": %llu}", (unsigned long long)stats->allocated, (unsigned long long)stats->allocations, (unsigned long long)stats->peak);
+    *first = 0;
+}
+
+/* Times smr_compute_stats over already parsed data, as stats_<what>. */
+static int benchmark_stats(const char* name, const char* mode, const struct smr_midi_data* midi_data, uint64_t length, int warmup, int runs, int* first)
+{
+    struct allocation_stats stats;
+    struct smr_allocator allocator;
+    struct smr_stats midi_stats;
+    double times[MAX_RUNS];
+    int run;
+
+    allocator.alloc_func = counting_alloc;
+    allocator.realloc_func = counting_realloc;
+    allocator.free_func = counting_free;
+    allocator.user = &stats;
+
+    for (run = -warmup; run < runs; ++run)
+    {
+        double start;
+        double elapsed;
+
+        memset(&stats, 0, sizeof(stats));
+        start = profiler_now();
+        if (smr_compute_stats(midi_data, &allocator, &midi_stats) != 0)
+        {
+            fprintf(stderr, "%s: %s failed.\n", name, mode);
+            return 1;
+        }
+        elapsed = profiler_now() - start;
+
+        if (run >= 0)
+        {
+            times[run] = elapsed;
+        }
+    }
+
+    print_result(name, mode, length, count_events(midi_data), times, runs, &stats, first);
+
+    return 0;
+}
+
+/* Prints one JSON result object per parse mode, then the statistics over the
+   events and over the columns. Returns 1 if a parse failed. */
+static int benchmark_buffer(const char* name, uint8_t* buffer, uint64_t length, int warmup, int runs, int* first)
+{
+    uint32_t mode_index;
+
+    for (mode_index = 0; mode_index < sizeof(modes) / sizeof(modes[0]); ++mode_index)
+    {
+        struct allocation_stats stats;
+        struct smr_allocator allocator;
+        struct smr_read_options options;
+        struct smr_midi_data midi_data;
+        double times[MAX_RUNS];
+        uint64_t nevents;
+        int run;
+
+        allocator.alloc_func = counting_alloc;
+        allocator.realloc_func = counting_realloc;
+        allocator.free_func = counting_free;
+        allocator.user = &stats;
+        options.flags = modes[mode_index].flags;
+        options.nthreads = 0;
+        options.allocator = &allocator;
+
+        nevents = 0;
+        for (run = -warmup; run < runs; ++run)
+        {
+            double start;
+            double elapsed;
+
+            memset(&stats, 0, sizeof(stats));
+            start = profiler_now();
+            if (smr_read_byte_array_ex(buffer, &options, &midi_data) != 0)
+            {
+                fprintf(stderr, "%s: %s parse failed.\n", name, modes[mode_index].name);
+                return 1;
+            }
+            elapsed = profiler_now() - start;
+
+            nevents = count_events(&midi_data);
+            smr_free_midi_data(&midi_data);
+            if (run >= 0)
+            {
+                times[run] = elapsed;
+            }
+        }
+
+        print_result(name, modes[mode_index].name, length, nevents, times, runs, &stats, first);
+    }
+
+    {
+        struct smr_read_options options;
+        struct smr_midi_data midi_data;
+        struct smr_midi_data columns;
+        int result;
+
+        memset(&options, 0, sizeof(options));
+        if (smr_read_byte_array_ex(buffer, &options, &midi_data) != 0)
+        {
+            return 1;
+        }
+
+        options.flags = SMRE_read_column_ticks;
+        if (smr_events_to_columns(&midi_data, &options, &columns) != 0)
+        {
+            smr_free_midi_data(&midi_data);
+            return 1;
+        }
+
+        result = benchmark_stats(name, "stats_tracks", &midi_data, length, warmup, runs, first);
+        if (result == 0)
+        {
+            result = benchmark_stats(name, "stats_columns", &columns, length, warmup, runs, first);
+        }
+
+        smr_free_midi_data(&midi_data);
+        smr_free_midi_data(&columns);
+        if (result != 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    static const char* bundled_files[] = { "beethoven1.mid", "beethoven2.mid", "beethoven3.mid", "mario_test.mid", "c_scale.mid" };
+    const char* files[256];
+    int nfiles;
+    int bundled;
+    const char* label;
+    int warmup;
+    int runs;
+    int first;
+    int result;
+    int i;
+
+    label = "";
+    warmup = 2;
+    runs = 10;
+    nfiles = 0;
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+        {
+            warmup = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+        {
+            label = argv[++i];
+        }
+        else if (nfiles < 256)
+        {
+            files[nfiles++] = argv[i];
+        }
+    }
+
+    if (runs < 1 || runs > MAX_RUNS || warmup < 0)
+    {
+        fprintf(stderr, "--runs must be 1 to %d, --warmup at least 0.\n", MAX_RUNS);
+        return 1;
+    }
+
+    bundled = nfiles == 0;
+    if (bundled)
+    {
+        for (i = 0; i < (int)(sizeof(bundled_files) / sizeof(bundled_files[0])); ++i)
+        {
+            files[nfiles++] = bundled_files[i];
+        }
+    }
+
+    printf("{\n  \"label\": \"%s\",\n  \"runs\": %d,\n  \"warmup\": %d,\n  \"results\": [\n", label, runs, warmup);
+
+    first = 1;
+    result = 0;
+    for (i = 0; i < nfiles && result == 0; ++i)
+    {
+        uint8_t* buffer;
+        uint64_t length;
+
+        buffer = read_whole_file(files[i], &length);
+        if (!buffer)
+        {
+            fprintf(stderr, "Unable to read %s.\n", files[i]);
+            result = 1;
+            break;
+        }
+
+        result = benchmark_buffer(files[i], buffer, length, warmup, runs, &first);
+        free(buffer);
+    }
+
+    if (result == 0 && bundled)
+    {
+        uint8_t* buffer;
+        uint64_t length;
+
+        /* One long track, then many tracks for the parallel parse. */
+        buffer = make_synthetic_file(1, 200000, &length);
+        result = benchmark_buffer("synthetic_1_track", buffer, length, warmup, runs, &first);
+        free(buffer);
+
+        if (result == 0)
+        {
+            buffer = make_synthetic_file(16, 250000, &length);
+            result = benchmark_buffer("synthetic_16_tracks", buffer, length, warmup, runs, &first);
+            free(buffer);
+        }
+    }
+
+    printf("\n  ]");
+#if defined(__unix__) || defined(__APPLE__)
+    {
+        struct rusage usage;
+
+        /* Kilobytes on Linux, bytes on macOS. */
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            printf(",\n  \"max_rss\": %ld", usage.ru_maxrss);
+        }
+    }
+#endif
+    printf("\n}\n");
+
+    return result;
+}
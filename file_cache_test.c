@@ -0,0 +1,459 @@
+/* Checks smr_file_cache on copies of the sample files. Acquiring a path twice
+   has to hand out the same parse and parse it once. Rewriting the file has to
+   give the next acquire a fresh parse, while whoever holds the old one can
+   still read it. A budget of one byte has to evict a file as soon as it is
+   released, and a file that fails to parse must not stay cached, nor count as
+   a hit for the threads that waited on it.
+
+       cc -O2 file_cache_test.c -o file_cache_test
+       cc -O2 -DSMR_ENABLE_THREADS file_cache_test.c -o file_cache_test -lpthread
+       ./file_cache_test [a.mid b.mid ...] */
+#define SMR_IMPLEMENTATION
+#include "simple_midi_read.h"
+
+#define TEST_PATH "file_cache_test.tmp.mid"
+
+static const char* default_files[] =
+{
+    "beethoven1.mid",
+    "beethoven2.mid",
+    "beethoven3.mid",
+    "c_scale.mid",
+    "mario_test.mid"
+};
+
+static int write_test_file(const uint8_t* data, uint64_t size)
+{
+    FILE* file_ptr;
+    int failed;
+
+    file_ptr = fopen(TEST_PATH, "wb");
+    if (!file_ptr)
+    {
+        printf("Unable to write %s.\n", TEST_PATH);
+        return 1;
+    }
+
+    failed = fwrite(data, 1, (size_t)size, file_ptr) != size;
+    fclose(file_ptr);
+
+    return failed;
+}
+
+static uint8_t* read_whole_file(const char* filename, uint64_t* size)
+{
+    FILE* file_ptr;
+    uint8_t* data;
+
+    file_ptr = fopen(filename, "rb");
+    if (!file_ptr)
+    {
+        return NULL;
+    }
+
+    fseek(file_ptr, 0L, SEEK_END);
+    *size = (uint64_t)ftell(file_ptr);
+    fseek(file_ptr, 0L, SEEK_SET);
+    data = (uint8_t*)malloc((size_t)*size);
+    if (data && fread(data, 1, (size_t)*size, file_ptr) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(file_ptr);
+
+    return data;
+}
+
+static int same_events(const struct smr_midi_data* a, const struct smr_midi_data* b)
+{
+    uint16_t track_index;
+    uint32_t event_index;
+
+    if (a->ntracks != b->ntracks)
+    {
+        return 0;
+    }
+
+    for (track_index = 0; track_index < a->ntracks; ++track_index)
+    {
+        const struct smr_track_data* track_a;
+        const struct smr_track_data* track_b;
+
+        track_a = a->tracks + track_index;
+        track_b = b->tracks + track_index;
+        if (track_a->nevents != track_b->nevents)
+        {
+            return 0;
+        }
+
+        for (event_index = 0; event_index < track_a->nevents; ++event_index)
+        {
+            if (track_a->events[event_index].event_type != track_b->events[event_index].event_type || track_a->events[event_index].delta_time != track_b->events[event_index].delta_time)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static int check_stats(struct smr_file_cache* cache, uint64_t hits, uint64_t misses, uint64_t evictions, uint64_t nentries, const char* what)
+{
+    struct smr_file_cache_stats stats;
+
+    smr_file_cache_get_stats(cache, &stats);
+    if (stats.hits != hits || stats.misses != misses || stats.evictions != evictions || stats.nentries != nentries)
+    {
+        printf("%s: %lu hits, %lu misses, %lu evictions and %lu entries, expected %lu, %lu, %lu and %lu.\n", what,
+            (unsigned long)stats.hits, (unsigned long)stats.misses, (unsigned long)stats.evictions, (unsigned long)stats.nentries,
+            (unsigned long)hits, (unsigned long)misses, (unsigned long)evictions, (unsigned long)nentries);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Acquires the same path twice, then rewrites it with other_data while the
+   first parse is still held. */
+static int test_shared_and_rewritten(const uint8_t* data, uint64_t size, const struct smr_midi_data* expected,
+    const uint8_t* other_data, uint64_t other_size, const struct smr_midi_data* other_expected)
+{
+    struct smr_file_cache* cache;
+    const struct smr_midi_data* first;
+    const struct smr_midi_data* second;
+    const struct smr_midi_data* rewritten;
+    int failed;
+
+    if (write_test_file(data, size) != 0 || smr_file_cache_create(~(uint64_t)0, NULL, &cache) != 0)
+    {
+        return 1;
+    }
+
+    failed = 1;
+    first = NULL;
+    second = NULL;
+    rewritten = NULL;
+    if (smr_file_cache_acquire(cache, TEST_PATH, &first) != 0 || smr_file_cache_acquire(cache, TEST_PATH, &second) != 0)
+    {
+        goto done;
+    }
+
+    if (first != second || !same_events(first, expected))
+    {
+        printf("Acquiring the same file twice gave two different parses.\n");
+        goto done;
+    }
+
+    if (check_stats(cache, 1, 1, 0, 1, "Acquired twice") != 0)
+    {
+        goto done;
+    }
+
+    /* A different size makes the change show even where the file system only
+       keeps the time to the second. */
+    if (write_test_file(other_data, other_size) != 0 || smr_file_cache_acquire(cache, TEST_PATH, &rewritten) != 0)
+    {
+        goto done;
+    }
+
+    if (rewritten == first || !same_events(rewritten, other_expected))
+    {
+        printf("Rewriting the file didn't give a fresh parse.\n");
+        goto done;
+    }
+
+    if (!same_events(first, expected) || check_stats(cache, 1, 2, 0, 1, "Rewritten") != 0)
+    {
+        printf("The old parse didn't survive the rewrite.\n");
+        goto done;
+    }
+
+    failed = 0;
+
+done:
+    if (first)
+    {
+        smr_file_cache_release(cache, first);
+    }
+
+    if (second)
+    {
+        smr_file_cache_release(cache, second);
+    }
+
+    if (rewritten)
+    {
+        smr_file_cache_release(cache, rewritten);
+    }
+
+    if (!failed)
+    {
+        /* The old parse is gone with its last holder, the new one is kept. */
+        failed = check_stats(cache, 1, 2, 0, 1, "Released");
+    }
+
+    smr_file_cache_free(cache);
+
+    return failed;
+}
+
+/* Nothing fits in one byte, so every release evicts. */
+static int test_tiny_budget(const uint8_t* data, uint64_t size)
+{
+    struct smr_file_cache* cache;
+    const struct smr_midi_data* midi_data;
+    int failed;
+
+    if (write_test_file(data, size) != 0 || smr_file_cache_create(1, NULL, &cache) != 0)
+    {
+        return 1;
+    }
+
+    failed = 1;
+    if (smr_file_cache_acquire(cache, TEST_PATH, &midi_data) != 0)
+    {
+        goto done;
+    }
+
+    /* Held files are never evicted. */
+    if (check_stats(cache, 0, 1, 0, 1, "Held") != 0)
+    {
+        smr_file_cache_release(cache, midi_data);
+        goto done;
+    }
+
+    smr_file_cache_release(cache, midi_data);
+    if (check_stats(cache, 0, 1, 1, 0, "Released over budget") != 0)
+    {
+        goto done;
+    }
+
+    if (smr_file_cache_acquire(cache, TEST_PATH, &midi_data) != 0)
+    {
+        goto done;
+    }
+
+    smr_file_cache_release(cache, midi_data);
+    failed = check_stats(cache, 0, 2, 2, 0, "Acquired again");
+
+done:
+    smr_file_cache_free(cache);
+
+    return failed;
+}
+
+/* A file that isn't MIDI fails every acquire, each one a miss. */
+static int test_failed_parse(void)
+{
+    static const uint8_t not_midi[] = "This is not a MIDI file.";
+    struct smr_file_cache* cache;
+    const struct smr_midi_data* midi_data;
+    int failed;
+
+    if (write_test_file(not_midi, sizeof(not_midi)) != 0 || smr_file_cache_create(~(uint64_t)0, NULL, &cache) != 0)
+    {
+        return 1;
+    }
+
+    failed = smr_file_cache_acquire(cache, TEST_PATH, &midi_data) == 0 || smr_file_cache_acquire(cache, TEST_PATH, &midi_data) == 0;
+    if (failed)
+    {
+        printf("A file that isn't MIDI was acquired.\n");
+    }
+    else
+    {
+        failed = check_stats(cache, 0, 2, 0, 0, "Failed parse");
+    }
+
+    smr_file_cache_free(cache);
+
+    return failed;
+}
+
+#ifdef SMR_ENABLE_THREADS
+#define NTHREADS 8
+
+/* Stalls every parse and then fails it, so that the other threads get to wait
+   on it. The cache's own allocations go through. */
+static void* stalling_alloc(size_t size, void* user)
+{
+    struct timespec stall;
+
+    (void)user;
+    if (size == sizeof(struct smr_file_cache_entry) + sizeof(TEST_PATH) || size == SMR_FILE_CACHE_MIN_BUCKETS * sizeof(struct smr_file_cache_entry*) || size == sizeof(struct smr_file_cache))
+    {
+        return malloc(size);
+    }
+
+    stall.tv_sec = 0;
+    stall.tv_nsec = 20000000;
+    nanosleep(&stall, NULL);
+
+    return NULL;
+}
+
+static void* stalling_realloc(void* ptr, size_t old_size, size_t new_size, void* user)
+{
+    (void)ptr;
+    (void)old_size;
+    (void)new_size;
+    (void)user;
+
+    return NULL;
+}
+
+static void stalling_free(void* ptr, size_t size, void* user)
+{
+    (void)size;
+    (void)user;
+    free(ptr);
+}
+
+static void* acquire_failing(void* cache)
+{
+    const struct smr_midi_data* midi_data;
+
+    return smr_file_cache_acquire((struct smr_file_cache*)cache, TEST_PATH, &midi_data) == 0 ? cache : NULL;
+}
+
+/* Threads that waited on a parse that then failed got nothing, so each of
+   them is a miss like the thread that parsed. */
+static int test_failed_wait(const uint8_t* data, uint64_t size)
+{
+    struct smr_allocator allocator;
+    struct smr_read_options options;
+    struct smr_file_cache* cache;
+    pthread_t threads[NTHREADS];
+    void* acquired;
+    int failed;
+    int i;
+
+    allocator.alloc_func = stalling_alloc;
+    allocator.realloc_func = stalling_realloc;
+    allocator.free_func = stalling_free;
+    allocator.user = NULL;
+    memset(&options, 0, sizeof(options));
+    options.allocator = &allocator;
+    if (write_test_file(data, size) != 0 || smr_file_cache_create(~(uint64_t)0, &options, &cache) != 0)
+    {
+        return 1;
+    }
+
+    for (i = 0; i < NTHREADS; ++i)
+    {
+        pthread_create(threads + i, NULL, acquire_failing, cache);
+    }
+
+    failed = 0;
+    for (i = 0; i < NTHREADS; ++i)
+    {
+        pthread_join(threads[i], &acquired);
+        if (acquired)
+        {
+            printf("A thread acquired a file whose parse failed.\n");
+            failed = 1;
+        }
+    }
+
+    if (!failed)
+    {
+        failed = check_stats(cache, 0, NTHREADS, 0, 0, "Failed parse waited on");
+    }
+
+    smr_file_cache_free(cache);
+
+    return failed;
+}
+#endif
+
+static int test_file(const char* filename, const char* other_filename)
+{
+    struct smr_midi_data expected;
+    struct smr_midi_data other_expected;
+    uint8_t* data;
+    uint8_t* other_data;
+    uint64_t size, other_size;
+    int failed;
+
+    data = read_whole_file(filename, &size);
+    other_data = read_whole_file(other_filename, &other_size);
+    if (!data || !other_data || smr_read_file(filename, &expected) != 0)
+    {
+        free(data);
+        free(other_data);
+        printf("Unable to read %s or %s.\n", filename, other_filename);
+        return 1;
+    }
+
+    if (smr_read_file(other_filename, &other_expected) != 0)
+    {
+        smr_free_midi_data(&expected);
+        free(data);
+        free(other_data);
+        return 1;
+    }
+
+    failed = 1;
+    if (size == other_size)
+    {
+        printf("%s and %s have the same size.\n", filename, other_filename);
+        goto done;
+    }
+
+    if (test_shared_and_rewritten(data, size, &expected, other_data, other_size, &other_expected) != 0 || test_tiny_budget(data, size) != 0)
+    {
+        goto done;
+    }
+
+#ifdef SMR_ENABLE_THREADS
+    if (test_failed_wait(data, size) != 0)
+    {
+        goto done;
+    }
+#endif
+
+    printf("%s: shared, rewritten and evicted.\n", filename);
+    failed = 0;
+
+done:
+    smr_free_midi_data(&expected);
+    smr_free_midi_data(&other_expected);
+    free(data);
+    free(other_data);
+
+    return failed;
+}
+
+int main(int argc, char** argv)
+{
+    const char** files;
+    int nfiles;
+    int nfailed;
+    int i;
+
+    /* Each file is rewritten with the next one, so there have to be two. */
+    files = argc > 2 ? (const char**)argv + 1 : default_files;
+    nfiles = argc > 2 ? argc - 1 : (int)(sizeof(default_files) / sizeof(default_files[0]));
+
+    nfailed = 0;
+    for (i = 0; i < nfiles; ++i)
+    {
+        nfailed += test_file(files[i], files[(i + 1) % nfiles]);
+    }
+
+    nfailed += test_failed_parse();
+    remove(TEST_PATH);
+
+    if (nfailed > 0)
+    {
+        printf("%d file cache tests failed.\n", nfailed);
+        return 1;
+    }
+
+    printf("All file cache tests passed.\n");
+
+    return 0;
+}
@@ -0,0 +1,258 @@
+/* Fuzz target for every entry point that takes an untrusted buffer. With clang
+   and libFuzzer:
+
+       clang -g -O1 -fsanitize=fuzzer,address,undefined fuzz.c -o fuzz
+       ./fuzz corpus_dir
+
+   Without libFuzzer, FUZZ_STANDALONE builds a main that runs the given files
+   and then random mutations of them:
+
+       cc -g -O1 -DFUZZ_STANDALONE -fsanitize=address,undefined fuzz.c -o fuzz
+       ./fuzz [-n iterations] beethoven1.mid mario_test.mid ... */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Broken input is the point here, so keep the error messages quiet. */
+static int ignore_log(const char* format, ...)
+{
+    (void)format;
+    return 0;
+}
+
+#define SMR_PRINTF ignore_log
+#define SMR_IMPLEMENTATION
+#include "simple_midi_read.h"
+
+static const uint32_t fuzz_flags[] =
+{
+    0,
+    SMRE_read_single_pass,
+    SMRE_read_borrow_payloads,
+    SMRE_read_columns | SMRE_read_timeline,
+    SMRE_read_columns | SMRE_read_column_ticks | SMRE_read_borrow_payloads
+};
+
+static void count_event(const struct smr_event* event, uint16_t track_index, void* user)
+{
+    (void)event;
+    (void)track_index;
+    *(uint64_t*)user += 1;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    uint8_t* buffer;
+    struct smr_midi_data midi_data;
+    struct smr_read_options options;
+    struct smr_stream stream;
+    struct smr_probe_info probe_info;
+    uint64_t required_size;
+    uint64_t nevents;
+    uint32_t i;
+
+    /* An exact size copy, so that reading one byte too far is caught. */
+    buffer = (uint8_t*)malloc(size ? size : 1);
+    memcpy(buffer, data, size);
+
+    memset(&options, 0, sizeof(options));
+    for (i = 0; i < sizeof(fuzz_flags) / sizeof(fuzz_flags[0]); ++i)
+    {
+        options.flags = fuzz_flags[i];
+        if (smr_read_byte_array_checked(buffer, size, &options, &midi_data) == 0)
+        {
+            smr_free_midi_data(&midi_data);
+        }
+    }
+
+    /* Filtered, so that dropped events get skipped rather than read. */
+    options.flags = SMRE_read_columns | SMRE_read_timeline;
+    options.keep_types = SMRE_keep_notes | SMRE_keep_tempo;
+    options.keep_channels = 0x00FF;
+    if (smr_read_byte_array_checked(buffer, size, &options, &midi_data) == 0)
+    {
+        smr_free_midi_data(&midi_data);
+    }
+
+    options.flags = 0;
+    if (smr_required_size(buffer, size, &options, &required_size) == 0 && required_size < ((uint64_t)1 << 30))
+    {
+        uint64_t* mem;
+
+        mem = (uint64_t*)malloc(required_size + 8);
+        smr_read_byte_array_into(buffer, size, &options, (uint8_t*)mem, required_size, &midi_data);
+        free(mem);
+    }
+
+    /* Both the whole walk and the one that stops after tick 0. */
+    smr_probe(buffer, size, SMRE_probe_all, &probe_info);
+    smr_probe(buffer, size, SMRE_probe_track_names | SMRE_probe_tempo, &probe_info);
+
+    if (smr_read_header(buffer, size, &midi_data) == 0)
+    {
+        uint16_t track_index;
+
+        for (track_index = 0; track_index < midi_data.ntracks; ++track_index)
+        {
+            struct smr_track_cursor cursor;
+            struct smr_event event;
+
+            if (smr_track_cursor_init(&cursor, buffer, size, track_index) != 0)
+            {
+                break;
+            }
+
+            while (!smr_track_cursor_done(&cursor) && smr_track_cursor_next(&cursor, &event) == 0)
+            {
+            }
+        }
+    }
+
+    /* Fed in two uneven pieces, to go through the stream's buffering. */
+    nevents = 0;
+    smr_stream_init(&stream, count_event, &nevents, NULL);
+    if (smr_stream_feed(&stream, buffer, size / 3) == 0)
+    {
+        smr_stream_feed(&stream, buffer + size / 3, size - size / 3);
+    }
+    smr_stream_finish(&stream);
+    smr_stream_free(&stream);
+
+    free(buffer);
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+static uint32_t random_state = 1;
+
+static uint32_t next_random(void)
+{
+    random_state = random_state * 1664525u + 1013904223u;
+    return random_state >> 8;
+}
+
+/* Damages a copy of seed the way broken files tend to be damaged. Returns the
+   new size. */
+static size_t mutate(const uint8_t* seed, size_t seed_size, uint8_t* out, size_t max_size)
+{
+    static const uint8_t interesting[] = { 0x00, 0x7F, 0x80, 0xF0, 0xF7, 0xFF };
+    size_t size;
+    uint32_t nmutations;
+    uint32_t i;
+
+    size = seed_size < max_size ? seed_size : max_size;
+    memcpy(out, seed, size);
+
+    nmutations = 1 + next_random() % 4;
+    for (i = 0; i < nmutations && size > 0; ++i)
+    {
+        size_t at;
+
+        at = next_random() % size;
+        switch (next_random() % 5)
+        {
+            case 0:
+                out[at] ^= (uint8_t)(1 << (next_random() % 8));
+                break;
+            case 1:
+                out[at] = interesting[next_random() % sizeof(interesting)];
+                break;
+            case 2:
+                /* Lengths are where it hurts: a chunk or VLQ length byte. */
+                out[at] = (uint8_t)next_random();
+                break;
+            case 3:
+                size = at;
+                break;
+            case 4:
+                if (size < max_size)
+                {
+                    memmove(out + at + 1, out + at, size - at);
+                    out[at] = interesting[next_random() % sizeof(interesting)];
+                    size += 1;
+                }
+                break;
+        }
+    }
+
+    return size;
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t* seeds[64];
+    size_t seed_sizes[64];
+    int nseeds;
+    long iterations;
+    uint8_t* mutated;
+    size_t max_size;
+    long i;
+    int arg;
+
+    iterations = 100000;
+    nseeds = 0;
+    max_size = 0;
+    for (arg = 1; arg < argc; ++arg)
+    {
+        FILE* file_ptr;
+        long int file_size;
+
+        if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc)
+        {
+            iterations = atol(argv[++arg]);
+            continue;
+        }
+
+        file_ptr = fopen(argv[arg], "rb");
+        if (!file_ptr || nseeds == 64)
+        {
+            fprintf(stderr, "Unable to use %s.\n", argv[arg]);
+            return 1;
+        }
+
+        fseek(file_ptr, 0L, SEEK_END);
+        file_size = ftell(file_ptr);
+        fseek(file_ptr, 0L, SEEK_SET);
+        seeds[nseeds] = (uint8_t*)malloc(file_size > 0 ? file_size : 1);
+        seed_sizes[nseeds] = fread(seeds[nseeds], 1, file_size > 0 ? file_size : 0, file_ptr);
+        fclose(file_ptr);
+
+        LLVMFuzzerTestOneInput(seeds[nseeds], seed_sizes[nseeds]);
+        if (seed_sizes[nseeds] > max_size)
+        {
+            max_size = seed_sizes[nseeds];
+        }
+        nseeds += 1;
+    }
+
+    if (nseeds == 0)
+    {
+        fprintf(stderr, "Usage: %s [-n iterations] file.mid ...\n", argv[0]);
+        return 1;
+    }
+
+    mutated = (uint8_t*)malloc(max_size + 64);
+    for (i = 0; i < iterations; ++i)
+    {
+        int seed_index;
+        size_t size;
+
+        seed_index = (int)(next_random() % nseeds);
+        size = mutate(seeds[seed_index], seed_sizes[seed_index], mutated, max_size + 64);
+        LLVMFuzzerTestOneInput(mutated, size);
+    }
+
+    printf("%ld inputs ran clean.\n", iterations + nseeds);
+
+    free(mutated);
+    for (i = 0; i < nseeds; ++i)
+    {
+        free(seeds[i]);
+    }
+
+    return 0;
+}
+
+#endif /* FUZZ_STANDALONE */
@@ -0,0 +1,387 @@
+/* Plays each file through smr_player_update and smr_player_render, one audio
+   block at a time, and checks what comes out: the song's channel events in
+   timeline order, each at the sample its tick falls on. A seek or stop has to
+   take back everything queued before it, and a loop has to jump back to its
+   start once it gets to its end.
+
+       cc -O2 player_test.c -o player_test
+       ./player_test [file.mid ...] */
+#define SMR_IMPLEMENTATION
+#include "simple_midi_read.h"
+
+#define SAMPLE_RATE 48000.0
+#define BLOCK_FRAMES 512
+#define MAX_BLOCK_EVENTS 4096
+
+static const char* default_files[] =
+{
+    "beethoven1.mid",
+    "beethoven2.mid",
+    "beethoven3.mid",
+    "c_scale.mid",
+    "mario_test.mid"
+};
+
+/* Walks the timeline the way the player should, from anchor_tick heard at
+   anchor_sample on. */
+struct expected_playback
+{
+    const struct smr_player* player;
+    uint64_t entry_index;
+    uint64_t anchor_sample;
+    uint64_t anchor_tick;
+};
+
+static int is_channel_entry(const struct smr_midi_data* midi_data, const struct smr_timeline_entry* entry)
+{
+    return midi_data->tracks[entry->track_index].events[entry->event_index].event_type < SMRE_sysex_single;
+}
+
+/* Moves expected to the first channel event at or after entry_index. Returns 1
+   when the song has none left. */
+static int find_channel_entry(struct expected_playback* expected)
+{
+    const struct smr_timeline* timeline;
+
+    timeline = &expected->player->seek_index.timeline;
+    while (expected->entry_index < timeline->nentries && !is_channel_entry(expected->player->midi_data, timeline->entries + expected->entry_index))
+    {
+        expected->entry_index += 1;
+    }
+
+    return expected->entry_index >= timeline->nentries;
+}
+
+/* First timeline entry at or after tick. */
+static uint64_t find_tick(const struct smr_timeline* timeline, uint64_t tick)
+{
+    uint64_t entry_index;
+
+    entry_index = 0;
+    while (entry_index < timeline->nentries && timeline->entries[entry_index].tick < tick)
+    {
+        entry_index += 1;
+    }
+
+    return entry_index;
+}
+
+/* Same rounding as the player. */
+static uint64_t get_expected_sample(const struct expected_playback* expected, uint64_t tick)
+{
+    double samples;
+
+    samples = (smr_tick_to_seconds(&expected->player->tempo_map, tick) - smr_tick_to_seconds(&expected->player->tempo_map, expected->anchor_tick)) * SAMPLE_RATE;
+    return expected->anchor_sample + (samples > 0.0 ? (uint64_t)(samples + 0.5) : 0);
+}
+
+/* Checks that event, rendered in the block starting at block_start, is the
+   next one expected and comes at its sample. */
+static int check_song_event(struct expected_playback* expected, const struct smr_player_event* event, uint64_t block_start)
+{
+    const struct smr_timeline_entry* entry;
+
+    if (find_channel_entry(expected) != 0)
+    {
+        printf("Event past the end of the song.\n");
+        return 1;
+    }
+
+    entry = expected->player->seek_index.timeline.entries + expected->entry_index;
+    if (event->track_index != entry->track_index || event->event_index != entry->event_index)
+    {
+        printf("Got event %u of track %hu, expected event %u of track %hu.\n", event->event_index, event->track_index, entry->event_index, entry->track_index);
+        return 1;
+    }
+
+    if (block_start + event->offset != get_expected_sample(expected, entry->tick) || event->offset >= BLOCK_FRAMES)
+    {
+        printf("Event %u of track %hu at sample %lu, expected %lu.\n", event->event_index, event->track_index, (unsigned long)(block_start + event->offset), (unsigned long)get_expected_sample(expected, entry->tick));
+        return 1;
+    }
+
+    expected->entry_index += 1;
+
+    return 0;
+}
+
+/* Updates and renders one block. Returns the events and where the block
+   started. */
+static uint32_t play_block(struct smr_player* player, struct smr_player_event* events, uint64_t* block_start)
+{
+    smr_player_update(player);
+    *block_start = player->audio_sample;
+
+    return smr_player_render(player, BLOCK_FRAMES, events, MAX_BLOCK_EVENTS);
+}
+
+/* The whole song, start to end. Nothing can be late, so every event keeps its
+   exact sample. */
+static int test_playback(const struct smr_midi_data* midi_data, struct smr_player_event* events)
+{
+    struct smr_player player;
+    struct smr_player_stats stats;
+    struct expected_playback expected;
+    uint64_t block_start;
+    uint32_t nevents, i;
+    int failed;
+
+    if (smr_player_init(&player, midi_data, SAMPLE_RATE, 0.05, 8192, NULL) != 0 || smr_player_start(&player) != 0)
+    {
+        return 1;
+    }
+
+    expected.player = &player;
+    expected.entry_index = 0;
+    expected.anchor_sample = player.lookahead_samples;
+    expected.anchor_tick = 0;
+
+    failed = 0;
+    while (!failed && find_channel_entry(&expected) == 0)
+    {
+        nevents = play_block(&player, events, &block_start);
+        for (i = 0; i < nevents && !failed; ++i)
+        {
+            if (events[i].event_index != SMR_PLAYER_GENERATED)
+            {
+                failed = check_song_event(&expected, events + i, block_start);
+            }
+        }
+    }
+
+    smr_player_get_stats(&player, &stats);
+    if (!failed && (stats.late.max != 0 || stats.dropped != 0))
+    {
+        printf("Plain playback had late or dropped events.\n");
+        failed = 1;
+    }
+
+    smr_player_free(&player);
+
+    return failed;
+}
+
+/* Seeks to the middle and then stops, each with a second of the song queued.
+   Nothing queued before either may come out afterwards. */
+static int test_seek_and_stop(const struct smr_midi_data* midi_data, struct smr_player_event* events)
+{
+    struct smr_player player;
+    struct smr_player_stats stats;
+    struct expected_playback expected;
+    const struct smr_timeline* timeline;
+    uint64_t block_start;
+    uint64_t seek_tick;
+    uint64_t dropped;
+    uint32_t nevents, i;
+    int block, failed, seen;
+
+    if (smr_player_init(&player, midi_data, SAMPLE_RATE, 1.0, 8192, NULL) != 0 || smr_player_start(&player) != 0)
+    {
+        return 1;
+    }
+
+    timeline = &player.seek_index.timeline;
+    expected.player = &player;
+    expected.entry_index = timeline->nentries / 2;
+    if (find_channel_entry(&expected) != 0)
+    {
+        smr_player_free(&player);
+        return 0;
+    }
+
+    /* Play up to a tenth of a second before the seek target, so that the ring
+       holds what comes right up to it. */
+    seek_tick = timeline->entries[expected.entry_index].tick;
+    block_start = 0;
+    while (player.audio_sample + player.lookahead_samples < smr_tick_to_seconds(&player.tempo_map, seek_tick) * SAMPLE_RATE - SAMPLE_RATE / 10)
+    {
+        play_block(&player, events, &block_start);
+    }
+
+    smr_player_update(&player);
+    smr_player_get_stats(&player, &stats);
+    dropped = stats.dropped;
+    if (smr_player_seek(&player, seek_tick) != 0)
+    {
+        smr_player_free(&player);
+        return 1;
+    }
+
+    expected.entry_index = find_tick(timeline, seek_tick);
+    expected.anchor_sample = player.audio_sample + player.lookahead_samples;
+    expected.anchor_tick = seek_tick;
+
+    /* A second and a half covers the lookahead, and the first events after the
+       seek target. */
+    failed = 0;
+    seen = 0;
+    for (block = 0; block < (int)(1.5 * SAMPLE_RATE / BLOCK_FRAMES) && !failed; ++block)
+    {
+        nevents = play_block(&player, events, &block_start);
+        for (i = 0; i < nevents && !failed; ++i)
+        {
+            if (events[i].event_index != SMR_PLAYER_GENERATED)
+            {
+                failed = check_song_event(&expected, events + i, block_start);
+                seen = 1;
+            }
+        }
+    }
+
+    smr_player_get_stats(&player, &stats);
+    if (!failed && (!seen || stats.dropped <= dropped))
+    {
+        printf("Seek didn't drop the queued events or play on from the target.\n");
+        failed = 1;
+    }
+
+    dropped = stats.dropped;
+    smr_player_stop(&player);
+    for (block = 0; block < (int)(1.5 * SAMPLE_RATE / BLOCK_FRAMES) && !failed; ++block)
+    {
+        nevents = play_block(&player, events, &block_start);
+        for (i = 0; i < nevents && !failed; ++i)
+        {
+            if (events[i].event_index != SMR_PLAYER_GENERATED)
+            {
+                printf("Event %u of track %hu played after stopping.\n", events[i].event_index, events[i].track_index);
+                failed = 1;
+            }
+        }
+    }
+
+    smr_player_get_stats(&player, &stats);
+    if (!failed && stats.dropped <= dropped && find_channel_entry(&expected) == 0)
+    {
+        printf("Stop didn't drop the queued events.\n");
+        failed = 1;
+    }
+
+    smr_player_free(&player);
+
+    return failed;
+}
+
+/* Loops from a quarter to half way through the song and plays it around
+   twice. Each time the end comes up, the song has to pick up at the loop start
+   right at the loop end's sample. */
+static int test_loop(const struct smr_midi_data* midi_data, struct smr_player_event* events)
+{
+    struct smr_player player;
+    struct expected_playback expected;
+    const struct smr_timeline* timeline;
+    uint64_t block_start;
+    uint64_t loop_start, loop_end;
+    uint32_t nevents, i;
+    int nloops, failed;
+
+    if (smr_player_init(&player, midi_data, SAMPLE_RATE, 0.05, 8192, NULL) != 0)
+    {
+        return 1;
+    }
+
+    timeline = &player.seek_index.timeline;
+    loop_start = timeline->nentries > 0 ? timeline->entries[timeline->nentries / 4].tick : 0;
+    loop_end = timeline->nentries > 0 ? timeline->entries[timeline->nentries / 2].tick : 0;
+    if (loop_end <= loop_start)
+    {
+        smr_player_free(&player);
+        return 0;
+    }
+
+    if (smr_player_set_loop(&player, loop_start, loop_end) != 0 || smr_player_start(&player) != 0)
+    {
+        smr_player_free(&player);
+        return 1;
+    }
+
+    expected.player = &player;
+    expected.entry_index = 0;
+    expected.anchor_sample = player.lookahead_samples;
+    expected.anchor_tick = 0;
+
+    failed = 0;
+    nloops = 0;
+    while (!failed && nloops < 2)
+    {
+        nevents = play_block(&player, events, &block_start);
+        for (i = 0; i < nevents && !failed; ++i)
+        {
+            if (events[i].event_index == SMR_PLAYER_GENERATED)
+            {
+                continue;
+            }
+
+            if (find_channel_entry(&expected) != 0 || timeline->entries[expected.entry_index].tick >= loop_end)
+            {
+                expected.anchor_sample = get_expected_sample(&expected, loop_end);
+                expected.anchor_tick = loop_start;
+                expected.entry_index = find_tick(timeline, loop_start);
+                nloops += 1;
+            }
+
+            failed = check_song_event(&expected, events + i, block_start);
+        }
+    }
+
+    smr_player_free(&player);
+
+    return failed;
+}
+
+static int test_file(const char* filename, struct smr_player_event* events)
+{
+    struct smr_midi_data midi_data;
+    int failed;
+
+    if (smr_read_file(filename, &midi_data) != 0)
+    {
+        return 1;
+    }
+
+    failed = test_playback(&midi_data, events) || test_seek_and_stop(&midi_data, events) || test_loop(&midi_data, events);
+    if (!failed)
+    {
+        printf("%s: played, sought, stopped and looped.\n", filename);
+    }
+
+    smr_free_midi_data(&midi_data);
+
+    return failed;
+}
+
+int main(int argc, char** argv)
+{
+    struct smr_player_event* events;
+    int nfailed;
+    int i;
+
+    events = (struct smr_player_event*)malloc(MAX_BLOCK_EVENTS * sizeof(struct smr_player_event));
+    nfailed = 0;
+    if (argc > 1)
+    {
+        for (i = 1; i < argc; ++i)
+        {
+            nfailed += test_file(argv[i], events);
+        }
+    }
+    else
+    {
+        for (i = 0; i < (int)(sizeof(default_files) / sizeof(default_files[0])); ++i)
+        {
+            nfailed += test_file(default_files[i], events);
+        }
+    }
+
+    free(events);
+
+    if (nfailed > 0)
+    {
+        printf("%d files failed to play.\n", nfailed);
+        return 1;
+    }
+
+    printf("All files played.\n");
+
+    return 0;
+}
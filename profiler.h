@@ -0,0 +1,44 @@
+#ifndef SMR_PROFILER_H
+#define SMR_PROFILER_H
+
+#include <stdio.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+/* Seconds from a monotonic, high resolution clock. Only differences between
+   two calls mean anything. */
+static double profiler_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+#else
+    struct timespec now;
+
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+#endif
+}
+
+#define START_TIMER()\
+{\
+    double start_time;\
+    start_time = profiler_now();
+
+#define END_TIMER()\
+    printf("Time spent: %f milliseconds.\n", (profiler_now() - start_time) * 1000.0);\
+}
+
+#endif /* SMR_PROFILER_H */
@@ -0,0 +1,407 @@
+/* Parses each file, writes it back out with smr_write_byte_array and parses
+   that again, which has to give the same events. The write from columns has
+   to match the write from tracks byte for byte, and writing the second parse
+   has to give the same bytes again. Splitting the file by channel has to write
+   the same whether or not it was merged into format 0 first. Caches of a two
+   pass, a columns and timeline and a single pass parse have to load back into
+   the same data. Empty payloads have to survive a single pass parse whose
+   block moves when it shrinks.
+
+       cc -O2 roundtrip_test.c -o roundtrip_test
+       ./roundtrip_test [file.mid ...] */
+#define SMR_IMPLEMENTATION
+#include "simple_midi_read.h"
+
+static const char* default_files[] =
+{
+    "beethoven1.mid",
+    "beethoven2.mid",
+    "beethoven3.mid",
+    "c_scale.mid",
+    "mario_test.mid"
+};
+
+/* Realloc that never grows or shrinks in place, and scribbles over the old
+   block, so pointers left behind in it show up. */
+static void* moving_alloc(size_t size, void* user)
+{
+    (void)user;
+    return malloc(size);
+}
+
+static void* moving_realloc(void* ptr, size_t old_size, size_t new_size, void* user)
+{
+    void* moved;
+
+    (void)user;
+    moved = malloc(new_size);
+    if (moved)
+    {
+        memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+        memset(ptr, 0xDD, old_size);
+        free(ptr);
+    }
+
+    return moved;
+}
+
+static void moving_free(void* ptr, size_t size, void* user)
+{
+    (void)size;
+    (void)user;
+    free(ptr);
+}
+
+static const struct smr_allocator moving_allocator = { moving_alloc, moving_realloc, moving_free, NULL };
+
+static int compare_events(const struct smr_event* a, const struct smr_event* b)
+{
+    if (a->delta_time != b->delta_time || a->event_type != b->event_type)
+    {
+        return 1;
+    }
+
+    switch (a->event_type)
+    {
+        case SMRE_midi_program_change:
+        case SMRE_midi_channel_pressure:
+            return a->program != b->program || a->channel != b->channel;
+        case SMRE_midi_pitch_bend:
+            return a->pitch_bend != b->pitch_bend || a->channel != b->channel;
+        case SMRE_midi_note_off:
+        case SMRE_midi_note_on:
+        case SMRE_midi_polyphonic_pressure:
+        case SMRE_midi_controller:
+            return a->note != b->note || a->velocity != b->velocity || a->channel != b->channel;
+        case SMRE_meta_sequence_number:
+            return a->ss_ss != b->ss_ss;
+        case SMRE_meta_midi_channel_prefix:
+            return a->cc != b->cc;
+        case SMRE_meta_midi_port:
+            return a->pp != b->pp;
+        case SMRE_meta_end_of_track:
+            return 0;
+        case SMRE_meta_tempo:
+            return a->tempo != b->tempo;
+        case SMRE_meta_smpte_offset:
+            return a->hr != b->hr || a->mn != b->mn || a->se != b->se || a->fr != b->fr || a->ff != b->ff;
+        case SMRE_meta_time_signature:
+            return a->nn != b->nn || a->dd != b->dd || a->cc != b->cc || a->bb != b->bb;
+        case SMRE_meta_key_signature:
+            return a->sf != b->sf || a->mi != b->mi;
+        case SMRE_sysex_single:
+        case SMRE_sysex_escape:
+        case SMRE_meta_text:
+        case SMRE_meta_copyright:
+        case SMRE_meta_track_name:
+        case SMRE_meta_instrument_name:
+        case SMRE_meta_lyric:
+        case SMRE_meta_marker:
+        case SMRE_meta_cue_point:
+        case SMRE_meta_program_name:
+        case SMRE_meta_device_name:
+        case SMRE_meta_sequencer_specific_event:
+            return a->length != b->length || memcmp(a->data, b->data, a->length) != 0;
+        default:
+            /* Unknown meta events come back empty. */
+            return b->length != 0;
+    }
+}
+
+static int compare_midi_data(const struct smr_midi_data* a, const struct smr_midi_data* b)
+{
+    uint16_t track_index;
+
+    if (a->format != b->format || a->ntracks != b->ntracks || a->time_type != b->time_type || a->tickdiv != b->tickdiv)
+    {
+        printf("Headers differ.\n");
+        return 1;
+    }
+
+    for (track_index = 0; track_index < a->ntracks; ++track_index)
+    {
+        uint32_t event_index;
+
+        if (a->tracks[track_index].nevents != b->tracks[track_index].nevents)
+        {
+            printf("Track %hu has %u events, then %u.\n", track_index, a->tracks[track_index].nevents, b->tracks[track_index].nevents);
+            return 1;
+        }
+
+        for (event_index = 0; event_index < a->tracks[track_index].nevents; ++event_index)
+        {
+            if (compare_events(a->tracks[track_index].events + event_index, b->tracks[track_index].events + event_index) != 0)
+            {
+                printf("Event %u of track %hu differs.\n", event_index, track_index);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Writes midi_data into a newly allocated buffer. */
+static uint8_t* write_midi_data(const struct smr_midi_data* midi_data, uint64_t* size)
+{
+    uint8_t* buffer;
+    uint64_t written;
+
+    if (smr_write_required_size(midi_data, size) != 0)
+    {
+        return NULL;
+    }
+
+    /* Exact size, so that writing one byte too far is caught by a checker. */
+    buffer = (uint8_t*)malloc(*size);
+    if (smr_write_byte_array(midi_data, buffer, *size, &written) != 0 || written != *size)
+    {
+        printf("Write didn't give the required size.\n");
+        free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/* Writes midi_data as a cache and loads it back, which has to write the same
+   bytes as midi_data (written) and have the same timeline. */
+static int test_cache(const struct smr_midi_data* midi_data, const uint8_t* written, uint64_t written_size)
+{
+    struct smr_midi_data loaded;
+    uint8_t* cache;
+    uint8_t* loaded_written;
+    uint64_t cache_size, cache_written, loaded_size;
+    int failed;
+
+    if (smr_cache_required_size(midi_data, &cache_size) != 0)
+    {
+        return 1;
+    }
+
+    /* malloc gives the 8 byte alignment smr_load_cache needs. */
+    cache = (uint8_t*)malloc(cache_size);
+    if (smr_write_cache(midi_data, cache, cache_size, &cache_written) != 0 || cache_written != cache_size || smr_load_cache(cache, cache_size, &loaded) != 0)
+    {
+        printf("Cache didn't write or load.\n");
+        free(cache);
+        return 1;
+    }
+
+    failed = 0;
+    loaded_written = write_midi_data(&loaded, &loaded_size);
+    if (!loaded_written || loaded_size != written_size || memcmp(loaded_written, written, written_size) != 0)
+    {
+        printf("Cache writes differ.\n");
+        failed = 1;
+    }
+    else if (loaded.timeline.nentries != midi_data->timeline.nentries ||
+             (loaded.timeline.nentries > 0 && memcmp(loaded.timeline.entries, midi_data->timeline.entries, loaded.timeline.nentries * sizeof(struct smr_timeline_entry)) != 0))
+    {
+        printf("Cache timelines differ.\n");
+        failed = 1;
+    }
+
+    free(loaded_written);
+    smr_free_midi_data(&loaded);
+    free(cache);
+
+    return failed;
+}
+
+static int test_file(const char* filename)
+{
+    struct smr_midi_data original, columns, reread, format0, split, format0_split, columns_timeline, single_pass;
+    struct smr_read_options options;
+    uint8_t* written;
+    uint8_t* columns_written;
+    uint8_t* rewritten;
+    uint8_t* split_written;
+    uint8_t* format0_split_written;
+    uint64_t written_size, columns_size, rewritten_size, split_size, format0_split_size;
+    int failed;
+
+    if (smr_read_file(filename, &original) != 0)
+    {
+        return 1;
+    }
+
+    failed = 1;
+    columns_written = NULL;
+    rewritten = NULL;
+    split_written = NULL;
+    format0_split_written = NULL;
+    memset(&reread, 0, sizeof(reread));
+    memset(&columns, 0, sizeof(columns));
+    memset(&format0, 0, sizeof(format0));
+    memset(&split, 0, sizeof(split));
+    memset(&format0_split, 0, sizeof(format0_split));
+    memset(&columns_timeline, 0, sizeof(columns_timeline));
+    memset(&single_pass, 0, sizeof(single_pass));
+
+    written = write_midi_data(&original, &written_size);
+    if (!written || smr_read_byte_array_checked(written, written_size, NULL, &reread) != 0 || compare_midi_data(&original, &reread) != 0)
+    {
+        goto done;
+    }
+
+    if (test_cache(&original, written, written_size) != 0)
+    {
+        goto done;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.flags = SMRE_read_columns | SMRE_read_timeline;
+    if (smr_read_file_mapped(filename, &options, &columns_timeline) != 0 || test_cache(&columns_timeline, written, written_size) != 0)
+    {
+        goto done;
+    }
+
+    options.flags = SMRE_read_single_pass;
+    options.allocator = &moving_allocator;
+    if (smr_read_file_mapped(filename, &options, &single_pass) != 0 || compare_midi_data(&original, &single_pass) != 0 || test_cache(&single_pass, written, written_size) != 0)
+    {
+        goto done;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.flags = SMRE_read_column_ticks;
+    if (smr_events_to_columns(&original, &options, &columns) != 0)
+    {
+        goto done;
+    }
+
+    columns_written = write_midi_data(&columns, &columns_size);
+    rewritten = write_midi_data(&reread, &rewritten_size);
+    if (!columns_written || !rewritten || columns_size != written_size || rewritten_size != written_size || memcmp(columns_written, written, written_size) != 0 || memcmp(rewritten, written, written_size) != 0)
+    {
+        printf("Writes differ.\n");
+        goto done;
+    }
+
+    if (smr_to_format0(&original, NULL, &format0) != 0 || smr_split_by_channel(&original, NULL, &split) != 0 || smr_split_by_channel(&format0, NULL, &format0_split) != 0)
+    {
+        goto done;
+    }
+
+    split_written = write_midi_data(&split, &split_size);
+    format0_split_written = write_midi_data(&format0_split, &format0_split_size);
+    if (!split_written || !format0_split_written || split_size != format0_split_size || memcmp(split_written, format0_split_written, split_size) != 0)
+    {
+        printf("Splits differ.\n");
+        goto done;
+    }
+
+    printf("%s: %hu tracks, written as %lu bytes, split into %hu.\n", filename, original.ntracks, (unsigned long)written_size, split.ntracks);
+    failed = 0;
+
+done:
+    free(written);
+    free(columns_written);
+    free(rewritten);
+    free(split_written);
+    free(format0_split_written);
+    smr_free_midi_data(&original);
+    smr_free_midi_data(&reread);
+    smr_free_midi_data(&columns);
+    smr_free_midi_data(&format0);
+    smr_free_midi_data(&split);
+    smr_free_midi_data(&format0_split);
+    smr_free_midi_data(&columns_timeline);
+    smr_free_midi_data(&single_pass);
+
+    return failed;
+}
+
+/* Empty SysEx, text and sequencer specific payloads still point into the
+   block, and have to follow it when a single pass parse shrinks it. */
+static int test_empty_payloads(void)
+{
+    static const uint8_t midi[] =
+    {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 96,
+        'M', 'T', 'r', 'k', 0, 0, 0, 26,
+        0x00, 0xF0, 0x00,
+        0x00, 0xFF, 0x01, 0x00,
+        0x00, 0xFF, 0x7F, 0x00,
+        0x00, 0x90, 0x3C, 0x40,
+        0x60, 0x80, 0x3C, 0x00,
+        0x00, 0xF7, 0x00,
+        0x00, 0xFF, 0x2F, 0x00
+    };
+    struct smr_midi_data midi_data;
+    struct smr_read_options options;
+    uint8_t buffer[sizeof(midi)];
+    uint32_t event_index;
+    int failed;
+
+    memcpy(buffer, midi, sizeof(midi));
+    memset(&options, 0, sizeof(options));
+    options.flags = SMRE_read_single_pass;
+    options.allocator = &moving_allocator;
+    if (smr_read_byte_array_checked(buffer, sizeof(buffer), &options, &midi_data) != 0)
+    {
+        printf("Empty payloads didn't parse.\n");
+        return 1;
+    }
+
+    failed = 0;
+    for (event_index = 0; event_index < midi_data.tracks[0].nevents; ++event_index)
+    {
+        const struct smr_event* event;
+
+        event = midi_data.tracks[0].events + event_index;
+        switch (event->event_type)
+        {
+            case SMRE_sysex_single:
+            case SMRE_sysex_escape:
+            case SMRE_meta_text:
+            case SMRE_meta_sequencer_specific_event:
+                if (event->data < midi_data._mem_block || event->data > midi_data._mem_block + midi_data._mem_size ||
+                    (event->event_type == SMRE_meta_text && event->text[0] != '\0'))
+                {
+                    printf("Empty payload of event %u was left in the old block.\n", event_index);
+                    failed = 1;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    smr_free_midi_data(&midi_data);
+
+    return failed;
+}
+
+int main(int argc, char** argv)
+{
+    int nfailed;
+    int i;
+
+    nfailed = test_empty_payloads();
+    if (argc > 1)
+    {
+        for (i = 1; i < argc; ++i)
+        {
+            nfailed += test_file(argv[i]);
+        }
+    }
+    else
+    {
+        for (i = 0; i < (int)(sizeof(default_files) / sizeof(default_files[0])); ++i)
+        {
+            nfailed += test_file(default_files[i]);
+        }
+    }
+
+    if (nfailed > 0)
+    {
+        printf("%d files failed the round trip.\n", nfailed);
+        return 1;
+    }
+
+    printf("All files made the round trip.\n");
+
+    return 0;
+}
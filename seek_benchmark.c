@@ -0,0 +1,89 @@
+#include "profiler.h"
+
+#define SMR_IMPLEMENTATION
+#include "simple_midi_read.h"
+
+#define NUM_SEEKS 10000
+
+/* Seeking without an index: replay every event from the start. */
+static void seek_by_replay(const struct smr_midi_data* midi_data, const struct smr_timeline* timeline, uint64_t tick, struct smr_channel_state* channels)
+{
+    uint64_t entry_index;
+
+    reset_channel_states(channels);
+    for (entry_index = 0; entry_index < timeline->nentries && timeline->entries[entry_index].tick < tick; ++entry_index)
+    {
+        apply_channel_event(midi_data, timeline->entries + entry_index, channels);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* filename;
+    struct smr_midi_data midi_data;
+    struct smr_seek_index seek_index;
+    struct smr_channel_state channels[16];
+    struct smr_channel_state replayed[16];
+    uint64_t* seek_ticks;
+    uint64_t last_tick;
+    double start;
+    double build_time, index_time, replay_time;
+    int i;
+
+    filename = argc > 1 ? argv[1] : "beethoven3.mid";
+    if (smr_read_file(filename, &midi_data) != 0)
+    {
+        return 1;
+    }
+
+    start = profiler_now();
+    if (smr_build_seek_index(&midi_data, 0, NULL, &seek_index) != 0)
+    {
+        return 1;
+    }
+    build_time = profiler_now() - start;
+
+    last_tick = seek_index.timeline.nentries > 0 ? seek_index.timeline.entries[seek_index.timeline.nentries - 1].tick : 0;
+    seek_ticks = (uint64_t*)malloc(NUM_SEEKS * sizeof(uint64_t));
+    srand(1);
+    for (i = 0; i < NUM_SEEKS; ++i)
+    {
+        seek_ticks[i] = (uint64_t)rand() % (last_tick + 1);
+    }
+
+    start = profiler_now();
+    for (i = 0; i < NUM_SEEKS; ++i)
+    {
+        smr_seek(&seek_index, &midi_data, seek_ticks[i], channels, NULL, NULL);
+    }
+    index_time = profiler_now() - start;
+
+    start = profiler_now();
+    for (i = 0; i < NUM_SEEKS; ++i)
+    {
+        seek_by_replay(&midi_data, &seek_index.timeline, seek_ticks[i], channels);
+    }
+    replay_time = profiler_now() - start;
+
+    /* Outside the timed loops, both ways have to end up in the same state. */
+    for (i = 0; i < NUM_SEEKS; ++i)
+    {
+        smr_seek(&seek_index, &midi_data, seek_ticks[i], channels, NULL, NULL);
+        seek_by_replay(&midi_data, &seek_index.timeline, seek_ticks[i], replayed);
+        if (memcmp(channels, replayed, sizeof(channels)) != 0)
+        {
+            printf("Seek to tick %lu differs from replaying up to it.\n", (unsigned long)seek_ticks[i]);
+            return 1;
+        }
+    }
+
+    printf("%s: %lu events, %u snapshots, built in %.3f ms.\n", filename, (unsigned long)seek_index.timeline.nentries, seek_index.nsnapshots, build_time * 1000.0);
+    printf("Random seek with index:  %.3f us.\n", index_time * 1000000.0 / NUM_SEEKS);
+    printf("Random seek by replay:   %.3f us.\n", replay_time * 1000000.0 / NUM_SEEKS);
+
+    free(seek_ticks);
+    smr_free_seek_index(&seek_index);
+    smr_free_midi_data(&midi_data);
+
+    return 0;
+}
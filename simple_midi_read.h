@@ -86,6 +86,179 @@ struct smr_track_data
     struct smr_event* events;
 };
 
+/* Column (structure of arrays) form of a track, from SMRE_read_columns. Channel
+   events take 7 bytes instead of a 24 byte smr_event. */
+struct smr_track_columns
+{
+    uint32_t nevents;
+    /* Delta times, or absolute ticks when absolute_ticks is set. */
+    uint32_t* times;
+    /* Status byte: event type plus channel for MIDI events, 0xF0 or 0xF7 for
+       SysEx events, 0xFF for meta events. */
+    uint8_t* status;
+    /* MIDI events only: first data byte in the low byte, second data byte (if
+       any) in the high byte, as they appear in the file. */
+    uint16_t* data;
+    /* SysEx and meta events are kept in full, in order, in other, and
+       other_index holds the index of each among all nevents. Their delta_time
+       matches times. */
+    uint32_t nother;
+    uint32_t* other_index;
+    struct smr_event* other;
+    uint8_t absolute_ticks;
+};
+
+/* Custom allocator for _mem_block and any temporary memory a parse needs.
+   realloc_func can be NULL, then blocks are just never shrunk in place. */
+struct smr_allocator
+{
+    void* (*alloc_func)(size_t size, void* user);
+    void* (*realloc_func)(void* ptr, size_t old_size, size_t new_size, void* user);
+    void (*free_func)(void* ptr, size_t size, void* user);
+    void* user;
+};
+
+/* One event of a merged timeline, found at tracks[track_index].events[event_index]
+   (or at event_index of columns[track_index]). */
+struct smr_timeline_entry
+{
+    uint64_t tick;
+    uint32_t event_index;
+    uint16_t track_index;
+};
+
+/* Every event of every track in order of absolute tick. Events on the same
+   tick keep track order, then file order within their track. */
+struct smr_timeline
+{
+    uint64_t nentries;
+    struct smr_timeline_entry* entries;
+    uint64_t _mem_size;
+    /* How entries get freed, all NULL when they live in an smr_midi_data. */
+    struct smr_allocator _allocator;
+};
+
+/* Stretch of ticks at a constant rate, from tick up to the next segment. */
+struct smr_tempo_segment
+{
+    uint64_t tick;
+    /* Time at tick. */
+    double microseconds;
+    double microseconds_per_tick;
+    /* Microseconds per quarter note, 0 in timecode files. */
+    uint32_t tempo;
+};
+
+/* Tick to time conversion for a whole file, segments sorted by tick. */
+struct smr_tempo_map
+{
+    uint32_t nsegments;
+    struct smr_tempo_segment* segments;
+    uint64_t _mem_size;
+    struct smr_allocator _allocator;
+};
+
+/* What a player needs to know about one MIDI channel to start mid-file. */
+struct smr_channel_state
+{
+    uint8_t program;
+    uint8_t pressure;
+    /* 14 bit value, 0x2000 is centered. */
+    uint16_t pitch_bend;
+    uint8_t controllers[128];
+};
+
+/* Channel state with every timeline entry before entry_index applied, all of
+   which are before tick (snapshots never split a tick). */
+struct smr_seek_snapshot
+{
+    uint64_t tick;
+    uint64_t entry_index;
+    struct smr_channel_state channels[16];
+};
+
+struct smr_seek_index
+{
+    /* The timeline the snapshots refer to. */
+    struct smr_timeline timeline;
+    uint32_t nsnapshots;
+    struct smr_seek_snapshot* snapshots;
+    /* ntracks per snapshot: how many events of each track it includes. */
+    uint32_t* track_positions;
+    uint16_t ntracks;
+    uint64_t _mem_size;
+    struct smr_allocator _allocator;
+};
+
+/* Notes paired up from note on and note off events, one array per field. */
+struct smr_note_spans
+{
+    uint64_t nspans;
+    /* Absolute ticks. */
+    uint64_t* starts;
+    uint32_t* durations;
+    uint16_t* tracks;
+    uint8_t* notes;
+    uint8_t* velocities;
+    uint8_t* channels;
+    uint64_t _mem_size;
+    struct smr_allocator _allocator;
+};
+
+/* Statistics of a whole file, from smr_compute_stats. Notes are note ons with
+   a nonzero velocity. */
+struct smr_stats
+{
+    uint64_t nnotes;
+    /* Notes by pitch, by pitch class (C is 0) and by velocity. */
+    uint64_t pitches[128];
+    uint64_t pitch_classes[12];
+    uint64_t velocities[128];
+    /* Notes per channel, and per second of the whole file. */
+    uint64_t channel_notes[16];
+    double channel_density[16];
+    /* Controller events by controller number, over all channels. */
+    uint64_t controllers[128];
+    /* Most notes sounding at once over all tracks, and the first tick with that
+       many. Notes pair up as in smr_extract_note_spans. */
+    uint32_t max_polyphony;
+    uint64_t max_polyphony_tick;
+    /* End of the longest track. */
+    uint64_t duration_ticks;
+    double duration_seconds;
+};
+
+/* Steps of a smr_apply_transforms pipeline. */
+enum smr_transform_type
+{
+    /* Moves the notes of note ons, offs and polyphonic pressure by semitones,
+       clamped to 0 to 127. */
+    SMRE_transform_transpose,
+    /* Looks note on velocities up in velocities. Velocities stay at least 1,
+       so that no note on turns into a note off. */
+    SMRE_transform_velocity,
+    /* Moves channel events from each channel c to channel_map[c]. */
+    SMRE_transform_channel_remap,
+    /* Rounds note ons and offs to the nearest multiple of grid ticks, but not
+       past the end of their track. */
+    SMRE_transform_quantize
+};
+
+struct smr_transform
+{
+    enum smr_transform_type type;
+    /* The channels (a bit each) the step applies to, as they are at this point
+       of the pipeline. 0 applies it to all of them. */
+    uint16_t channels;
+    union
+    {
+        int32_t semitones;
+        uint8_t velocities[128];
+        uint8_t channel_map[16];
+        uint32_t grid;
+    };
+};
+
 struct smr_midi_data
 {
     uint16_t format;
@@ -101,7 +274,366 @@ struct smr_midi_data
         };
     };
     struct smr_track_data* tracks;
+    /* Set instead of tracks when parsed with SMRE_read_columns. */
+    struct smr_track_columns* columns;
+    /* Only filled in when parsed with SMRE_read_timeline. */
+    struct smr_timeline timeline;
     uint8_t* _mem_block;
+    uint64_t _mem_size;
+    /* How _mem_block gets freed, all NULL when the memory belongs to the user. */
+    struct smr_allocator _allocator;
+};
+
+enum smr_read_flags
+{
+    /* Decode every event exactly once, into a block sized from a guess at the
+       event count that grows when needed, instead of measuring the file in a
+       first pass. Payloads take a scratch buffer of about the size of the
+       file while parsing, and up to an eighth of _mem_block can be left
+       unused. */
+    SMRE_read_single_pass = 1 << 0,
+    /* Measure and decode tracks concurrently, each into its own precomputed
+       slice of _mem_block. The result is identical to the serial parse. Only
+       available when SMR_ENABLE_THREADS is defined along with
+       SMR_IMPLEMENTATION (requires pthreads), otherwise the parse stays
+       serial. Takes precedence over SMRE_read_single_pass. */
+    SMRE_read_parallel = 1 << 1,
+    /* Point text, SysEx message and sequencer specific data straight into the
+       buffer being parsed instead of copying them into _mem_block, so the
+       parsed data only takes memory per event. The buffer must stay alive and
+       unchanged for as long as the smr_midi_data is used. Borrowed text is NOT
+       null terminated, length is the only terminator. Can't be used with
+       smr_read_file or smr_read_file_mapped, which release their buffer. */
+    SMRE_read_borrow_payloads = 1 << 2,
+    /* Fill columns (see smr_track_columns) instead of tracks. Always parses
+       in two passes, SMRE_read_single_pass and SMRE_read_parallel are
+       ignored. */
+    SMRE_read_columns = 1 << 3,
+    /* With SMRE_read_columns, store absolute ticks in times instead of delta
+       times. */
+    SMRE_read_column_ticks = 1 << 4,
+    /* Also build the merged timeline (see smr_build_timeline) into
+       _mem_block. Always parses in two passes, like SMRE_read_columns. */
+    SMRE_read_timeline = 1 << 5
+};
+
+/* Event types for smr_read_options.keep_types. */
+enum smr_keep_types
+{
+    SMRE_keep_note_off = 1 << 0,
+    SMRE_keep_note_on = 1 << 1,
+    SMRE_keep_polyphonic_pressure = 1 << 2,
+    SMRE_keep_controller = 1 << 3,
+    SMRE_keep_program_change = 1 << 4,
+    SMRE_keep_channel_pressure = 1 << 5,
+    SMRE_keep_pitch_bend = 1 << 6,
+    SMRE_keep_sysex = 1 << 7,
+    /* SMRE_meta_text through SMRE_meta_device_name. */
+    SMRE_keep_text = 1 << 8,
+    SMRE_keep_tempo = 1 << 9,
+    SMRE_keep_time_signature = 1 << 10,
+    SMRE_keep_key_signature = 1 << 11,
+    /* Every other meta event, known or not. */
+    SMRE_keep_other_meta = 1 << 12,
+
+    SMRE_keep_notes = SMRE_keep_note_off | SMRE_keep_note_on
+};
+
+struct smr_read_options
+{
+    uint32_t flags;
+    /* Thread count for SMRE_read_parallel, including the calling thread.
+       0 uses one thread per online CPU. */
+    uint32_t nthreads;
+    /* NULL uses SMR_MALLOC, SMR_REALLOC and SMR_FREE. */
+    const struct smr_allocator* allocator;
+    /* Only events of these types (SMRE_keep_* bits) are kept, 0 keeps all of
+       them. The rest are stepped over without being decoded or taking any
+       memory, and their delta times are added to the next kept event's.
+       End of track events are always kept, so tracks keep their length. */
+    uint32_t keep_types;
+    /* Only MIDI events on the channels whose bits are set are kept, 0 keeps
+       all of them. */
+    uint16_t keep_channels;
+};
+
+enum smr_batch_error
+{
+    SMRE_batch_ok,
+    SMRE_batch_open_failed,
+    SMRE_batch_read_failed,
+    /* Not enough memory to load the file. Running out while parsing it is
+       reported as a parse failure. */
+    SMRE_batch_out_of_memory,
+    SMRE_batch_parse_failed
+};
+
+/* One file of a batch: read from path, or when path is NULL parsed straight
+   from buffer, which must stay alive until the batch is done (and for as long
+   as the result if payloads are borrowed). */
+struct smr_batch_item
+{
+    const char* path;
+    uint8_t* buffer;
+    uint64_t buffer_len;
+};
+
+struct smr_batch_options
+{
+    /* Parse options for every file, can be NULL. SMRE_read_parallel is
+       ignored, each file is parsed by one worker. SMRE_read_borrow_payloads
+       only applies to buffer items. */
+    const struct smr_read_options* read_options;
+    /* Worker threads, 0 for one per CPU. Without SMR_ENABLE_THREADS the
+       batch runs on the calling thread only. */
+    uint32_t nthreads;
+    /* Called on a worker thread as each file finishes, in no particular
+       order. midi_data is only filled in when error is SMRE_batch_ok, and
+       is freed right after the call unless a results array was given. */
+    void (*callback)(uint64_t item_index, enum smr_batch_error error, struct smr_midi_data* midi_data, void* user);
+    void* user;
+};
+
+struct smr_batch_stats
+{
+    uint64_t nfiles;
+    uint64_t nfailed;
+    /* Size of all files, failed ones included. */
+    uint64_t nbytes;
+    uint64_t nevents;
+    double seconds;
+    double files_per_second;
+    double megabytes_per_second;
+};
+
+enum smr_stream_state
+{
+    SMRE_stream_header,
+    SMRE_stream_track_header,
+    SMRE_stream_delta_time,
+    SMRE_stream_status,
+    SMRE_stream_meta_type,
+    SMRE_stream_length,
+    SMRE_stream_body,
+    SMRE_stream_done,
+    SMRE_stream_error
+};
+
+/* Push parser: bytes are fed in chunks of any size, and every event is handed
+   to callback as soon as its last byte arrives. Only the event that straddles
+   two chunks is ever buffered, so memory stays at the size of the largest
+   event. Payload pointers (text, message, data) are borrowed from the fed
+   chunk or that buffer, are only valid during the callback, and text is not
+   null terminated. */
+struct smr_stream
+{
+    /* Filled in once the file header has been fed. tracks stays NULL. */
+    struct smr_midi_data header;
+    uint16_t track_index;
+
+    void (*callback)(const struct smr_event* event, uint16_t track_index, void* user);
+    void* user;
+    struct smr_allocator allocator;
+
+    enum smr_stream_state state;
+    uint32_t track_remaining;
+    uint32_t body_remaining;
+    uint32_t vlq_value;
+    uint8_t vlq_length;
+    uint8_t last_status_byte;
+
+    /* Start of the current event or chunk header, when it straddles chunks. */
+    uint8_t* buffer;
+    uint32_t buffer_length;
+    uint32_t buffer_capacity;
+};
+
+#define SMR_HISTOGRAM_BUCKETS 32
+
+/* Power of two buckets: counts[0] holds zeros, counts[i] values from 2^(i-1)
+   up to 2^i, and the last bucket everything above. */
+struct smr_histogram
+{
+    uint64_t counts[SMR_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+struct smr_player_stats
+{
+    /* Samples from an event going into the ring to it being due. Values near
+       0 mean smr_player_update runs too rarely for the lookahead. */
+    struct smr_histogram lead;
+    /* Samples an event was late by when rendered, 0 when on time. */
+    struct smr_histogram late;
+    /* Microseconds by which the time between two renders missed the length
+       of the first one's block. Stays empty without a monotonic clock. */
+    struct smr_histogram callback_jitter;
+    uint64_t rendered;
+    /* Events taken back by a stop or seek before they were due. */
+    uint64_t dropped;
+    /* Times smr_player_update found the ring full. */
+    uint64_t ring_full;
+};
+
+/* A MIDI message due at a sample of the playback clock. */
+struct smr_player_event
+{
+    uint64_t sample;
+    /* Frame of the rendered block to play it at, set by smr_player_render. */
+    uint32_t offset;
+    /* Where it is in the MIDI data, or SMR_PLAYER_GENERATED for the messages
+       the player makes itself: silencing notes on stop, seek and loop, and
+       bringing channels to their state at the new position. */
+    uint32_t event_index;
+    uint16_t track_index;
+    uint8_t bytes[3];
+    /* 2 or 3. */
+    uint8_t size;
+    uint32_t generation;
+};
+
+/* Wait-free single producer (control thread), single consumer (audio thread)
+   queue. head and tail sit on their own cache lines. */
+struct smr_player_ring
+{
+    uint64_t head;
+    uint8_t head_padding[56];
+    uint64_t tail;
+    uint8_t tail_padding[56];
+    uint64_t mask;
+    struct smr_player_event* slots;
+};
+
+/* Plays MIDI data in real time. A control thread resolves tempo and timing
+   and feeds the ring ahead of time, the audio thread drains it one block at a
+   time without locks or allocations. Transport calls belong on the control
+   thread too. Needs GCC or Clang atomics when the two are different threads. */
+struct smr_player
+{
+    const struct smr_midi_data* midi_data;
+    struct smr_seek_index seek_index;
+    struct smr_tempo_map tempo_map;
+    double sample_rate;
+    uint64_t lookahead_samples;
+    struct smr_allocator allocator;
+
+    /* Control thread only. The song is at anchor_seconds at anchor_sample of
+       the playback clock; the previous anchor still holds for the samples
+       before a loop point that has been queued but not reached. */
+    uint8_t playing;
+    uint64_t next_entry;
+    uint64_t anchor_sample;
+    double anchor_seconds;
+    uint64_t previous_anchor_sample;
+    double previous_anchor_seconds;
+    uint64_t stopped_tick;
+    uint64_t loop_start;
+    uint64_t loop_end;
+    /* Messages still to queue before any more of the song: notes off and a
+       channel state to restore, from sample pending_sample on. */
+    uint64_t pending_sample;
+    uint32_t pending_notes_off;
+    uint32_t pending_restore;
+    struct smr_channel_state restore_channels[16];
+
+    /* Shared. */
+    uint32_t generation;
+    uint64_t audio_sample;
+    struct smr_player_ring ring;
+
+    /* Audio thread only. */
+    double last_render_time;
+    uint32_t last_nframes;
+
+    struct smr_player_stats stats;
+};
+
+/* Defined by the implementation, only used through smr_file_cache_*. */
+struct smr_file_cache;
+
+struct smr_file_cache_stats
+{
+    /* Acquires that found the file cached, or waited for another thread to
+       parse it successfully. */
+    uint64_t hits;
+    /* Acquires that parsed the file, or waited for a parse that failed. */
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t nentries;
+    /* Memory of every parsed file still alive, held or not. */
+    uint64_t bytes;
+};
+
+/* Fields smr_probe looks for. The header (format, ntracks and timing) always
+   comes with them. */
+enum smr_probe_fields
+{
+    SMRE_probe_copyright = 1 << 0,
+    SMRE_probe_track_names = 1 << 1,
+    SMRE_probe_tempo = 1 << 2,
+    SMRE_probe_time_signature = 1 << 3,
+    SMRE_probe_note_count = 1 << 4,
+    SMRE_probe_duration = 1 << 5,
+    SMRE_probe_all = 0x3F
+};
+
+/* Tracks smr_probe keeps the name of. */
+#define SMR_PROBE_MAX_TRACK_NAMES 32
+
+/* Text borrowed from the buffer smr_probe read, not null terminated. text is
+   NULL if there was none. */
+struct smr_probe_text
+{
+    const char* text;
+    uint32_t length;
+};
+
+/* Summary of a MIDI file, from smr_probe. Fields that weren't asked for or
+   weren't in the file keep their defaults. */
+struct smr_probe_info
+{
+    uint16_t format;
+    uint16_t ntracks;
+    enum smr_time_type time_type;
+    union
+    {
+        uint16_t tickdiv;
+        struct
+        {
+            uint8_t fps;
+            uint8_t subframe_resolution;
+        };
+    };
+    /* SMRE_probe_* fields found. The note count and duration always are once
+       asked for. */
+    uint32_t found;
+    /* First copyright notice at tick 0 of any track. */
+    struct smr_probe_text copyright;
+    /* First name at tick 0 of each track, for the first
+       SMR_PROBE_MAX_TRACK_NAMES tracks. */
+    struct smr_probe_text track_names[SMR_PROBE_MAX_TRACK_NAMES];
+    /* Tempo and time signature in effect at tick 0: 500000 (120 BPM) and 4/4
+       unless an event there says otherwise. */
+    uint32_t tempo;
+    uint8_t nn, dd, cc, bb;
+    /* Note ons with a nonzero velocity. */
+    uint64_t nnotes;
+    /* Tick at the end of the longest track, and the same in seconds going by
+       the tempo map smr_build_tempo_map would make. duration_seconds is -1 in
+       the odd file with tempo events in more than 16 tracks. */
+    uint64_t duration_ticks;
+    double duration_seconds;
+};
+
+/* Walks the events of one track straight from the file bytes, decoding them
+   on demand, without allocating anything. Payload pointers (text, message,
+   data) are borrowed from the buffer, and text is not null terminated. */
+struct smr_track_cursor
+{
+    uint8_t* read;
+    uint8_t* end;
+    uint8_t last_status_byte;
 };
 
 static int32_t compare_next_string(uint8_t** buffer_read, const char* to_compare);
@@ -112,9 +644,200 @@ static uint32_t get_next_uint32(uint8_t** buffer_read);
 static uint32_t get_next_variable_length_int(uint8_t** buffer_read);
 
 int smr_read_byte_array(uint8_t* buffer, struct smr_midi_data* file_data);
+/* Same as smr_read_byte_array, options can be NULL for the defaults. */
+int smr_read_byte_array_ex(uint8_t* buffer, const struct smr_read_options* options, struct smr_midi_data* file_data);
+/* Same as smr_read_byte_array_ex, but never reads outside the buffer_len bytes
+   of buffer, however broken or hostile they are. Use this for files that
+   can't be trusted. */
+int smr_read_byte_array_checked(uint8_t* buffer, uint64_t buffer_len, const struct smr_read_options* options, struct smr_midi_data* file_data);
+/* Exact number of bytes smr_read_byte_array_into needs to parse buffer with
+   these options, which depends on them: SMRE_read_borrow_payloads,
+   SMRE_read_columns and SMRE_read_timeline change it, and so do keep_types and
+   keep_channels, as dropped events take no memory. SMRE_read_single_pass and
+   SMRE_read_parallel don't. Size the memory with the same options it is
+   parsed with. */
+int smr_required_size(uint8_t* buffer, uint64_t buffer_len, const struct smr_read_options* options, uint64_t* required_size);
+/* Parses into mem (8 byte aligned, at least smr_required_size bytes) instead
+   of allocating, so no heap allocation happens at all. The smr_midi_data
+   lives in mem, which must outlive it; smr_free_midi_data does nothing. */
+int smr_read_byte_array_into(uint8_t* buffer, uint64_t buffer_len, const struct smr_read_options* options, uint8_t* mem, uint64_t mem_size, struct smr_midi_data* file_data);
 int smr_read_file(const char* filename, struct smr_midi_data* file_data);
+/* Parses the file straight out of a read-only memory mapping, instead of
+   copying it into a heap buffer first. Uses MapViewOfFile on Windows, and
+   falls back to reading the file on systems without either. options can be
+   NULL for the defaults. */
+int smr_read_file_mapped(const char* filename, const struct smr_read_options* options, struct smr_midi_data* file_data);
 int smr_free_midi_data(struct smr_midi_data* midi_data);
 
+/* Parses nitems files on a pool of worker threads, which steal work from each
+   other once their own share runs out. Nothing is printed, every file gets an
+   error code instead. results and errors can be NULL, otherwise they have
+   nitems entries. Successful results must be freed with smr_free_midi_data,
+   failed ones are zeroed. options and stats can be NULL. Returns 1 if any
+   file failed. */
+int smr_read_batch(const struct smr_batch_item* items, uint64_t nitems, const struct smr_batch_options* options, struct smr_midi_data* results, enum smr_batch_error* errors, struct smr_batch_stats* stats);
+/* Converts between tracks and columns. dst gets its own _mem_block, payloads
+   included, so it doesn't depend on src, and is freed with smr_free_midi_data.
+   options can be NULL; only its allocator and SMRE_read_column_ticks are used. */
+int smr_events_to_columns(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst);
+int smr_columns_to_events(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst);
+/* Merges every track of src into the one track of a format 0 dst, in order of
+   tick and, on the same tick, in track order. Split does the reverse: dst gets
+   a conductor track with every SysEx and meta event, then one track per
+   channel that has events, in order of channel. Either way end of track events
+   are replaced by one at the end of the longest track, and dst gets a
+   _mem_block of its own like above, sized from counting the events first.
+   src needs tracks (not columns); its timeline gives the order if it was
+   parsed with one, and one is built for the purpose otherwise. options can be
+   NULL; only its allocator is used. */
+int smr_to_format0(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst);
+int smr_split_by_channel(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst);
+/* Merges the events of all tracks (or columns) into one timeline, which only
+   refers to file_data. allocator can be NULL for the default one. */
+int smr_build_timeline(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_timeline* timeline);
+int smr_free_timeline(struct smr_timeline* timeline);
+/* Collects the tempo events of all tracks (or columns) into a tempo map. The
+   tempo is 120 BPM until the first tempo event. In timecode files ticks are a
+   fixed fraction of a second (fps 29 meaning 29.97 drop frame) and tempo
+   events don't change that. allocator can be NULL for the default one. */
+int smr_build_tempo_map(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_tempo_map* tempo_map);
+int smr_free_tempo_map(struct smr_tempo_map* tempo_map);
+/* O(log n) in the number of segments. */
+double smr_tick_to_seconds(const struct smr_tempo_map* tempo_map, uint64_t tick);
+/* Last tick at or before seconds. */
+uint64_t smr_seconds_to_tick(const struct smr_tempo_map* tempo_map, double seconds);
+/* Converts count ticks at once. Sorted ticks take O(1) per tick. */
+void smr_ticks_to_seconds(const struct smr_tempo_map* tempo_map, const uint64_t* ticks, double* seconds, uint64_t count);
+/* Snapshots channel state every interval timeline entries (0 for 1024), so a
+   seek only replays events since the last snapshot. Channels start at program
+   0, pitch bend centered, volume 100, pan 64, expression 127 and every other
+   controller 0. allocator can be NULL for the default one. */
+int smr_build_seek_index(const struct smr_midi_data* file_data, uint32_t interval, const struct smr_allocator* allocator, struct smr_seek_index* seek_index);
+int smr_free_seek_index(struct smr_seek_index* seek_index);
+/* Gives the state of all 16 channels once every event before tick has
+   happened. track_positions (ntracks, can be NULL) gets the index of each
+   track's first event at or after tick, and entry_index (can be NULL) the
+   timeline entry to resume at. */
+int smr_seek(const struct smr_seek_index* seek_index, const struct smr_midi_data* file_data, uint64_t tick, struct smr_channel_state* channels, uint32_t* track_positions, uint64_t* entry_index);
+/* Pairs every note on with the note off (or note on with velocity 0) of the
+   same track, channel and note. Overlapping notes of the same pitch are closed
+   first in, first out, and notes left on end with their track. Spans come in
+   track order, then in order of start. allocator can be NULL for the default
+   one. */
+int smr_extract_note_spans(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_note_spans* spans);
+int smr_free_note_spans(struct smr_note_spans* spans);
+/* Computes every smr_stats field in one pass over the tracks (or columns),
+   plus a merge of the note ons and offs for the polyphony. Fastest on columns,
+   whose status bytes are sorted out 16 at a time where SSE2 is available.
+   allocator can be NULL for the default one. */
+int smr_compute_stats(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_stats* stats);
+/* Runs the ntransforms steps of transforms over every event of file_data in
+   place, in one pass: the steps are first folded into a lookup table per
+   status byte. Only quantizing allocates, and only moves events when they
+   change order. The timeline is rebuilt then, but other things built from
+   file_data before (tempo maps, seek indices) go stale. allocator can be NULL
+   for the default one. */
+int smr_apply_transforms(struct smr_midi_data* file_data, const struct smr_transform* transforms, uint32_t ntransforms, const struct smr_allocator* allocator);
+/* Fills velocities for SMRE_transform_velocity with every velocity times
+   scale. */
+int smr_make_velocity_scale(double scale, uint8_t* velocities);
+
+/* Reads only the file header: format, ntracks and timing. tracks stays NULL. */
+int smr_read_header(uint8_t* buffer, uint64_t buffer_len, struct smr_midi_data* file_data);
+/* Points cursor at the first event of track track_index in buffer, which must
+   stay alive while the cursor is used. */
+int smr_track_cursor_init(struct smr_track_cursor* cursor, uint8_t* buffer, uint64_t buffer_len, uint16_t track_index);
+/* Nonzero once every event of the track has been read or skipped. */
+int smr_track_cursor_done(const struct smr_track_cursor* cursor);
+/* Decodes the next event into event. */
+int smr_track_cursor_next(struct smr_track_cursor* cursor, struct smr_event* event);
+/* Steps over the next event without decoding its data or payload, only giving
+   back its delta time and type. Either can be NULL. */
+int smr_track_cursor_skip(struct smr_track_cursor* cursor, uint32_t* delta_time, enum smr_event_type* event_type);
+/* Summarizes the file in buffer without parsing it or allocating anything,
+   decoding only what fields (SMRE_probe_* bits) need. Without the note count
+   or duration, only the events at tick 0 are looked at, and tracks that can't
+   hold anything still wanted are never touched. Never reads outside the
+   buffer_len bytes of buffer. */
+int smr_probe(uint8_t* buffer, uint64_t buffer_len, uint32_t fields, struct smr_probe_info* info);
+
+/* allocator can be NULL for the default one. */
+void smr_stream_init(struct smr_stream* stream, void (*callback)(const struct smr_event* event, uint16_t track_index, void* user), void* user, const struct smr_allocator* allocator);
+int smr_stream_feed(struct smr_stream* stream, const uint8_t* bytes, uint64_t num_bytes);
+/* Fails if the stream ended before the last track did. */
+int smr_stream_finish(struct smr_stream* stream);
+void smr_stream_free(struct smr_stream* stream);
+
+/* Exact size of the standard MIDI file smr_write_byte_array makes of
+   midi_data, from its tracks or its columns. */
+int smr_write_required_size(const struct smr_midi_data* midi_data, uint64_t* required_size);
+/* Encodes midi_data as a standard MIDI file into buffer, which needs at least
+   smr_write_required_size bytes. MIDI events use running status wherever it
+   saves a byte. Fixed size meta events get their standard length, and the data
+   of unknown meta events isn't kept by the parser, so they are written empty.
+   written can be NULL. */
+int smr_write_byte_array(const struct smr_midi_data* midi_data, uint8_t* buffer, uint64_t buffer_len, uint64_t* written);
+int smr_write_file(const char* filename, const struct smr_midi_data* midi_data);
+
+/* A cache is a parse saved as is: a header checked on load (version, the
+   writer's pointer size, struct sizes and byte order, and a hash) followed by
+   _mem_block with every pointer turned into an offset, and where those
+   pointers are. Loading one only hashes it and puts the pointers back, which
+   costs nothing like a parse. The hash catches damaged caches, not forged
+   ones, so only load caches you wrote. Everything midi_data refers to has to
+   live in its _mem_block, so parses with SMRE_read_borrow_payloads can't be
+   cached. */
+int smr_cache_required_size(const struct smr_midi_data* midi_data, uint64_t* required_size);
+int smr_write_cache(const struct smr_midi_data* midi_data, uint8_t* buffer, uint64_t buffer_len, uint64_t* written);
+int smr_write_cache_file(const char* filename, const struct smr_midi_data* midi_data);
+/* Loads the cache in place: buffer (8 byte aligned) becomes the smr_midi_data's
+   memory and must outlive it; smr_free_midi_data does nothing. */
+int smr_load_cache(uint8_t* buffer, uint64_t buffer_len, struct smr_midi_data* midi_data);
+/* Maps the cache copy on write where mmap is available, so only the pages
+   holding pointers ever get copied. Free with smr_free_midi_data. */
+int smr_load_cache_file(const char* filename, struct smr_midi_data* midi_data);
+
+/* Shared cache of parsed files, keyed by path and checked against the file's
+   modification time and size. Every acquire of a cached file hands out the
+   same read-only smr_midi_data, and concurrent acquires of a file that isn't
+   cached yet wait for a single parse. Files nobody holds stay cached until
+   their memory goes over byte_budget, least recently used first. Safe to use
+   from any number of threads with SMR_ENABLE_THREADS. options (can be NULL)
+   are used for every parse, except SMRE_read_borrow_payloads. */
+int smr_file_cache_create(uint64_t byte_budget, const struct smr_read_options* options, struct smr_file_cache** cache);
+/* Every acquired file has to be released first. */
+int smr_file_cache_free(struct smr_file_cache* cache);
+int smr_file_cache_acquire(struct smr_file_cache* cache, const char* filename, const struct smr_midi_data** midi_data);
+int smr_file_cache_release(struct smr_file_cache* cache, const struct smr_midi_data* midi_data);
+void smr_file_cache_get_stats(struct smr_file_cache* cache, struct smr_file_cache_stats* stats);
+
+/* midi_data must outlive the player. Events are queued lookahead_seconds
+   ahead of the audio clock, into a ring of ring_capacity events (rounded up to
+   a power of two). A start, seek or loop queues a few hundred messages at
+   once to reset the channels, so 1024 or more keeps them from being late.
+   allocator can be NULL for the default one. */
+int smr_player_init(struct smr_player* player, const struct smr_midi_data* midi_data, double sample_rate, double lookahead_seconds, uint32_t ring_capacity, const struct smr_allocator* allocator);
+int smr_player_free(struct smr_player* player);
+/* Control thread. Playing starts lookahead_seconds after the audio clock's
+   current sample, so that nothing is late. */
+int smr_player_start(struct smr_player* player);
+int smr_player_stop(struct smr_player* player);
+int smr_player_seek(struct smr_player* player, uint64_t tick);
+/* Plays ticks [start, end) over and over once the position gets there. end 0
+   turns looping off. */
+int smr_player_set_loop(struct smr_player* player, uint64_t start, uint64_t end);
+/* Control thread, every few milliseconds: queues everything due before the
+   lookahead runs out. */
+int smr_player_update(struct smr_player* player);
+/* Control thread: the tick being heard right now. */
+uint64_t smr_player_get_tick(const struct smr_player* player);
+/* Audio thread, once per block: advances the clock by nframes and gives the
+   events due within the block, at most max_events (the rest come next
+   block, late). Returns how many. */
+uint32_t smr_player_render(struct smr_player* player, uint32_t nframes, struct smr_player_event* events, uint32_t max_events);
+/* Any thread. */
+void smr_player_get_stats(const struct smr_player* player, struct smr_player_stats* stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -125,6 +848,86 @@ int smr_free_midi_data(struct smr_midi_data* midi_data);
 
 #ifdef SMR_IMPLEMENTATION
 
+/* Define all three to replace the allocator used by default. */
+#ifndef SMR_MALLOC
+#define SMR_MALLOC(size) malloc(size)
+#define SMR_REALLOC(ptr, size) realloc(ptr, size)
+#define SMR_FREE(ptr) free(ptr)
+#endif
+
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SMR_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SMR_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef SMR_ENABLE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+
+#ifndef SMR_MAX_THREADS
+#define SMR_MAX_THREADS 64
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define SMR_THREAD_LOCAL __thread
+#define SMR_ATOMIC_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define SMR_ATOMIC_STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+#define SMR_ATOMIC_CAS(ptr, expected, desired) __atomic_compare_exchange_n(ptr, expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+/* For counters with a single writer that anyone may read. */
+#define SMR_ATOMIC_LOAD_RELAXED(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define SMR_ATOMIC_STORE_RELAXED(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+#else
+/* Only used single threaded, SMR_ENABLE_THREADS needs GCC or Clang. */
+#if defined(_MSC_VER)
+#define SMR_THREAD_LOCAL __declspec(thread)
+#else
+#define SMR_THREAD_LOCAL
+#endif
+#define SMR_ATOMIC_LOAD(ptr) (*(ptr))
+#define SMR_ATOMIC_STORE(ptr, value) (*(ptr) = (value))
+#define SMR_ATOMIC_CAS(ptr, expected, desired) (*(ptr) == *(expected) ? (*(ptr) = (desired), 1) : (*(expected) = *(ptr), 0))
+#define SMR_ATOMIC_LOAD_RELAXED(ptr) (*(ptr))
+#define SMR_ATOMIC_STORE_RELAXED(ptr, value) (*(ptr) = (value))
+#endif
+
+/* Every error message goes through SMR_LOG, define SMR_PRINTF to send them
+   somewhere other than stdout. Threads running a batch turn them off. */
+#ifndef SMR_PRINTF
+#define SMR_PRINTF printf
+#endif
+
+static SMR_THREAD_LOCAL int smr_log_muted;
+
+#define SMR_LOG(...) do { if (!smr_log_muted) { SMR_PRINTF(__VA_ARGS__); } } while (0)
+
+/* Big endian fields are loaded a word at a time and byte swapped. */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SMR_LOAD_BE16(bytes, value) do { memcpy(&(value), (bytes), 2); (value) = __builtin_bswap16(value); } while (0)
+#define SMR_LOAD_BE32(bytes, value) do { memcpy(&(value), (bytes), 4); (value) = __builtin_bswap32(value); } while (0)
+#define SMR_STORE_BE32(bytes, value) do { uint32_t swapped_ = __builtin_bswap32(value); memcpy((bytes), &swapped_, 4); } while (0)
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SMR_LOAD_BE16(bytes, value) memcpy(&(value), (bytes), 2)
+#define SMR_LOAD_BE32(bytes, value) memcpy(&(value), (bytes), 4)
+#define SMR_STORE_BE32(bytes, value) do { uint32_t unswapped_ = (value); memcpy((bytes), &unswapped_, 4); } while (0)
+#else
+#define SMR_LOAD_BE16(bytes, value) ((value) = (uint16_t)((bytes)[1] | (bytes)[0] << 8))
+#define SMR_LOAD_BE32(bytes, value) ((value) = (uint32_t)(bytes)[3] | ((uint32_t)(bytes)[2] << 8) | ((uint32_t)(bytes)[1] << 16) | ((uint32_t)(bytes)[0] << 24))
+#define SMR_STORE_BE32(bytes, value) do { uint32_t word_ = (value); (bytes)[0] = (uint8_t)(word_ >> 24); (bytes)[1] = (uint8_t)(word_ >> 16); (bytes)[2] = (uint8_t)(word_ >> 8); (bytes)[3] = (uint8_t)word_; } while (0)
+#endif
+
 static int32_t compare_next_string(uint8_t** buffer_read, const char* to_compare)
 {
     int32_t result;
@@ -162,18 +965,17 @@ static uint16_t get_next_uint16(uint8_t** buffer_read)
 {
     uint16_t result;
 
-    result = (*buffer_read)[1] | (*buffer_read)[0] << 8;
+    SMR_LOAD_BE16(*buffer_read, result);
     *buffer_read += 2;
 
     return result;
 }
 
-/* TODO: Check for endian-ness */
 static uint32_t get_next_uint32(uint8_t** buffer_read)
 {
     uint32_t result;
 
-    result = (*buffer_read)[3] | ((*buffer_read)[2] << 8) | ((*buffer_read)[1] << 16) | ((*buffer_read)[0] << 24);
+    SMR_LOAD_BE32(*buffer_read, result);
     *buffer_read += 4;
 
     return result;
@@ -182,437 +984,8058 @@ static uint32_t get_next_uint32(uint8_t** buffer_read)
 static uint32_t get_next_variable_length_int(uint8_t** buffer_read)
 {
     uint32_t result;
+    int32_t count;
+
+    /* Most delta times are a single byte. */
+    if (!(**buffer_read & 0x80))
+    {
+        return *(*buffer_read)++;
+    }
 
+    /* A variable length int is never longer than 4 bytes, so stop there even
+       if the file says otherwise. */
     result = 0;
-    do
+    for (count = 0; count < 3; ++count)
     {
         result = (result << 7) | (uint32_t)(**buffer_read & 0x7F);
-    } while (*(*buffer_read)++ & 0x80);
+        if (!(*(*buffer_read)++ & 0x80))
+        {
+            return result;
+        }
+    }
 
-    return result;
+    return (result << 7) | (uint32_t)(*(*buffer_read)++ & 0x7F);
 }
 
-int smr_read_byte_array(uint8_t* buffer, struct smr_midi_data* file_data)
+/* Steps over a variable length int (at most 4 bytes, like
+   get_next_variable_length_int reads) that must end before end. */
+static int skip_variable_length_int_checked(const uint8_t** read, const uint8_t* end)
 {
-    uint8_t* buffer_read;
-    uint32_t header_chunklen;
     int32_t i;
-    uint64_t total_alloc_size;
-    uint8_t* mem_ptr;
-    struct smr_event* event_ptr;
-    uint8_t* all_tracks_start;
-    uint32_t total_num_events;
 
-    buffer_read = buffer;
+    for (i = 0; i < 3 && *read < end && (**read & 0x80); ++i)
+    {
+        *read += 1;
+    }
+
+    if (*read >= end)
+    {
+        return 1;
+    }
+
+    *read += 1;
+
+    return 0;
+}
+
+static int read_midi_header(uint8_t** buffer_read, struct smr_midi_data* file_data)
+{
+    uint32_t header_chunklen;
 
     /* Check for header identifier */
-    if (compare_next_string(&buffer_read, "MThd") != 0)
+    if (compare_next_string(buffer_read, "MThd") != 0)
     {
         /* TODO: Separate out verbose logging? */
-        printf("MIDI file is missing header identifier 'MThd'.\n");
+        SMR_LOG("MIDI file is missing header identifier 'MThd'.\n");
         return 1;
     }
 
     /* Check for header chunklen */
     /* TODO: Standardize when buffer pointer advances. */
-    header_chunklen = get_next_uint32(&buffer_read);
+    header_chunklen = get_next_uint32(buffer_read);
     if (header_chunklen != 6)
     {
-        printf("This MIDI file is not compatible with this version of the parser.\n");
+        SMR_LOG("This MIDI file is not compatible with this version of the parser.\n");
         /* VERBOSE */
-        printf("Expected header chunk size of 6 bytes, got %d.\n", header_chunklen);
+        SMR_LOG("Expected header chunk size of 6 bytes, got %d.\n", header_chunklen);
         return 1;
     }
 
-    file_data->format = get_next_uint16(&buffer_read);
+    file_data->format = get_next_uint16(buffer_read);
     if (file_data->format > 2)
     {
-        printf("Do not recognize MIDI format %hu.\n", file_data->format);
+        SMR_LOG("Do not recognize MIDI format %hu.\n", file_data->format);
         /*return 1;*/
     }
 
-    file_data->ntracks = get_next_uint16(&buffer_read);
+    file_data->ntracks = get_next_uint16(buffer_read);
 
-    if (buffer_read[0] & (1<<15))
+    /* The top bit of the division's first byte marks timecode. */
+    if ((*buffer_read)[0] & 0x80)
     {
-        /* TODO: Test timecode */
         file_data->time_type = SMRE_timecode;
         /* FPS comes in as a negative value for some reason, this flips it to positive. */
-        file_data->fps = 0 - get_next_uint8(&buffer_read);
-        file_data->subframe_resolution = get_next_uint8(&buffer_read);
+        file_data->fps = 0 - get_next_uint8(buffer_read);
+        file_data->subframe_resolution = get_next_uint8(buffer_read);
     }
     else
     {
         file_data->time_type = SMRE_metrical;
-        file_data->tickdiv = get_next_uint16(&buffer_read);
+        file_data->tickdiv = get_next_uint16(buffer_read);
     }
 
-    total_alloc_size = file_data->ntracks * sizeof(struct smr_track_data);
-    all_tracks_start = buffer_read;
-    total_num_events = 0;
+    memset(&file_data->timeline, 0, sizeof(file_data->timeline));
 
-    /* Add all tracks. */
-    for (i = 0; i < file_data->ntracks; ++i)
+    return 0;
+}
+
+/* Number of bytes an event needs in _mem_block on top of its smr_event. */
+static uint32_t get_event_payload_size(enum smr_event_type event_type, uint32_t length)
+{
+    switch (event_type)
     {
-        uint32_t track_chunklen;
-        uint8_t* track_start;
-        uint32_t track_num_events;
-        uint8_t last_status_byte;
+        case SMRE_sysex_single:
+        case SMRE_sysex_escape:
+        case SMRE_meta_sequencer_specific_event:
+            return length;
+        case SMRE_meta_text:
+        case SMRE_meta_copyright:
+        case SMRE_meta_track_name:
+        case SMRE_meta_instrument_name:
+        case SMRE_meta_lyric:
+        case SMRE_meta_marker:
+        case SMRE_meta_cue_point:
+        case SMRE_meta_program_name:
+        case SMRE_meta_device_name:
+            /* Allocating 1 extra byte for text, to add null terminator. */
+            return length + 1;
+        default:
+            /* All other events don't need extra allocation space. */
+            return 0;
+    }
+}
 
-        if (compare_next_string(&buffer_read, "MTrk") != 0)
-        {
-            printf("Did not find an expected track header.\n");
+/* Whether the event's data/text member is a pointer to its payload, which
+   it is even when the payload is empty. */
+static int event_has_payload_pointer(enum smr_event_type event_type)
+{
+    switch (event_type)
+    {
+        case SMRE_sysex_single:
+        case SMRE_sysex_escape:
+        case SMRE_meta_sequencer_specific_event:
+        case SMRE_meta_text:
+        case SMRE_meta_copyright:
+        case SMRE_meta_track_name:
+        case SMRE_meta_instrument_name:
+        case SMRE_meta_lyric:
+        case SMRE_meta_marker:
+        case SMRE_meta_cue_point:
+        case SMRE_meta_program_name:
+        case SMRE_meta_device_name:
             return 1;
-        }
+        default:
+            return 0;
+    }
+}
 
-        track_chunklen = get_next_uint32(&buffer_read);
-        track_start = buffer_read;
+/* Upper bound on the bytes of an event read_event looks at beyond its declared
+   payload: a delta time (4), status (1), meta event type (1), length (4) and
+   the largest fixed size meta event (SMPTE offset, 5). Events starting further
+   than this from the end of their track can't read past it. */
+#define SMR_EVENT_HEADER_BOUND 16
 
-        track_num_events = 0;
-        last_status_byte = 0xFF;
-        /* TODO: Maybe ignore track length and just look for End of Track event? */
-        while (buffer_read - track_start < track_chunklen)
-        {
-            uint32_t delta_time;
-            uint8_t status_byte, status_byte_top;
-            enum smr_event_type event_type;
-            uint32_t event_chunklen;
+/* Fixed size fields read_event takes from a meta event's data, whatever its
+   declared length. */
+static uint32_t get_meta_field_size(uint8_t meta_event_type)
+{
+    switch (meta_event_type | 0xFF00)
+    {
+        case SMRE_meta_sequence_number:
+        case SMRE_meta_key_signature:
+            return 2;
+        case SMRE_meta_midi_channel_prefix:
+        case SMRE_meta_midi_port:
+            return 1;
+        case SMRE_meta_tempo:
+            return 3;
+        case SMRE_meta_smpte_offset:
+            return 5;
+        case SMRE_meta_time_signature:
+            return 4;
+        default:
+            return 0;
+    }
+}
 
-            delta_time = get_next_variable_length_int(&buffer_read);
-            status_byte = get_next_uint8(&buffer_read);
+/* Makes sure everything read_event reads of the event at read, other than its
+   payload, lies before end. Only needed within SMR_EVENT_HEADER_BOUND bytes of
+   end. Statuses read_event rejects anyway are let through. */
+static int check_event_header(const uint8_t* read, const uint8_t* end, uint8_t last_status_byte)
+{
+    uint8_t status_byte;
+    uint32_t field_size;
 
-            /* Check for running status. */
-            if (status_byte < 0x80)
-            {
-                if (last_status_byte >= 0xF0)
-                {
-                    printf("Currently not supporting running status for non-MIDI events.");
-                    return 1;
-                }
+    if (skip_variable_length_int_checked(&read, end) != 0 || read >= end)
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
 
-                status_byte = last_status_byte;
-                /* Back up buffer so that value can be read again. */
-                buffer_read -= 1;
-            }
+    status_byte = *read++;
+    if (status_byte < 0x80)
+    {
+        status_byte = last_status_byte;
+        read -= 1;
+    }
 
-            last_status_byte = status_byte;
+    field_size = 0;
+    if (status_byte >= 0x80 && status_byte < 0xF0)
+    {
+        field_size = ((status_byte & 0xF0) == SMRE_midi_program_change || (status_byte & 0xF0) == SMRE_midi_channel_pressure) ? 1 : 2;
+    }
+    else if (status_byte == 0xF0 || status_byte == 0xF7)
+    {
+        if (skip_variable_length_int_checked(&read, end) != 0)
+        {
+            SMR_LOG("Event runs past the end of its track.\n");
+            return 1;
+        }
+    }
+    else if (status_byte == 0xFF)
+    {
+        if (read >= end)
+        {
+            SMR_LOG("Event runs past the end of its track.\n");
+            return 1;
+        }
 
-            status_byte_top = status_byte & 0xF0;
-            if (status_byte_top >= 0x80 & status_byte_top < 0xF0)
-            {
-                /* MIDI event */
-                event_type = (enum smr_event_type)status_byte_top;
-                /* Bottom nibble = channel */
+        field_size = get_meta_field_size(*read++);
+        if (skip_variable_length_int_checked(&read, end) != 0)
+        {
+            SMR_LOG("Event runs past the end of its track.\n");
+            return 1;
+        }
+    }
 
-                switch (event_type)
-                {
-                    case SMRE_midi_note_off:
-                    case SMRE_midi_note_on:
-                    case SMRE_midi_polyphonic_pressure:
-                    case SMRE_midi_controller:
-                    case SMRE_midi_pitch_bend:
-                        event_chunklen = 2;
-                        break;
+    if (field_size > (uint64_t)(end - read))
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
 
-                    case SMRE_midi_program_change:
-                    case SMRE_midi_channel_pressure:
-                        event_chunklen = 1;
-                        break;
-                    default:
-                        /* Can't happen. */
-                        event_chunklen = 0; /* <- Appeasing compiler warnings. */
-                        break;
-                }
-            }
-            else if (status_byte == 0xF0 || status_byte == 0xF7)
-            {
-                /* SysEx event */
-                event_type = (enum smr_event_type)status_byte;
-                event_chunklen = get_next_variable_length_int(&buffer_read);
+    return 0;
+}
 
-                total_alloc_size += event_chunklen;
-            }
-            else if (status_byte == 0xFF)
-            {
-                uint8_t meta_event_type;
+/* Which events a parse keeps, from smr_read_options. Only used when it drops
+   any, so that parses keeping everything don't pay for it. */
+struct smr_event_filter
+{
+    uint32_t types;
+    uint16_t channels;
+    /* Whether each MIDI status byte (less 0x80) is kept, worked out once. */
+    uint8_t midi_kept[0x70];
+};
 
-                meta_event_type = get_next_uint8(&buffer_read);
-                event_type = (enum smr_event_type)(meta_event_type | (status_byte << 8));
-                event_chunklen = get_next_variable_length_int(&buffer_read);
+static const struct smr_event_filter* get_event_filter(const struct smr_read_options* options, struct smr_event_filter* filter)
+{
+    uint32_t status_byte;
+
+    if (!options)
+    {
+        return NULL;
+    }
+
+    filter->types = options->keep_types ? options->keep_types : 0xFFFFFFFF;
+    filter->channels = options->keep_channels ? options->keep_channels : 0xFFFF;
+    if ((filter->types & 0x1FFF) == 0x1FFF && filter->channels == 0xFFFF)
+    {
+        return NULL;
+    }
+
+    for (status_byte = 0; status_byte < 0x70; ++status_byte)
+    {
+        filter->midi_kept[status_byte] = (filter->types >> (status_byte >> 4)) & (filter->channels >> (status_byte & 0x0F)) & 1;
+    }
+
+    return filter;
+}
+
+/* Whether filter keeps a MIDI event with status_byte. */
+static inline int is_midi_event_kept(const struct smr_event_filter* filter, uint8_t status_byte)
+{
+    return filter->midi_kept[status_byte - 0x80];
+}
+
+/* Whether filter keeps an event of event_type, on channel if it is a MIDI
+   event. End of track events are always kept. */
+static int is_event_kept(const struct smr_event_filter* filter, uint32_t event_type, uint8_t channel)
+{
+    uint32_t keep_type;
+
+    if (event_type < SMRE_sysex_single)
+    {
+        return is_midi_event_kept(filter, (uint8_t)(event_type | channel));
+    }
+
+    if (event_type == SMRE_sysex_single || event_type == SMRE_sysex_escape)
+    {
+        keep_type = SMRE_keep_sysex;
+    }
+    else if (event_type >= SMRE_meta_text && event_type <= SMRE_meta_device_name)
+    {
+        keep_type = SMRE_keep_text;
+    }
+    else
+    {
+        switch (event_type)
+        {
+            case SMRE_meta_end_of_track:
+                return 1;
+            case SMRE_meta_tempo:
+                keep_type = SMRE_keep_tempo;
+                break;
+            case SMRE_meta_time_signature:
+                keep_type = SMRE_keep_time_signature;
+                break;
+            case SMRE_meta_key_signature:
+                keep_type = SMRE_keep_key_signature;
+                break;
+            default:
+                keep_type = SMRE_keep_other_meta;
+                break;
+        }
+    }
+
+    return (filter->types & keep_type) != 0;
+}
+
+/* Rest of measure_event for SysEx and meta events, buffer_read being right
+   after their status byte, setting dropped if filter drops the event. Kept
+   apart so that measure_event stays small. */
+static int measure_other_event(uint8_t** buffer_read, uint8_t* track_end, uint32_t flags, const struct smr_event_filter* filter, uint8_t status_byte, uint32_t* num_other, uint64_t* payload_size, int* dropped)
+{
+    enum smr_event_type event_type;
+    uint32_t event_chunklen;
+
+    if (status_byte == 0xF0 || status_byte == 0xF7)
+    {
+        /* SysEx event */
+        event_type = (enum smr_event_type)status_byte;
+        event_chunklen = get_next_variable_length_int(buffer_read);
+    }
+    else if (status_byte == 0xFF)
+    {
+        uint8_t meta_event_type;
+
+        meta_event_type = get_next_uint8(buffer_read);
+        event_type = (enum smr_event_type)(meta_event_type | (status_byte << 8));
+        event_chunklen = get_next_variable_length_int(buffer_read);
+    }
+    else
+    {
+        SMR_LOG("\nDo not recognize status byte %02x.\n", status_byte & 0xFF);
+        return 1;
+    }
+
+    if (event_chunklen > (uint64_t)(track_end - *buffer_read))
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
+
+    *buffer_read += event_chunklen;
+    if (filter && !is_event_kept(filter, event_type, 0))
+    {
+        *dropped = 1;
+        return 0;
+    }
+
+    *num_other += 1;
+    /* Borrowed payloads stay in the source buffer. */
+    if (!(flags & SMRE_read_borrow_payloads))
+    {
+        *payload_size += get_event_payload_size(event_type, event_chunklen);
+    }
+
+    return 0;
+}
+
+/* Steps over the event at buffer_read without decoding it, counting it in
+   num_other if it is a SysEx or meta event, and adding the payload bytes it
+   will need to payload_size. Its payload must end by track_end. Events filter
+   drops (if not NULL) are counted in num_dropped instead. Inlined, since it is
+   the whole count pass. */
+static inline int measure_event(uint8_t** buffer_read, uint8_t* track_end, uint32_t flags, const struct smr_event_filter* filter, uint8_t* last_status_byte, uint32_t* num_other, uint64_t* payload_size, uint32_t* num_dropped)
+{
+    uint8_t status_byte, status_byte_top;
+    int dropped;
+
+    /* Skip delta time. */
+    get_next_variable_length_int(buffer_read);
+    status_byte = get_next_uint8(buffer_read);
+
+    /* Check for running status. */
+    if (status_byte < 0x80)
+    {
+        if (*last_status_byte >= 0xF0)
+        {
+            SMR_LOG("Currently not supporting running status for non-MIDI events.");
+            return 1;
+        }
+
+        status_byte = *last_status_byte;
+        /* Back up buffer so that value can be read again. */
+        *buffer_read -= 1;
+    }
+
+    *last_status_byte = status_byte;
+
+    status_byte_top = status_byte & 0xF0;
+    if (status_byte_top >= 0x80 && status_byte_top < 0xF0)
+    {
+        /* MIDI event */
+        if (filter)
+        {
+            *num_dropped += !is_midi_event_kept(filter, status_byte);
+        }
+
+        /* Program change and channel pressure are the only 1 byte events. */
+        *buffer_read += (status_byte_top == SMRE_midi_program_change || status_byte_top == SMRE_midi_channel_pressure) ? 1 : 2;
+        return 0;
+    }
+
+    /* Not num_dropped itself, which is better off in a register. */
+    dropped = 0;
+    if (measure_other_event(buffer_read, track_end, flags, filter, status_byte, num_other, payload_size, &dropped) != 0)
+    {
+        return 1;
+    }
+
+    if (filter)
+    {
+        *num_dropped += dropped;
+    }
+
+    return 0;
+}
+
+/* Walks one track (header included) without decoding it, counting its events,
+   how many of those are SysEx or meta events (if num_other isn't NULL), and the
+   payload bytes they will need. Events filter drops (if not NULL) don't count.
+   Every event is checked to lie inside the track, so decoding a measured track
+   can't read past it. */
+static int measure_track(uint8_t** buffer_read, uint32_t flags, const struct smr_event_filter* filter, uint32_t* num_events, uint32_t* num_other, uint64_t* payload_size)
+{
+    uint32_t track_chunklen;
+    uint8_t* track_start;
+    uint8_t* track_end;
+    uint8_t* checked_from;
+    uint32_t track_num_events;
+    uint32_t track_num_other;
+    uint32_t track_num_dropped;
+    uint8_t last_status_byte;
+
+    if (compare_next_string(buffer_read, "MTrk") != 0)
+    {
+        SMR_LOG("Did not find an expected track header.\n");
+        return 1;
+    }
+
+    track_chunklen = get_next_uint32(buffer_read);
+    track_start = *buffer_read;
+    track_end = track_start + track_chunklen;
+    checked_from = track_chunklen > SMR_EVENT_HEADER_BOUND ? track_end - SMR_EVENT_HEADER_BOUND : track_start;
+
+    track_num_events = 0;
+    track_num_other = 0;
+    track_num_dropped = 0;
+    last_status_byte = 0xFF;
+
+    /* Far enough from the end of the track, only payload lengths can run past
+       it, so the bounds checks stay out of the loop. Without a filter, the
+       filter checks go too. */
+    if (filter)
+    {
+        while (*buffer_read < checked_from)
+        {
+            if (measure_event(buffer_read, track_end, flags, filter, &last_status_byte, &track_num_other, payload_size, &track_num_dropped) != 0)
+            {
+                return 1;
+            }
+
+            track_num_events += 1;
+        }
+    }
+    else
+    {
+        while (*buffer_read < checked_from)
+        {
+            if (measure_event(buffer_read, track_end, flags, NULL, &last_status_byte, &track_num_other, payload_size, NULL) != 0)
+            {
+                return 1;
+            }
+
+            track_num_events += 1;
+        }
+    }
+
+    /* TODO: Maybe ignore track length and just look for End of Track event? */
+    while (*buffer_read < track_end)
+    {
+        if (check_event_header(*buffer_read, track_end, last_status_byte) != 0 || measure_event(buffer_read, track_end, flags, filter, &last_status_byte, &track_num_other, payload_size, &track_num_dropped) != 0)
+        {
+            return 1;
+        }
+
+        track_num_events += 1;
+    }
+
+    *num_events = track_num_events - track_num_dropped;
+    if (num_other)
+    {
+        *num_other = track_num_other;
+    }
+
+    return 0;
+}
+
+/* Steps over the SysEx or meta event at buffer_read if filter drops it,
+   setting dropped and adding its delta time to skipped_time. Anything else is
+   left for read_event, which rejects what it has to. The event header must be
+   known to lie inside the track. */
+static int filter_other_event(uint8_t** buffer_read, uint8_t* track_end, const struct smr_event_filter* filter, uint8_t* last_status_byte, uint32_t* skipped_time, int* dropped)
+{
+    uint8_t* read;
+    uint32_t delta_time;
+    uint8_t status_byte;
+    uint32_t num_other;
+    uint64_t payload_size;
+
+    *dropped = 0;
+    read = *buffer_read;
+    delta_time = get_next_variable_length_int(&read);
+    status_byte = get_next_uint8(&read);
+    if ((status_byte != 0xF0 && status_byte != 0xF7 && status_byte != 0xFF) ||
+        is_event_kept(filter, status_byte == 0xFF ? (uint32_t)(0xFF00 | *read) : status_byte, 0))
+    {
+        return 0;
+    }
+
+    *buffer_read = read;
+    if (measure_other_event(buffer_read, track_end, SMRE_read_borrow_payloads, NULL, status_byte, &num_other, &payload_size, dropped) != 0)
+    {
+        return 1;
+    }
+
+    *last_status_byte = status_byte;
+    *skipped_time += delta_time;
+    *dropped = 1;
+
+    return 0;
+}
+
+/* Decodes the data bytes of a MIDI event with status_byte into event. */
+static inline void read_midi_event(uint8_t** buffer_read, uint8_t status_byte, struct smr_event* event)
+{
+    event->event_type = (enum smr_event_type)(status_byte & 0xF0);
+    /* Getting bottom nibble as channel. */
+    event->channel = status_byte & 0x0F;
+
+    switch (event->event_type)
+    {
+        case SMRE_midi_note_off:
+        case SMRE_midi_note_on:
+            event->note = get_next_uint8(buffer_read);
+            event->velocity = get_next_uint8(buffer_read);
+            break;
+        case SMRE_midi_polyphonic_pressure:
+            event->note = get_next_uint8(buffer_read);
+            event->pressure = get_next_uint8(buffer_read);
+            break;
+        case SMRE_midi_controller:
+            event->controller = get_next_uint8(buffer_read);
+            event->value = get_next_uint8(buffer_read);
+            break;
+        case SMRE_midi_program_change:
+            event->program = get_next_uint8(buffer_read);
+            break;
+        case SMRE_midi_channel_pressure:
+            event->pressure = get_next_uint8(buffer_read);
+            break;
+        case SMRE_midi_pitch_bend:
+            /* TODO: Test this, I don't know that this how the pitch bend value is supposed to be read in. */
+            event->pitch_bend = get_next_uint16(buffer_read);
+            break;
+        default:
+            /* Can't happen. */
+            break;
+    }
+}
+
+/* Decodes the event at buffer_read into event. Any payload it carries is copied
+   to mem_ptr, which is advanced past it, or with SMRE_read_borrow_payloads just
+   pointed to. Payloads that would run past track_end are rejected, so that an
+   upper-bound sized mem block can't be overrun. */
+static int read_event(uint8_t** buffer_read, uint8_t* track_end, uint32_t flags, uint8_t* last_status_byte, struct smr_event* event, uint8_t** mem_ptr)
+{
+    uint8_t status_byte;
+    uint8_t status_byte_top;
+
+    event->delta_time = get_next_variable_length_int(buffer_read);
+    status_byte = get_next_uint8(buffer_read);
+
+    /* Check for running status. */
+    if (status_byte < 0x80)
+    {
+        if (*last_status_byte >= 0xF0)
+        {
+            SMR_LOG("Currently not supporting running status for non-MIDI events.");
+            return 1;
+        }
+
+        status_byte = *last_status_byte;
+        /* Back up buffer so that value can be read again. */
+        *buffer_read -= 1;
+    }
+
+    *last_status_byte = status_byte;
+
+    status_byte_top = status_byte & 0xF0;
+    if (status_byte_top >= 0x80 && status_byte_top < 0xF0)
+    {
+        read_midi_event(buffer_read, status_byte, event);
+    }
+    else if (status_byte == 0xF0 || status_byte == 0xF7)
+    {
+        /* SysEx event */
+        event->event_type = (enum smr_event_type)status_byte;
+        event->length = get_next_variable_length_int(buffer_read);
+        if (event->length > track_end - *buffer_read)
+        {
+            SMR_LOG("SysEx event runs past the end of its track.\n");
+            return 1;
+        }
+
+        if (flags & SMRE_read_borrow_payloads)
+        {
+            event->message = *buffer_read;
+        }
+        else
+        {
+            event->message = *mem_ptr;
+            memcpy(event->message, *buffer_read, event->length);
+            *mem_ptr += event->length;
+        }
+
+        *buffer_read += event->length;
+    }
+    else if (status_byte == 0xFF)
+    {
+        uint8_t meta_event_type;
+        uint32_t meta_length;
+        uint8_t* event_data;
+
+        meta_event_type = get_next_uint8(buffer_read);
+        event->event_type = (enum smr_event_type)(meta_event_type | (status_byte << 8));
+        /* Fixed size meta events share their fields with length, so hold on to
+           it separately. */
+        meta_length = get_next_variable_length_int(buffer_read);
+        if (meta_length > track_end - *buffer_read)
+        {
+            SMR_LOG("Meta event runs past the end of its track.\n");
+            return 1;
+        }
+
+        event->length = meta_length;
+        event_data = *buffer_read;
+
+        switch (event->event_type)
+        {
+            case SMRE_meta_sequence_number:
+                event->ss_ss = get_next_uint16(&event_data);
+                break;
+            case SMRE_meta_text:
+            case SMRE_meta_copyright:
+            case SMRE_meta_track_name:
+            case SMRE_meta_instrument_name:
+            case SMRE_meta_lyric:
+            case SMRE_meta_marker:
+            case SMRE_meta_cue_point:
+            case SMRE_meta_program_name:
+            case SMRE_meta_device_name:
+                if (flags & SMRE_read_borrow_payloads)
+                {
+                    event->text = (char*)event_data;
+                    break;
+                }
+
+                event->text = (char*)*mem_ptr;
+                memcpy(event->text, event_data, event->length);
+                /* Add null terminator. */
+                event->text[event->length] = 0;
+                *mem_ptr += event->length + 1;
+                break;
+            case SMRE_meta_midi_channel_prefix:
+                event->cc = get_next_uint8(&event_data);
+                break;
+            case SMRE_meta_midi_port:
+                event->pp = get_next_uint8(&event_data);
+                break;
+            case SMRE_meta_end_of_track:
+                /* Empty event. */
+                break;
+            case SMRE_meta_tempo:
+                event->tempo = get_next_uint24(&event_data);
+                break;
+            case SMRE_meta_smpte_offset:
+                event->hr = get_next_uint8(&event_data);
+                event->mn = get_next_uint8(&event_data);
+                event->se = get_next_uint8(&event_data);
+                event->fr = get_next_uint8(&event_data);
+                event->ff = get_next_uint8(&event_data);
+                break;
+            case SMRE_meta_time_signature:
+                event->nn = get_next_uint8(&event_data);
+                event->dd = get_next_uint8(&event_data);
+                event->cc = get_next_uint8(&event_data);
+                event->bb = get_next_uint8(&event_data);
+                break;
+            case SMRE_meta_key_signature:
+                event->sf = get_next_uint8(&event_data);
+                event->mi = get_next_uint8(&event_data);
+                break;
+            case SMRE_meta_sequencer_specific_event:
+                if (flags & SMRE_read_borrow_payloads)
+                {
+                    event->data = event_data;
+                    break;
+                }
+
+                event->data = *mem_ptr;
+                memcpy(event->data, event_data, event->length);
+                *mem_ptr += event->length;
+                break;
+            default:
+                /* Unknown meta event, its data is skipped below. */
+                break;
+        }
+
+        /* Always step over the declared length, so an unknown or oversized meta
+           event can't throw off the rest of the track. It was checked above. */
+        *buffer_read += meta_length;
+    }
+    else
+    {
+        SMR_LOG("\nDo not recognize status byte %02x.\n", status_byte & 0xFF);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* read_event for a filtered parse: an event filter drops is stepped over,
+   setting dropped and adding its delta time to skipped_time, which goes to
+   the next event read instead. MIDI events are only decoded once. */
+static inline int read_filtered_event(uint8_t** buffer_read, uint8_t* track_end, uint32_t flags, const struct smr_event_filter* filter, uint8_t* last_status_byte, struct smr_event* event, uint8_t** mem_ptr, uint32_t* skipped_time, int* dropped)
+{
+    uint8_t* read;
+    uint32_t delta_time;
+    uint8_t status_byte;
+
+    read = *buffer_read;
+    delta_time = get_next_variable_length_int(&read);
+    status_byte = *read;
+    if (status_byte >= 0x80)
+    {
+        read += 1;
+    }
+    else if (*last_status_byte < 0xF0)
+    {
+        status_byte = *last_status_byte;
+    }
+
+    if (status_byte >= 0x80 && status_byte < 0xF0)
+    {
+        *last_status_byte = status_byte;
+        *dropped = !is_midi_event_kept(filter, status_byte);
+        if (*dropped)
+        {
+            /* Program change and channel pressure are the only 1 byte events. */
+            *buffer_read = read + (((status_byte & 0xF0) == SMRE_midi_program_change || (status_byte & 0xF0) == SMRE_midi_channel_pressure) ? 1 : 2);
+            *skipped_time += delta_time;
+            return 0;
+        }
+
+        *buffer_read = read;
+        event->delta_time = delta_time + *skipped_time;
+        *skipped_time = 0;
+        read_midi_event(buffer_read, status_byte, event);
+        return 0;
+    }
+
+    if (filter_other_event(buffer_read, track_end, filter, last_status_byte, skipped_time, dropped) != 0)
+    {
+        return 1;
+    }
+
+    if (*dropped)
+    {
+        return 0;
+    }
+
+    if (read_event(buffer_read, track_end, flags, last_status_byte, event, mem_ptr) != 0)
+    {
+        return 1;
+    }
+
+    event->delta_time += *skipped_time;
+    *skipped_time = 0;
+
+    return 0;
+}
+
+/* Where read_track_events is in a track, so that it can stop when the events
+   run out of room and carry on once there is more. */
+struct smr_track_reader
+{
+    uint8_t* track_end;
+    uint8_t* checked_from;
+    uint32_t skipped_time;
+    uint8_t last_status_byte;
+};
+
+/* Reads the track header at buffer_read, leaving it at the first event. */
+static int start_track(uint8_t** buffer_read, struct smr_track_reader* reader)
+{
+    uint32_t track_chunklen;
+
+    if (compare_next_string(buffer_read, "MTrk") != 0)
+    {
+        SMR_LOG("Did not find an expected track header.\n");
+        return 1;
+    }
+
+    track_chunklen = get_next_uint32(buffer_read);
+    reader->track_end = *buffer_read + track_chunklen;
+    reader->checked_from = track_chunklen > SMR_EVENT_HEADER_BOUND ? reader->track_end - SMR_EVENT_HEADER_BOUND : *buffer_read;
+    reader->skipped_time = 0;
+    reader->last_status_byte = 0xFF;
+
+    return 0;
+}
+
+/* Decodes events of the track reader is in after the nevents track_data already
+   has, until the track ends or the next event would go at events_end (never
+   when it is NULL). Payloads go to mem_ptr. Events filter drops (if not NULL)
+   are only stepped over, their delta times going to the next kept event. */
+static int read_track_events(uint8_t** buffer_read, uint32_t flags, const struct smr_event_filter* filter, struct smr_track_reader* reader, struct smr_track_data* track_data, struct smr_event* events_end, uint8_t** mem_ptr)
+{
+    struct smr_event* event_ptr;
+    int dropped;
+
+    event_ptr = track_data->events + track_data->nevents;
+    dropped = 0;
+
+    while (*buffer_read < reader->checked_from && event_ptr != events_end)
+    {
+        if (filter)
+        {
+            if (read_filtered_event(buffer_read, reader->track_end, flags, filter, &reader->last_status_byte, event_ptr, mem_ptr, &reader->skipped_time, &dropped) != 0)
+            {
+                return 1;
+            }
+
+            if (dropped)
+            {
+                continue;
+            }
+        }
+        else if (read_event(buffer_read, reader->track_end, flags, &reader->last_status_byte, event_ptr, mem_ptr) != 0)
+        {
+            return 1;
+        }
+
+        track_data->nevents += 1;
+        event_ptr += 1;
+    }
+
+    /* Measured tracks are known to be fine by now, but the single pass parse
+       doesn't measure. */
+    while (*buffer_read < reader->track_end && event_ptr != events_end)
+    {
+        if (check_event_header(*buffer_read, reader->track_end, reader->last_status_byte) != 0)
+        {
+            return 1;
+        }
+
+        if (filter)
+        {
+            if (read_filtered_event(buffer_read, reader->track_end, flags, filter, &reader->last_status_byte, event_ptr, mem_ptr, &reader->skipped_time, &dropped) != 0)
+            {
+                return 1;
+            }
+
+            if (dropped)
+            {
+                continue;
+            }
+        }
+        else if (read_event(buffer_read, reader->track_end, flags, &reader->last_status_byte, event_ptr, mem_ptr) != 0)
+        {
+            return 1;
+        }
+
+        track_data->nevents += 1;
+        event_ptr += 1;
+    }
+
+    return 0;
+}
+
+/* Decodes all events of the track at buffer_read (header included) into
+   event_ptr, with payloads going to mem_ptr. */
+static int read_track(uint8_t** buffer_read, uint32_t flags, const struct smr_event_filter* filter, struct smr_track_data* track_data, struct smr_event* event_ptr, uint8_t** mem_ptr)
+{
+    struct smr_track_reader reader;
+
+    if (start_track(buffer_read, &reader) != 0)
+    {
+        return 1;
+    }
+
+    track_data->events = event_ptr;
+    track_data->nevents = 0;
+
+    return read_track_events(buffer_read, flags, filter, &reader, track_data, NULL, mem_ptr);
+}
+
+/* Decodes all events of the track at buffer_read (header included) into
+   columns, whose arrays must already point at enough room. MIDI events are
+   packed straight from the file bytes, the rest go through read_event. Events
+   filter drops (if not NULL) are stepped over as in read_track. */
+static int read_track_columns(uint8_t** buffer_read, uint32_t flags, const struct smr_event_filter* filter, struct smr_track_columns* columns, uint8_t** mem_ptr)
+{
+    uint32_t track_chunklen;
+    uint8_t* track_end;
+    uint8_t last_status_byte;
+    uint32_t tick;
+    uint32_t skipped_time;
+    int dropped;
+
+    if (compare_next_string(buffer_read, "MTrk") != 0)
+    {
+        SMR_LOG("Did not find an expected track header.\n");
+        return 1;
+    }
+
+    track_chunklen = get_next_uint32(buffer_read);
+    track_end = *buffer_read + track_chunklen;
+
+    columns->nevents = 0;
+    columns->nother = 0;
+    columns->absolute_ticks = (flags & SMRE_read_column_ticks) != 0;
+    last_status_byte = 0xFF;
+    tick = 0;
+    skipped_time = 0;
+    dropped = 0;
+
+    while (*buffer_read < track_end)
+    {
+        uint8_t* event_start;
+        uint32_t time;
+        uint8_t status_byte;
+        uint16_t data;
+        struct smr_event* other;
+
+        event_start = *buffer_read;
+        time = get_next_variable_length_int(buffer_read);
+        status_byte = get_next_uint8(buffer_read);
+
+        /* Check for running status. */
+        if (status_byte < 0x80)
+        {
+            if (last_status_byte >= 0xF0)
+            {
+                SMR_LOG("Currently not supporting running status for non-MIDI events.");
+                return 1;
+            }
+
+            status_byte = last_status_byte;
+            /* Back up buffer so that value can be read again. */
+            *buffer_read -= 1;
+        }
+
+        other = NULL;
+        if (status_byte < 0xF0)
+        {
+            uint8_t status_byte_top;
+
+            /* MIDI event */
+            last_status_byte = status_byte;
+            status_byte_top = status_byte & 0xF0;
+            data = get_next_uint8(buffer_read);
+            /* Program change and channel pressure are the only 1 byte events. */
+            if (status_byte_top != SMRE_midi_program_change && status_byte_top != SMRE_midi_channel_pressure)
+            {
+                data |= get_next_uint8(buffer_read) << 8;
+            }
+
+            if (filter && !is_midi_event_kept(filter, status_byte))
+            {
+                skipped_time += time;
+                continue;
+            }
+        }
+        else
+        {
+            other = columns->other + columns->nother;
+            *buffer_read = event_start;
+            if (filter)
+            {
+                if (filter_other_event(buffer_read, track_end, filter, &last_status_byte, &skipped_time, &dropped) != 0)
+                {
+                    return 1;
+                }
+
+                if (dropped)
+                {
+                    continue;
+                }
+            }
+
+            if (read_event(buffer_read, track_end, flags, &last_status_byte, other, mem_ptr) != 0)
+            {
+                return 1;
+            }
+
+            columns->other_index[columns->nother] = columns->nevents;
+            columns->nother += 1;
+            data = 0;
+        }
+
+        time += skipped_time;
+        skipped_time = 0;
+        if (columns->absolute_ticks)
+        {
+            tick += time;
+            time = tick;
+        }
+
+        if (other)
+        {
+            other->delta_time = time;
+        }
+
+        columns->times[columns->nevents] = time;
+        columns->status[columns->nevents] = status_byte;
+        columns->data[columns->nevents] = data;
+        columns->nevents += 1;
+    }
+
+    return 0;
+}
+
+/* Moves every pointer in file_data that points into old_block (of old_size
+   bytes, end included for empty payloads) to file_data->_mem_block, after the
+   block has been reallocated or copied elsewhere. Only the first ntracks tracks
+   are looked at, the rest aren't read yet. Borrowed payloads point elsewhere
+   and are left alone. */
+static void rebase_mem_block(struct smr_midi_data* file_data, uintptr_t old_block, uint64_t old_size, uint16_t ntracks)
+{
+    uint8_t* new_block;
+    int32_t i;
+    uint32_t event_index;
+
+    new_block = file_data->_mem_block;
+    file_data->tracks = (struct smr_track_data*)(new_block + ((uintptr_t)file_data->tracks - old_block));
+
+    for (i = 0; i < ntracks; ++i)
+    {
+        struct smr_track_data* track;
+
+        track = file_data->tracks + i;
+        track->events = (struct smr_event*)(new_block + ((uintptr_t)track->events - old_block));
+
+        for (event_index = 0; event_index < track->nevents; ++event_index)
+        {
+            struct smr_event* event;
+
+            event = track->events + event_index;
+            if (event_has_payload_pointer(event->event_type) &&
+                (uintptr_t)event->data - old_block <= old_size)
+            {
+                event->data = new_block + ((uintptr_t)event->data - old_block);
+            }
+        }
+    }
+}
+
+static void* default_alloc(size_t size, void* user)
+{
+    (void)user;
+    return SMR_MALLOC(size);
+}
+
+static void* default_realloc(void* ptr, size_t old_size, size_t new_size, void* user)
+{
+    (void)old_size;
+    (void)user;
+    return SMR_REALLOC(ptr, new_size);
+}
+
+static void default_free(void* ptr, size_t size, void* user)
+{
+    (void)size;
+    (void)user;
+    SMR_FREE(ptr);
+}
+
+static const struct smr_allocator default_allocator = { default_alloc, default_realloc, default_free, NULL };
+
+static const struct smr_allocator* get_allocator(const struct smr_read_options* options)
+{
+    return (options && options->allocator) ? options->allocator : &default_allocator;
+}
+
+static int alloc_mem_block(struct smr_midi_data* file_data, const struct smr_allocator* allocator, uint64_t size)
+{
+    file_data->_allocator = *allocator;
+    file_data->_mem_size = size;
+    file_data->_mem_block = (uint8_t*)allocator->alloc_func(size, allocator->user);
+    if (!file_data->_mem_block)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI data.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Makes sure the header and every track chunk lie inside the buffer. */
+static int check_chunks(uint8_t* buffer, uint64_t buffer_len)
+{
+    uint8_t* buffer_read;
+    uint64_t offset;
+    uint16_t ntracks;
+    int32_t i;
+
+    if (buffer_len < 14)
+    {
+        SMR_LOG("MIDI file is too short to hold a header.\n");
+        return 1;
+    }
+
+    buffer_read = buffer + 10;
+    ntracks = get_next_uint16(&buffer_read);
+    offset = 14;
+
+    for (i = 0; i < ntracks; ++i)
+    {
+        uint32_t track_chunklen;
+
+        if (buffer_len - offset < 8)
+        {
+            SMR_LOG("MIDI file ends before track %d.\n", i);
+            return 1;
+        }
+
+        buffer_read = buffer + offset + 4;
+        track_chunklen = get_next_uint32(&buffer_read);
+        offset += 8;
+
+        if (track_chunklen > buffer_len - offset)
+        {
+            SMR_LOG("Track %d runs past the end of the MIDI file.\n", i);
+            return 1;
+        }
+
+        offset += track_chunklen;
+    }
+
+    return 0;
+}
+
+/* First pass of the default parse: counts the events, SysEx and meta events,
+   and payload bytes of every track. */
+static int measure_tracks(uint8_t* buffer_read, uint32_t flags, const struct smr_event_filter* filter, uint16_t ntracks, uint64_t* num_events, uint64_t* num_other, uint64_t* payload_size)
+{
+    int32_t i;
+
+    *num_events = 0;
+    *num_other = 0;
+    *payload_size = 0;
+
+    for (i = 0; i < ntracks; ++i)
+    {
+        uint32_t track_num_events;
+        uint32_t track_num_other;
+
+        if (measure_track(&buffer_read, flags, filter, &track_num_events, &track_num_other, payload_size) != 0)
+        {
+            return 1;
+        }
+
+        *num_events += track_num_events;
+        *num_other += track_num_other;
+    }
+
+    return 0;
+}
+
+/* Time of an event relative to the previous one in its track, or absolute
+   when columns hold ticks (then the merge just takes it as is). */
+static uint32_t get_event_time(const struct smr_midi_data* file_data, uint16_t track_index, uint32_t event_index)
+{
+    if (file_data->columns)
+    {
+        return file_data->columns[track_index].times[event_index];
+    }
+
+    return file_data->tracks[track_index].events[event_index].delta_time;
+}
+
+static uint32_t get_track_nevents(const struct smr_midi_data* file_data, uint16_t track_index)
+{
+    return file_data->columns ? file_data->columns[track_index].nevents : file_data->tracks[track_index].nevents;
+}
+
+/* Scratch bytes merge_timeline needs for ntracks tracks. */
+static uint64_t get_merge_scratch_size(uint16_t ntracks)
+{
+    uint64_t nleaves;
+
+    nleaves = 1;
+    while (nleaves < ntracks)
+    {
+        nleaves <<= 1;
+    }
+
+    return nleaves * (sizeof(struct smr_timeline_entry) + sizeof(uint64_t) + sizeof(uint16_t));
+}
+
+#define SMR_TIMELINE_DONE (~(uint64_t)0)
+
+/* Merge order of a track's next event: tick above track index, so ties go to
+   the lower track. Ticks past 48 bits are clamped, which keeps those events
+   in track order. */
+static uint64_t get_timeline_key(const struct smr_timeline_entry* entry)
+{
+    uint64_t tick;
+
+    tick = entry->tick < 0xFFFFFFFFFFFFull ? entry->tick : 0xFFFFFFFFFFFFull;
+    return (tick << 16) | entry->track_index;
+}
+
+/* Plays the subtree under node, storing the loser at every inner node, and
+   returns the winning leaf. */
+static uint32_t play_timeline_tournament(const uint64_t* keys, uint16_t* losers, uint32_t nleaves, uint32_t node)
+{
+    uint32_t a;
+    uint32_t b;
+
+    if (node >= nleaves)
+    {
+        return node - nleaves;
+    }
+
+    a = play_timeline_tournament(keys, losers, nleaves, node * 2);
+    b = play_timeline_tournament(keys, losers, nleaves, node * 2 + 1);
+    if (keys[b] < keys[a])
+    {
+        losers[node] = (uint16_t)a;
+        return b;
+    }
+
+    losers[node] = (uint16_t)b;
+    return a;
+}
+
+/* K-way merge of every track into entries, with a tournament tree of losers
+   over the next event of each track: one comparison per level per event, and
+   no child selection like a heap needs, which matters since the order of
+   events across tracks is too irregular for branches to predict. */
+static void merge_timeline(const struct smr_midi_data* file_data, struct smr_timeline_entry* entries, uint8_t* scratch)
+{
+    struct smr_timeline_entry* leaves;
+    uint64_t* keys;
+    uint16_t* losers;
+    uint32_t nleaves;
+    uint32_t winner;
+    uint32_t i;
+    uint64_t nentries;
+    int absolute_ticks;
+
+    nleaves = 1;
+    while (nleaves < file_data->ntracks)
+    {
+        nleaves <<= 1;
+    }
+
+    leaves = (struct smr_timeline_entry*)scratch;
+    keys = (uint64_t*)(leaves + nleaves);
+    losers = (uint16_t*)(keys + nleaves);
+    absolute_ticks = file_data->columns && file_data->ntracks > 0 && file_data->columns[0].absolute_ticks;
+
+    for (i = 0; i < nleaves; ++i)
+    {
+        leaves[i].event_index = 0;
+        leaves[i].track_index = (uint16_t)i;
+        keys[i] = SMR_TIMELINE_DONE;
+
+        if (i < file_data->ntracks && get_track_nevents(file_data, i) > 0)
+        {
+            leaves[i].tick = get_event_time(file_data, i, 0);
+            keys[i] = get_timeline_key(leaves + i);
+        }
+    }
+
+    winner = play_timeline_tournament(keys, losers, nleaves, 1);
+    nentries = 0;
+    while (keys[winner] != SMR_TIMELINE_DONE)
+    {
+        struct smr_timeline_entry* leaf;
+        uint32_t node;
+
+        leaf = leaves + winner;
+        entries[nentries] = *leaf;
+        nentries += 1;
+
+        leaf->event_index += 1;
+        if (leaf->event_index < get_track_nevents(file_data, leaf->track_index))
+        {
+            if (absolute_ticks)
+            {
+                leaf->tick = get_event_time(file_data, leaf->track_index, leaf->event_index);
+            }
+            else
+            {
+                leaf->tick += get_event_time(file_data, leaf->track_index, leaf->event_index);
+            }
+
+            keys[winner] = get_timeline_key(leaf);
+        }
+        else
+        {
+            keys[winner] = SMR_TIMELINE_DONE;
+        }
+
+        /* Replay only the path from this leaf up. */
+        for (node = (nleaves + winner) >> 1; node >= 1; node >>= 1)
+        {
+            if (keys[losers[node]] < keys[winner])
+            {
+                uint32_t loser;
+
+                loser = losers[node];
+                losers[node] = (uint16_t)winner;
+                winner = loser;
+            }
+        }
+    }
+}
+
+static uint64_t get_mem_block_size(uint32_t flags, uint16_t ntracks, uint64_t num_events, uint64_t num_other, uint64_t payload_size)
+{
+    uint64_t size;
+
+    if (flags & SMRE_read_columns)
+    {
+        size = ntracks * sizeof(struct smr_track_columns) +
+            num_other * (sizeof(struct smr_event) + sizeof(uint32_t)) +
+            num_events * (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t)) +
+            payload_size;
+    }
+    else
+    {
+        size = ntracks * sizeof(struct smr_track_data) + num_events * sizeof(struct smr_event) + payload_size;
+    }
+
+    if (flags & SMRE_read_timeline)
+    {
+        /* Aligned after the payloads, followed by the merge scratch. */
+        size = ((size + 7) & ~(uint64_t)7) + num_events * sizeof(struct smr_timeline_entry) + get_merge_scratch_size(ntracks);
+    }
+
+    return size;
+}
+
+/* Points the arrays of the first of file_data->ntracks columns at the start of
+   their sections in _mem_block, laid out as columns | other | times |
+   other_index | data | status | payloads (largest alignment first). Returns
+   where payloads go. */
+static uint8_t* place_columns(struct smr_midi_data* file_data, uint64_t num_events, uint64_t num_other)
+{
+    struct smr_track_columns* columns;
+
+    file_data->tracks = NULL;
+    file_data->columns = (struct smr_track_columns*)file_data->_mem_block;
+    columns = file_data->columns;
+    /* No tracks, no room for even the first one's pointers. */
+    if (file_data->ntracks == 0)
+    {
+        return file_data->_mem_block;
+    }
+
+    columns->other = (struct smr_event*)(columns + file_data->ntracks);
+    columns->times = (uint32_t*)(columns->other + num_other);
+    columns->other_index = columns->times + num_events;
+    columns->data = (uint16_t*)(columns->other_index + num_other);
+    columns->status = (uint8_t*)(columns->data + num_events);
+
+    return columns->status + num_events;
+}
+
+/* Points the arrays of columns right after those of the previous track. */
+static void place_next_columns(struct smr_track_columns* columns)
+{
+    struct smr_track_columns* prev;
+
+    prev = columns - 1;
+    columns->times = prev->times + prev->nevents;
+    columns->status = prev->status + prev->nevents;
+    columns->data = prev->data + prev->nevents;
+    columns->other_index = prev->other_index + prev->nother;
+    columns->other = prev->other + prev->nother;
+}
+
+/* Second pass of the default parse: decodes every track into _mem_block, laid
+   out as tracks | events | payloads, or as place_columns describes. */
+static int decode_tracks(uint8_t* buffer_read, uint32_t flags, const struct smr_event_filter* filter, uint64_t num_events, uint64_t num_other, struct smr_midi_data* file_data)
+{
+    int32_t i;
+    uint8_t* mem_ptr;
+    struct smr_event* event_ptr;
+
+    if (flags & SMRE_read_columns)
+    {
+        mem_ptr = place_columns(file_data, num_events, num_other);
+
+        for (i = 0; i < file_data->ntracks; ++i)
+        {
+            if (i > 0)
+            {
+                place_next_columns(file_data->columns + i);
+            }
+
+            if (read_track_columns(&buffer_read, flags, filter, file_data->columns + i, &mem_ptr) != 0)
+            {
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        file_data->tracks = (struct smr_track_data*)file_data->_mem_block;
+        file_data->columns = NULL;
+        event_ptr = (struct smr_event*)(file_data->tracks + file_data->ntracks);
+        mem_ptr = (uint8_t*)(event_ptr + num_events);
+
+        for (i = 0; i < file_data->ntracks; ++i)
+        {
+            if (read_track(&buffer_read, flags, filter, file_data->tracks + i, event_ptr, &mem_ptr) != 0)
+            {
+                return 1;
+            }
+
+            event_ptr += file_data->tracks[i].nevents;
+        }
+    }
+
+    if (flags & SMRE_read_timeline)
+    {
+        struct smr_timeline_entry* entries;
+
+        entries = (struct smr_timeline_entry*)(file_data->_mem_block + (((mem_ptr - file_data->_mem_block) + 7) & ~(uintptr_t)7));
+        merge_timeline(file_data, entries, (uint8_t*)(entries + num_events));
+        file_data->timeline.nentries = num_events;
+        file_data->timeline.entries = entries;
+    }
+
+    return 0;
+}
+
+/* Default parse: a first pass measures every track so the mem block can be
+   allocated at its exact size, and a second pass decodes into it. */
+static int read_tracks_two_pass(uint8_t* buffer_read, uint32_t flags, const struct smr_event_filter* filter, const struct smr_allocator* allocator, struct smr_midi_data* file_data)
+{
+    uint64_t num_events;
+    uint64_t num_other;
+    uint64_t payload_size;
+
+    if (measure_tracks(buffer_read, flags, filter, file_data->ntracks, &num_events, &num_other, &payload_size) != 0)
+    {
+        return 1;
+    }
+
+    if (alloc_mem_block(file_data, allocator, get_mem_block_size(flags, file_data->ntracks, num_events, num_other, payload_size)) != 0)
+    {
+        return 1;
+    }
+
+    if (decode_tracks(buffer_read, flags, filter, num_events, num_other, file_data) != 0)
+    {
+        smr_free_midi_data(file_data);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Resizes a single pass parse's block to new_size, moving the pointers of the
+   first ntracks tracks along if it moves. */
+static int resize_single_pass_block(struct smr_midi_data* file_data, const struct smr_allocator* allocator, uint16_t ntracks, uint64_t new_size)
+{
+    uint8_t* new_block;
+    uintptr_t old_block;
+    uint64_t old_size;
+
+    old_block = (uintptr_t)file_data->_mem_block;
+    old_size = file_data->_mem_size;
+    if (allocator->realloc_func)
+    {
+        new_block = (uint8_t*)allocator->realloc_func(file_data->_mem_block, old_size, new_size, allocator->user);
+    }
+    else
+    {
+        new_block = (uint8_t*)allocator->alloc_func(new_size, allocator->user);
+        if (new_block)
+        {
+            memcpy(new_block, file_data->_mem_block, old_size < new_size ? old_size : new_size);
+            allocator->free_func(file_data->_mem_block, old_size, allocator->user);
+        }
+    }
+
+    if (!new_block)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI data.\n");
+        return 1;
+    }
+
+    file_data->_mem_block = new_block;
+    file_data->_mem_size = new_size;
+    if ((uintptr_t)new_block != old_block)
+    {
+        rebase_mem_block(file_data, old_block, old_size, ntracks);
+    }
+
+    return 0;
+}
+
+/* Decodes every track at buffer_read into the events of a single pass parse's
+   block, which start at events_offset and fill the rest of it. When they run
+   out, the block grows to fit as many events again per byte of total_chunklen
+   left as there were so far. */
+static int read_single_pass_events(uint8_t* buffer_read, uint32_t flags, const struct smr_event_filter* filter, const struct smr_allocator* allocator, uint64_t total_chunklen, uint64_t events_offset, uint8_t** mem_ptr, struct smr_midi_data* file_data)
+{
+    int32_t i;
+    uint64_t max_num_events;
+    uint64_t total_num_events;
+    uint64_t consumed;
+
+    max_num_events = (file_data->_mem_size - events_offset) / sizeof(struct smr_event);
+    total_num_events = 0;
+    consumed = 0;
+
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        struct smr_track_reader reader;
+        struct smr_track_data* track;
+        uint8_t* track_start;
+
+        track = file_data->tracks + i;
+        if (start_track(&buffer_read, &reader) != 0)
+        {
+            return 1;
+        }
+
+        track_start = buffer_read;
+        track->events = (struct smr_event*)(file_data->_mem_block + events_offset) + total_num_events;
+        track->nevents = 0;
+
+        for (;;)
+        {
+            uint64_t num_events;
+
+            if (read_track_events(&buffer_read, flags, filter, &reader, track, (struct smr_event*)(file_data->_mem_block + events_offset) + max_num_events, mem_ptr) != 0)
+            {
+                return 1;
+            }
+
+            if (buffer_read >= reader.track_end)
+            {
+                break;
+            }
+
+            /* Full after at least one event, so something was consumed. Some
+               slack keeps a file that gets denser from growing every time. */
+            num_events = total_num_events + track->nevents;
+            max_num_events = num_events + (total_chunklen - consumed - (buffer_read - track_start)) * num_events / (consumed + (buffer_read - track_start));
+            max_num_events += max_num_events / 16 + 64;
+            if (resize_single_pass_block(file_data, allocator, (uint16_t)(i + 1), events_offset + max_num_events * sizeof(struct smr_event)) != 0)
+            {
+                return 1;
+            }
+
+            track = file_data->tracks + i;
+        }
+
+        total_num_events += track->nevents;
+        consumed += buffer_read - track_start;
+    }
+
+    return 0;
+}
+
+/* Single pass parse: only the track headers are walked up front, to bound the
+   payload size and guess the event count. Every event is decoded once, straight
+   into a block of tracks | events that grows when the guess runs out, while
+   payloads go to a scratch buffer of the bound size. The payloads are appended
+   to the block once all tracks are read, giving the same layout as the two
+   pass parse.
+
+   The guess is low, so the block mostly grows in place at the top of the heap,
+   and is only shrunk when that gives back more than an eighth of it. Bounding
+   the count instead (at 2 bytes per event) and shrinking afterwards allocates
+   past what malloc last freed, which glibc serves from fresh pages that fault
+   on every parse. */
+static int read_tracks_single_pass(uint8_t* buffer_read, uint32_t flags, const struct smr_event_filter* filter, const struct smr_allocator* allocator, struct smr_midi_data* file_data)
+{
+    uint8_t* header_read;
+    int32_t i;
+    uint64_t total_chunklen;
+    uint64_t max_payload_size;
+    uint64_t events_offset;
+    uint64_t events_end;
+    uint64_t payload_size;
+    uint8_t* payloads;
+    uint8_t* mem_ptr;
+
+    total_chunklen = 0;
+    max_payload_size = 0;
+    header_read = buffer_read;
+
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        uint32_t track_chunklen;
+
+        if (compare_next_string(&header_read, "MTrk") != 0)
+        {
+            SMR_LOG("Did not find an expected track header.\n");
+            return 1;
+        }
+
+        track_chunklen = get_next_uint32(&header_read);
+        header_read += track_chunklen;
+        total_chunklen += track_chunklen;
+        /* Payloads are copied from inside the track, plus a null terminator per
+           text event, which takes at least 4 bytes. */
+        max_payload_size += track_chunklen + track_chunklen / 4 + 1;
+    }
+
+    payloads = NULL;
+    if (!(flags & SMRE_read_borrow_payloads))
+    {
+        /* Allocated before the block, so that the block can grow in place. */
+        payloads = (uint8_t*)allocator->alloc_func(max_payload_size, allocator->user);
+        if (!payloads)
+        {
+            SMR_LOG("Unable to allocate memory for MIDI data.\n");
+            return 1;
+        }
+    }
+
+    /* Events take 3 or 4 bytes: a delta time, a status byte unless under
+       running status, and one or two data bytes. */
+    events_offset = file_data->ntracks * sizeof(struct smr_track_data);
+    if (alloc_mem_block(file_data, allocator, events_offset + (total_chunklen / 4 + 64) * sizeof(struct smr_event)) != 0)
+    {
+        if (payloads)
+        {
+            allocator->free_func(payloads, max_payload_size, allocator->user);
+        }
+
+        return 1;
+    }
+
+    file_data->tracks = (struct smr_track_data*)file_data->_mem_block;
+    file_data->columns = NULL;
+    mem_ptr = payloads;
+
+    if (read_single_pass_events(buffer_read, flags, filter, allocator, total_chunklen, events_offset, &mem_ptr, file_data) != 0)
+    {
+        if (payloads)
+        {
+            allocator->free_func(payloads, max_payload_size, allocator->user);
+        }
+
+        smr_free_midi_data(file_data);
+        return 1;
+    }
+
+    events_end = events_offset;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        events_end += file_data->tracks[i].nevents * sizeof(struct smr_event);
+    }
+
+    /* Shrinking to nothing (a file without tracks) would free the block, so
+       keep it then. */
+    payload_size = payloads ? (uint64_t)(mem_ptr - payloads) : 0;
+    if (events_end + payload_size > file_data->_mem_size ||
+        (allocator->realloc_func && events_end + payload_size > 0 && events_end + payload_size < file_data->_mem_size - file_data->_mem_size / 8))
+    {
+        if (resize_single_pass_block(file_data, allocator, file_data->ntracks, events_end + payload_size) != 0)
+        {
+            if (payloads)
+            {
+                allocator->free_func(payloads, max_payload_size, allocator->user);
+            }
+
+            smr_free_midi_data(file_data);
+            return 1;
+        }
+    }
+
+    if (payloads)
+    {
+        uint8_t* payload_dest;
+
+        /* Like rebase_mem_block, for the payloads only. */
+        payload_dest = file_data->_mem_block + events_end;
+        memcpy(payload_dest, payloads, payload_size);
+        for (i = 0; i < file_data->ntracks; ++i)
+        {
+            struct smr_track_data* track;
+            uint32_t event_index;
+
+            track = file_data->tracks + i;
+            for (event_index = 0; event_index < track->nevents; ++event_index)
+            {
+                struct smr_event* event;
+
+                event = track->events + event_index;
+                if (event_has_payload_pointer(event->event_type))
+                {
+                    event->data = payload_dest + (event->data - payloads);
+                }
+            }
+        }
+
+        allocator->free_func(payloads, max_payload_size, allocator->user);
+    }
+
+    return 0;
+}
+
+#ifdef SMR_ENABLE_THREADS
+
+/* One track's share of a parallel parse. */
+struct smr_track_job
+{
+    uint8_t* track_start;
+    uint32_t num_events;
+    uint64_t payload_size;
+    struct smr_event* events;
+    uint8_t* mem_ptr;
+    int result;
+};
+
+struct smr_parallel_read
+{
+    struct smr_midi_data* file_data;
+    struct smr_track_job* jobs;
+    uint32_t flags;
+    const struct smr_event_filter* filter;
+    uint32_t next_job;
+    int decode;
+};
+
+static void* parallel_read_worker(void* arg)
+{
+    struct smr_parallel_read* read;
+    uint32_t job_index;
+
+    read = (struct smr_parallel_read*)arg;
+
+    /* Tracks are handed out one at a time, so that a few long tracks don't
+       leave the other threads idle. */
+    while ((job_index = __atomic_fetch_add(&read->next_job, 1, __ATOMIC_RELAXED)) < read->file_data->ntracks)
+    {
+        struct smr_track_job* job;
+        uint8_t* buffer_read;
+
+        job = read->jobs + job_index;
+        buffer_read = job->track_start;
+
+        if (read->decode)
+        {
+            job->result = read_track(&buffer_read, read->flags, read->filter, read->file_data->tracks + job_index, job->events, &job->mem_ptr);
+        }
+        else
+        {
+            job->payload_size = 0;
+            job->result = measure_track(&buffer_read, read->flags, read->filter, &job->num_events, NULL, &job->payload_size);
+        }
+    }
+
+    return NULL;
+}
+
+/* Runs every job on nthreads threads, the calling thread being one of them. */
+static void run_parallel_read(struct smr_parallel_read* read, uint32_t nthreads)
+{
+    pthread_t threads[SMR_MAX_THREADS];
+    uint32_t nstarted;
+    uint32_t i;
+
+    read->next_job = 0;
+
+    for (nstarted = 0; nstarted + 1 < nthreads; ++nstarted)
+    {
+        /* Whatever threads could not be started, the others make up for. */
+        if (pthread_create(threads + nstarted, NULL, parallel_read_worker, read) != 0)
+        {
+            break;
+        }
+    }
+
+    parallel_read_worker(read);
+
+    for (i = 0; i < nstarted; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Parallel parse: a header-only walk finds every track, then the tracks are
+   measured concurrently, given the same slices of _mem_block a serial parse
+   would use, and decoded concurrently into them. */
+static int read_tracks_parallel(uint8_t* buffer_read, uint32_t flags, const struct smr_event_filter* filter, const struct smr_allocator* allocator, struct smr_midi_data* file_data, uint32_t nthreads)
+{
+    struct smr_parallel_read read;
+    struct smr_track_job* jobs;
+    size_t jobs_size;
+    int32_t i;
+    uint64_t total_alloc_size;
+    uint64_t total_num_events;
+    uint64_t total_payload_size;
+    uint8_t* mem_ptr;
+    struct smr_event* event_ptr;
+
+    if (nthreads == 0)
+    {
+        long num_cpus;
+
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = num_cpus > 0 ? (uint32_t)num_cpus : 1;
+    }
+
+    if (nthreads > file_data->ntracks)
+    {
+        nthreads = file_data->ntracks;
+    }
+
+    if (nthreads > SMR_MAX_THREADS)
+    {
+        nthreads = SMR_MAX_THREADS;
+    }
+
+    if (nthreads <= 1)
+    {
+        return read_tracks_two_pass(buffer_read, flags, filter, allocator, file_data);
+    }
+
+    jobs_size = file_data->ntracks * sizeof(struct smr_track_job);
+    jobs = (struct smr_track_job*)allocator->alloc_func(jobs_size, allocator->user);
+    if (!jobs)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI data.\n");
+        return 1;
+    }
+
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        uint8_t* header_read;
+        uint32_t track_chunklen;
+
+        header_read = buffer_read;
+        if (compare_next_string(&header_read, "MTrk") != 0)
+        {
+            SMR_LOG("Did not find an expected track header.\n");
+            allocator->free_func(jobs, jobs_size, allocator->user);
+            return 1;
+        }
+
+        track_chunklen = get_next_uint32(&header_read);
+        jobs[i].track_start = buffer_read;
+        buffer_read = header_read + track_chunklen;
+    }
+
+    read.file_data = file_data;
+    read.jobs = jobs;
+    read.flags = flags;
+    read.filter = filter;
+    read.decode = 0;
+    run_parallel_read(&read, nthreads);
+
+    total_num_events = 0;
+    total_payload_size = 0;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        if (jobs[i].result != 0)
+        {
+            allocator->free_func(jobs, jobs_size, allocator->user);
+            return 1;
+        }
+
+        total_num_events += jobs[i].num_events;
+        total_payload_size += jobs[i].payload_size;
+    }
+
+    total_alloc_size = file_data->ntracks * sizeof(struct smr_track_data);
+    total_alloc_size += total_num_events * sizeof(struct smr_event);
+    total_alloc_size += total_payload_size;
+    if (alloc_mem_block(file_data, allocator, total_alloc_size) != 0)
+    {
+        allocator->free_func(jobs, jobs_size, allocator->user);
+        return 1;
+    }
+
+    /* Same layout as read_tracks_two_pass: tracks | events | payloads, with
+       each track's events and payloads following the previous track's. */
+    file_data->tracks = (struct smr_track_data*)file_data->_mem_block;
+    file_data->columns = NULL;
+    event_ptr = (struct smr_event*)(file_data->tracks + file_data->ntracks);
+    mem_ptr = (uint8_t*)(event_ptr + total_num_events);
+
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        jobs[i].events = event_ptr;
+        jobs[i].mem_ptr = mem_ptr;
+        event_ptr += jobs[i].num_events;
+        mem_ptr += jobs[i].payload_size;
+    }
+
+    read.decode = 1;
+    run_parallel_read(&read, nthreads);
+
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        if (jobs[i].result != 0)
+        {
+            smr_free_midi_data(file_data);
+            allocator->free_func(jobs, jobs_size, allocator->user);
+            return 1;
+        }
+    }
+
+    allocator->free_func(jobs, jobs_size, allocator->user);
+
+    return 0;
+}
+
+#endif /* SMR_ENABLE_THREADS */
+
+int smr_read_byte_array(uint8_t* buffer, struct smr_midi_data* file_data)
+{
+    return smr_read_byte_array_ex(buffer, NULL, file_data);
+}
+
+int smr_read_byte_array_ex(uint8_t* buffer, const struct smr_read_options* options, struct smr_midi_data* file_data)
+{
+    uint8_t* buffer_read;
+    uint32_t flags;
+    struct smr_event_filter filter_storage;
+    const struct smr_event_filter* filter;
+
+    flags = options ? options->flags : 0;
+    filter = get_event_filter(options, &filter_storage);
+    buffer_read = buffer;
+
+    if (read_midi_header(&buffer_read, file_data) != 0)
+    {
+        return 1;
+    }
+
+    if (flags & (SMRE_read_columns | SMRE_read_timeline))
+    {
+        return read_tracks_two_pass(buffer_read, flags, filter, get_allocator(options), file_data);
+    }
+
+#ifdef SMR_ENABLE_THREADS
+    if (flags & SMRE_read_parallel)
+    {
+        return read_tracks_parallel(buffer_read, flags, filter, get_allocator(options), file_data, options->nthreads);
+    }
+#endif
+
+    if (flags & SMRE_read_single_pass)
+    {
+        return read_tracks_single_pass(buffer_read, flags, filter, get_allocator(options), file_data);
+    }
+
+    return read_tracks_two_pass(buffer_read, flags, filter, get_allocator(options), file_data);
+}
+
+int smr_read_byte_array_checked(uint8_t* buffer, uint64_t buffer_len, const struct smr_read_options* options, struct smr_midi_data* file_data)
+{
+    /* Once every chunk is known to be inside the buffer, the parse itself
+       keeps every event inside its chunk. */
+    if (check_chunks(buffer, buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    return smr_read_byte_array_ex(buffer, options, file_data);
+}
+
+int smr_required_size(uint8_t* buffer, uint64_t buffer_len, const struct smr_read_options* options, uint64_t* required_size)
+{
+    struct smr_midi_data file_data;
+    uint8_t* buffer_read;
+    uint64_t num_events;
+    uint64_t num_other;
+    uint64_t payload_size;
+    uint32_t flags;
+    struct smr_event_filter filter_storage;
+
+    flags = options ? options->flags : 0;
+    buffer_read = buffer;
+
+    if (check_chunks(buffer, buffer_len) != 0 || read_midi_header(&buffer_read, &file_data) != 0)
+    {
+        return 1;
+    }
+
+    if (measure_tracks(buffer_read, flags, get_event_filter(options, &filter_storage), file_data.ntracks, &num_events, &num_other, &payload_size) != 0)
+    {
+        return 1;
+    }
+
+    *required_size = get_mem_block_size(flags, file_data.ntracks, num_events, num_other, payload_size);
+
+    return 0;
+}
+
+int smr_read_byte_array_into(uint8_t* buffer, uint64_t buffer_len, const struct smr_read_options* options, uint8_t* mem, uint64_t mem_size, struct smr_midi_data* file_data)
+{
+    uint8_t* buffer_read;
+    uint64_t num_events;
+    uint64_t num_other;
+    uint64_t payload_size;
+    uint64_t required_size;
+    uint32_t flags;
+    struct smr_event_filter filter_storage;
+    const struct smr_event_filter* filter;
+
+    flags = options ? options->flags : 0;
+    filter = get_event_filter(options, &filter_storage);
+    buffer_read = buffer;
+
+    if ((uintptr_t)mem & 7)
+    {
+        SMR_LOG("Memory for MIDI data must be 8 byte aligned.\n");
+        return 1;
+    }
+
+    if (check_chunks(buffer, buffer_len) != 0 || read_midi_header(&buffer_read, file_data) != 0)
+    {
+        return 1;
+    }
+
+    /* The layout depends on the event count, so measure again rather than
+       trust that mem_size came from smr_required_size. */
+    if (measure_tracks(buffer_read, flags, filter, file_data->ntracks, &num_events, &num_other, &payload_size) != 0)
+    {
+        return 1;
+    }
+
+    required_size = get_mem_block_size(flags, file_data->ntracks, num_events, num_other, payload_size);
+    if (mem_size < required_size)
+    {
+        SMR_LOG("Need %lu bytes of memory for MIDI data, got %lu.\n", (unsigned long)required_size, (unsigned long)mem_size);
+        return 1;
+    }
+
+    file_data->_mem_block = mem;
+    file_data->_mem_size = mem_size;
+    memset(&file_data->_allocator, 0, sizeof(file_data->_allocator));
+
+    return decode_tracks(buffer_read, flags, filter, num_events, num_other, file_data);
+}
+
+/* Reads the entire file into a newly allocated buffer. */
+static int load_file(const char* filename, uint8_t** buffer, uint64_t* buffer_len)
+{
+    FILE* file_ptr;
+    long int file_size;
+    size_t bytes_read;
+
+    file_ptr = fopen(filename, "rb");
+    if (!file_ptr)
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+    /* Get file size */
+    fseek(file_ptr, 0L, SEEK_END);
+    file_size = ftell(file_ptr);
+    fseek(file_ptr, 0L, SEEK_SET);
+    if (file_size < 0)
+    {
+        SMR_LOG("Unable to get file size!\n");
+        fclose(file_ptr);
+        return 1;
+    }
+
+    /* Read entire file */
+    *buffer = (uint8_t*) SMR_MALLOC(file_size + 1);
+    if (!*buffer)
+    {
+        SMR_LOG("Unable to allocate memory for file!\n");
+        fclose(file_ptr);
+        return 1;
+    }
+
+    bytes_read = fread(*buffer, sizeof(uint8_t), file_size, file_ptr);
+    fclose(file_ptr);
+    if (bytes_read != (size_t)file_size)
+    {
+        SMR_LOG("Unable to read file, got %lu of %ld bytes!\n", (unsigned long)bytes_read, file_size);
+        SMR_FREE(*buffer);
+        return 1;
+    }
+
+    *buffer_len = file_size;
+
+    return 0;
+}
+
+int smr_read_file(const char* filename, struct smr_midi_data* file_data)
+{
+    uint8_t* buffer;
+    uint64_t buffer_len;
+    int return_code;
+
+    if (load_file(filename, &buffer, &buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    return_code = smr_read_byte_array_checked(buffer, buffer_len, NULL, file_data);
+
+    SMR_FREE(buffer);
+
+    return return_code;
+}
+
+int smr_read_file_mapped(const char* filename, const struct smr_read_options* options, struct smr_midi_data* file_data)
+{
+#ifdef SMR_HAS_MMAP
+    int file_descriptor;
+    struct stat file_stat;
+    uint8_t* buffer;
+    int return_code;
+#elif defined(_WIN32)
+    HANDLE file_handle;
+    HANDLE mapping;
+    LARGE_INTEGER file_size;
+    uint8_t* buffer;
+    int return_code;
+#else
+    uint8_t* buffer;
+    uint64_t buffer_len;
+    int return_code;
+#endif
+
+    if (options && (options->flags & SMRE_read_borrow_payloads))
+    {
+        SMR_LOG("Borrowed payloads would outlive the file buffer, use smr_read_byte_array_ex.\n");
+        return 1;
+    }
+
+#ifdef SMR_HAS_MMAP
+    file_descriptor = open(filename, O_RDONLY);
+    if (file_descriptor < 0)
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+    if (fstat(file_descriptor, &file_stat) != 0 || file_stat.st_size <= 0)
+    {
+        SMR_LOG("Unable to get file size!\n");
+        close(file_descriptor);
+        return 1;
+    }
+
+    buffer = (uint8_t*)mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+    /* The mapping keeps its own reference to the file. */
+    close(file_descriptor);
+    if (buffer == (uint8_t*)MAP_FAILED)
+    {
+        SMR_LOG("Unable to map file!\n");
+        return 1;
+    }
+
+#ifdef MADV_SEQUENTIAL
+    /* Both passes walk the file front to back, so read ahead aggressively. */
+    madvise(buffer, file_stat.st_size, MADV_SEQUENTIAL);
+    madvise(buffer, file_stat.st_size, MADV_WILLNEED);
+#endif
+
+    return_code = smr_read_byte_array_checked(buffer, file_stat.st_size, options, file_data);
+
+    munmap(buffer, file_stat.st_size);
+
+    return return_code;
+#elif defined(_WIN32)
+    file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE)
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+    if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart <= 0)
+    {
+        SMR_LOG("Unable to get file size!\n");
+        CloseHandle(file_handle);
+        return 1;
+    }
+
+    /* The mapping keeps its own reference to the file, and the view its own
+       reference to the mapping. */
+    mapping = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file_handle);
+    buffer = mapping ? (uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping)
+    {
+        CloseHandle(mapping);
+    }
+
+    if (!buffer)
+    {
+        SMR_LOG("Unable to map file!\n");
+        return 1;
+    }
+
+    return_code = smr_read_byte_array_checked(buffer, (uint64_t)file_size.QuadPart, options, file_data);
+
+    UnmapViewOfFile(buffer);
+
+    return return_code;
+#else
+    if (load_file(filename, &buffer, &buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    return_code = smr_read_byte_array_checked(buffer, buffer_len, options, file_data);
+
+    SMR_FREE(buffer);
+
+    return return_code;
+#endif
+}
+
+int smr_free_midi_data(struct smr_midi_data* midi_data)
+{
+    if (midi_data->_allocator.free_func)
+    {
+        midi_data->_allocator.free_func(midi_data->_mem_block, midi_data->_mem_size, midi_data->_allocator.user);
+    }
+
+    midi_data->_mem_block = NULL;
+
+    return 0;
+}
+
+#ifndef SMR_BATCH_SIZE
+/* Most items a worker takes from its own share at once. */
+#define SMR_BATCH_SIZE 32
+#endif
+
+#ifdef SMR_ENABLE_THREADS
+#define SMR_MAX_BATCH_WORKERS SMR_MAX_THREADS
+#else
+#define SMR_MAX_BATCH_WORKERS 1
+#endif
+
+#if defined(_WIN32) || defined(CLOCK_MONOTONIC)
+#define SMR_HAS_MONOTONIC_CLOCK
+#endif
+
+/* Seconds on a monotonic clock where there is one (SMR_HAS_MONOTONIC_CLOCK),
+   otherwise on the wall clock or, failing that, in processor time. */
+static double get_time_seconds(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+#elif defined(TIME_UTC)
+    struct timespec now;
+
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* A worker's share of the batch: items [begin, end) packed as begin | end << 32,
+   so that the owner taking from the front and thieves taking from the back
+   both get by with one compare and swap. */
+struct smr_batch_worker
+{
+    uint64_t range;
+    /* Reused for every file the worker loads. */
+    uint8_t* buffer;
+    uint64_t buffer_capacity;
+    uint64_t nfiles;
+    uint64_t nfailed;
+    uint64_t nbytes;
+    uint64_t nevents;
+    /* Keeps neighbouring workers' ranges off this cache line. */
+    uint8_t padding[64];
+};
+
+struct smr_batch_read
+{
+    const struct smr_batch_item* items;
+    uint64_t first_item;
+    const struct smr_batch_options* options;
+    struct smr_read_options read_options;
+    struct smr_midi_data* results;
+    enum smr_batch_error* errors;
+    struct smr_batch_worker* workers;
+    uint32_t nworkers;
+    uint32_t next_worker;
+};
+
+/* Takes items off worker's range: a few off the front for its owner, or the
+   back half for a thief. Returns 0 when the range is empty. */
+static int take_batch_items(struct smr_batch_worker* worker, int steal, uint32_t* begin, uint32_t* end)
+{
+    uint64_t range;
+    uint64_t new_range;
+
+    range = SMR_ATOMIC_LOAD(&worker->range);
+    do
+    {
+        uint32_t range_begin;
+        uint32_t range_end;
+        uint32_t count;
+
+        range_begin = (uint32_t)range;
+        range_end = (uint32_t)(range >> 32);
+        if (range_begin >= range_end)
+        {
+            return 0;
+        }
+
+        count = range_end - range_begin;
+        if (steal)
+        {
+            count = (count + 1) / 2;
+            *begin = range_end - count;
+            *end = range_end;
+            new_range = range_begin | ((uint64_t)*begin << 32);
+        }
+        else
+        {
+            /* Smaller bites as the share runs out, so it can still be split
+               up between thieves. */
+            count = count / 8;
+            count = count < 1 ? 1 : (count > SMR_BATCH_SIZE ? SMR_BATCH_SIZE : count);
+            *begin = range_begin;
+            *end = range_begin + count;
+            new_range = *end | ((uint64_t)range_end << 32);
+        }
+    } while (!SMR_ATOMIC_CAS(&worker->range, &range, new_range));
+
+    return 1;
+}
+
+/* Reads path into the worker's buffer, growing it as needed. */
+static enum smr_batch_error load_batch_file(struct smr_batch_worker* worker, const char* path, uint64_t* file_len)
+{
+    FILE* file_ptr;
+    long int file_size;
+
+    file_ptr = fopen(path, "rb");
+    if (!file_ptr)
+    {
+        return SMRE_batch_open_failed;
+    }
+
+    fseek(file_ptr, 0L, SEEK_END);
+    file_size = ftell(file_ptr);
+    fseek(file_ptr, 0L, SEEK_SET);
+    if (file_size < 0)
+    {
+        fclose(file_ptr);
+        return SMRE_batch_read_failed;
+    }
+
+    if ((uint64_t)file_size > worker->buffer_capacity)
+    {
+        uint8_t* new_buffer;
+
+        new_buffer = (uint8_t*)SMR_REALLOC(worker->buffer, file_size);
+        if (!new_buffer)
+        {
+            fclose(file_ptr);
+            return SMRE_batch_out_of_memory;
+        }
+
+        worker->buffer = new_buffer;
+        worker->buffer_capacity = file_size;
+    }
+
+    *file_len = file_size;
+    if (fread(worker->buffer, sizeof(uint8_t), file_size, file_ptr) != (size_t)file_size)
+    {
+        fclose(file_ptr);
+        return SMRE_batch_read_failed;
+    }
+
+    fclose(file_ptr);
+
+    return SMRE_batch_ok;
+}
+
+static void read_batch_item(struct smr_batch_read* read, struct smr_batch_worker* worker, uint64_t item_index)
+{
+    const struct smr_batch_item* item;
+    struct smr_midi_data local_data;
+    struct smr_midi_data* midi_data;
+    enum smr_batch_error error;
+    uint8_t* buffer;
+    uint64_t buffer_len;
+    struct smr_read_options read_options;
+
+    item = read->items + item_index;
+    midi_data = read->results ? read->results + item_index : &local_data;
+    memset(midi_data, 0, sizeof(*midi_data));
+    read_options = read->read_options;
+
+    buffer = item->buffer;
+    buffer_len = item->buffer_len;
+    error = SMRE_batch_ok;
+    if (item->path)
+    {
+        buffer_len = 0;
+        error = load_batch_file(worker, item->path, &buffer_len);
+        buffer = worker->buffer;
+        /* The buffer is reused for the next file. */
+        read_options.flags &= ~SMRE_read_borrow_payloads;
+    }
+
+    if (error == SMRE_batch_ok)
+    {
+        if (smr_read_byte_array_checked(buffer, buffer_len, &read_options, midi_data) != 0)
+        {
+            memset(midi_data, 0, sizeof(*midi_data));
+            error = SMRE_batch_parse_failed;
+        }
+    }
+
+    worker->nfiles += 1;
+    worker->nbytes += buffer_len;
+    if (error == SMRE_batch_ok)
+    {
+        uint16_t track_index;
+
+        for (track_index = 0; track_index < midi_data->ntracks; ++track_index)
+        {
+            worker->nevents += get_track_nevents(midi_data, track_index);
+        }
+    }
+    else
+    {
+        worker->nfailed += 1;
+    }
+
+    if (read->errors)
+    {
+        read->errors[item_index] = error;
+    }
+
+    if (read->options && read->options->callback)
+    {
+        read->options->callback(read->first_item + item_index, error, midi_data, read->options->user);
+    }
+
+    if (!read->results)
+    {
+        smr_free_midi_data(midi_data);
+    }
+}
+
+static void* batch_read_worker(void* arg)
+{
+    struct smr_batch_read* read;
+    struct smr_batch_worker* worker;
+    uint32_t worker_index;
+    int was_muted;
+
+    read = (struct smr_batch_read*)arg;
+#ifdef SMR_ENABLE_THREADS
+    worker_index = __atomic_fetch_add(&read->next_worker, 1, __ATOMIC_RELAXED);
+#else
+    worker_index = read->next_worker++;
+#endif
+    worker = read->workers + worker_index;
+
+    was_muted = smr_log_muted;
+    smr_log_muted = 1;
+
+    for (;;)
+    {
+        uint32_t begin;
+        uint32_t end;
+        uint32_t i;
+
+        if (!take_batch_items(worker, 0, &begin, &end))
+        {
+            int found;
+
+            /* Out of work, steal half of someone else's. */
+            found = 0;
+            for (i = 1; i < read->nworkers && !found; ++i)
+            {
+                found = take_batch_items(read->workers + (worker_index + i) % read->nworkers, 1, &begin, &end);
+            }
+
+            if (!found)
+            {
+                break;
+            }
+
+            /* Stolen work goes in this worker's own range, so it can be
+               stolen in turn. */
+            SMR_ATOMIC_STORE(&worker->range, begin | ((uint64_t)end << 32));
+            continue;
+        }
+
+        for (i = begin; i < end; ++i)
+        {
+            read_batch_item(read, worker, i);
+        }
+    }
+
+    smr_log_muted = was_muted;
+
+    return NULL;
+}
+
+/* Reads items [0, nitems) of read->items, nitems fitting in 32 bits. */
+static void run_batch_read(struct smr_batch_read* read, uint32_t nitems)
+{
+#ifdef SMR_ENABLE_THREADS
+    pthread_t threads[SMR_MAX_THREADS];
+    uint32_t nstarted;
+#endif
+    uint32_t i;
+
+    /* Every worker starts with an even share. */
+    for (i = 0; i < read->nworkers; ++i)
+    {
+        uint64_t begin;
+        uint64_t end;
+
+        begin = (uint64_t)nitems * i / read->nworkers;
+        end = (uint64_t)nitems * (i + 1) / read->nworkers;
+        read->workers[i].range = begin | (end << 32);
+    }
+
+    read->next_worker = 0;
+
+#ifdef SMR_ENABLE_THREADS
+    for (nstarted = 0; nstarted + 1 < read->nworkers; ++nstarted)
+    {
+        /* Shares of threads that could not be started get stolen. */
+        if (pthread_create(threads + nstarted, NULL, batch_read_worker, read) != 0)
+        {
+            break;
+        }
+    }
+
+    batch_read_worker(read);
+
+    for (i = 0; i < nstarted; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    batch_read_worker(read);
+#endif
+}
+
+int smr_read_batch(const struct smr_batch_item* items, uint64_t nitems, const struct smr_batch_options* options, struct smr_midi_data* results, enum smr_batch_error* errors, struct smr_batch_stats* stats)
+{
+    struct smr_batch_read read;
+    struct smr_batch_worker workers[SMR_MAX_BATCH_WORKERS];
+    uint32_t nworkers;
+    uint64_t first_item;
+    uint64_t nfailed;
+    double start_time;
+    uint32_t i;
+
+    start_time = get_time_seconds();
+
+    nworkers = options ? options->nthreads : 0;
+#ifdef SMR_ENABLE_THREADS
+    if (nworkers == 0)
+    {
+        long num_cpus;
+
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = num_cpus > 0 ? (uint32_t)num_cpus : 1;
+    }
+
+    if (nworkers > SMR_MAX_THREADS)
+    {
+        nworkers = SMR_MAX_THREADS;
+    }
+#else
+    nworkers = 1;
+#endif
+
+    if (nworkers > nitems)
+    {
+        nworkers = nitems > 0 ? (uint32_t)nitems : 1;
+    }
+
+    memset(workers, 0, nworkers * sizeof(struct smr_batch_worker));
+    memset(&read, 0, sizeof(read));
+    read.options = options;
+    if (options && options->read_options)
+    {
+        read.read_options = *options->read_options;
+    }
+    read.read_options.flags &= ~SMRE_read_parallel;
+    read.workers = workers;
+    read.nworkers = nworkers;
+
+    /* Item indices are packed in 32 bits, run huge batches in slices. */
+    for (first_item = 0; first_item < nitems; first_item += 0xFFFFFFFFu)
+    {
+        uint64_t slice_items;
+
+        slice_items = nitems - first_item;
+        slice_items = slice_items < 0xFFFFFFFFu ? slice_items : 0xFFFFFFFFu;
+
+        read.items = items + first_item;
+        read.first_item = first_item;
+        read.results = results ? results + first_item : NULL;
+        read.errors = errors ? errors + first_item : NULL;
+        run_batch_read(&read, (uint32_t)slice_items);
+    }
+
+    if (stats)
+    {
+        memset(stats, 0, sizeof(*stats));
+    }
+
+    nfailed = 0;
+    for (i = 0; i < nworkers; ++i)
+    {
+        nfailed += workers[i].nfailed;
+        if (stats)
+        {
+            stats->nfiles += workers[i].nfiles;
+            stats->nfailed += workers[i].nfailed;
+            stats->nbytes += workers[i].nbytes;
+            stats->nevents += workers[i].nevents;
+        }
+
+        SMR_FREE(workers[i].buffer);
+    }
+
+    if (stats)
+    {
+        stats->seconds = get_time_seconds() - start_time;
+        if (stats->seconds > 0.0)
+        {
+            stats->files_per_second = stats->nfiles / stats->seconds;
+            stats->megabytes_per_second = stats->nbytes / (1000000.0 * stats->seconds);
+        }
+    }
+
+    return nfailed > 0;
+}
+
+int smr_build_timeline(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_timeline* timeline)
+{
+    uint64_t num_events;
+    uint64_t size;
+    int32_t i;
+
+    if (!file_data->tracks && !file_data->columns)
+    {
+        SMR_LOG("MIDI data has no events to merge.\n");
+        return 1;
+    }
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    num_events = 0;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        num_events += get_track_nevents(file_data, i);
+    }
+
+    /* The merge scratch goes after the entries, in the same allocation. */
+    size = num_events * sizeof(struct smr_timeline_entry) + get_merge_scratch_size(file_data->ntracks);
+    timeline->entries = (struct smr_timeline_entry*)allocator->alloc_func(size, allocator->user);
+    if (!timeline->entries)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI timeline.\n");
+        return 1;
+    }
+
+    timeline->nentries = num_events;
+    timeline->_mem_size = size;
+    timeline->_allocator = *allocator;
+    merge_timeline(file_data, timeline->entries, (uint8_t*)(timeline->entries + num_events));
+
+    return 0;
+}
+
+int smr_free_timeline(struct smr_timeline* timeline)
+{
+    if (timeline->_allocator.free_func)
+    {
+        timeline->_allocator.free_func(timeline->entries, timeline->_mem_size, timeline->_allocator.user);
+    }
+
+    timeline->entries = NULL;
+    timeline->nentries = 0;
+
+    return 0;
+}
+
+/* Index of the segment that holds tick. */
+static uint32_t find_tempo_segment(const struct smr_tempo_map* tempo_map, uint64_t tick)
+{
+    uint32_t low;
+    uint32_t count;
+
+    /* Branch free binary search for the last segment starting at or before
+       tick; the first one always starts at 0. */
+    low = 0;
+    count = tempo_map->nsegments;
+    while (count > 1)
+    {
+        uint32_t half;
+
+        half = count / 2;
+        low = tempo_map->segments[low + half].tick <= tick ? low + half : low;
+        count -= half;
+    }
+
+    return low;
+}
+
+/* Index of the segment that starts the latest at or before microseconds. */
+static uint32_t find_tempo_segment_by_time(const struct smr_tempo_map* tempo_map, double microseconds)
+{
+    uint32_t low;
+    uint32_t count;
+
+    low = 0;
+    count = tempo_map->nsegments;
+    while (count > 1)
+    {
+        uint32_t half;
+
+        half = count / 2;
+        low = tempo_map->segments[low + half].microseconds <= microseconds ? low + half : low;
+        count -= half;
+    }
+
+    return low;
+}
+
+int smr_build_tempo_map(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_tempo_map* tempo_map)
+{
+    struct smr_tempo_segment* segments;
+    uint32_t nsegments;
+    uint32_t max_segments;
+    uint64_t size;
+    int32_t i;
+    uint32_t j;
+
+    if (!file_data->tracks && !file_data->columns)
+    {
+        SMR_LOG("MIDI data has no events to read tempo from.\n");
+        return 1;
+    }
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    /* Count tempo events, plus the initial segment. */
+    max_segments = 1;
+    if (file_data->time_type == SMRE_metrical)
+    {
+        for (i = 0; i < file_data->ntracks; ++i)
+        {
+            uint32_t nevents;
+            uint32_t event_index;
+
+            nevents = file_data->columns ? file_data->columns[i].nother : file_data->tracks[i].nevents;
+            for (event_index = 0; event_index < nevents; ++event_index)
+            {
+                const struct smr_event* event;
+
+                event = file_data->columns ? file_data->columns[i].other + event_index : file_data->tracks[i].events + event_index;
+                max_segments += event->event_type == SMRE_meta_tempo;
+            }
+        }
+    }
+
+    size = max_segments * sizeof(struct smr_tempo_segment);
+    segments = (struct smr_tempo_segment*)allocator->alloc_func(size, allocator->user);
+    if (!segments)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI tempo map.\n");
+        return 1;
+    }
+
+    segments[0].tick = 0;
+    segments[0].microseconds = 0;
+    nsegments = 1;
+
+    if (file_data->time_type == SMRE_timecode)
+    {
+        double fps;
+
+        fps = file_data->fps == 29 ? 29.97 : file_data->fps;
+        segments[0].tempo = 0;
+        segments[0].microseconds_per_tick = 1000000.0 / (fps * (file_data->subframe_resolution ? file_data->subframe_resolution : 1));
+    }
+    else
+    {
+        uint16_t tickdiv;
+
+        tickdiv = file_data->tickdiv ? file_data->tickdiv : 1;
+        segments[0].tempo = 500000;
+        segments[0].microseconds_per_tick = 500000.0 / tickdiv;
+
+        for (i = 0; i < file_data->ntracks; ++i)
+        {
+            uint32_t nevents;
+            uint32_t event_index;
+            uint32_t other_index;
+            uint64_t tick;
+
+            /* Walk every event for the ticks, tempo events are usually in
+               one track and already in order, so inserting stays linear. */
+            nevents = get_track_nevents(file_data, i);
+            other_index = 0;
+            tick = 0;
+            for (event_index = 0; event_index < nevents; ++event_index)
+            {
+                const struct smr_event* event;
+                uint32_t insert_at;
+
+                if (file_data->columns)
+                {
+                    const struct smr_track_columns* columns;
+
+                    columns = file_data->columns + i;
+                    tick = columns->absolute_ticks ? columns->times[event_index] : tick + columns->times[event_index];
+                    if (columns->status[event_index] < 0xF0)
+                    {
+                        continue;
+                    }
+
+                    event = columns->other + other_index;
+                    other_index += 1;
+                }
+                else
+                {
+                    event = file_data->tracks[i].events + event_index;
+                    tick += event->delta_time;
+                }
+
+                if (event->event_type != SMRE_meta_tempo || event->tempo == 0)
+                {
+                    continue;
+                }
+
+                /* Later tracks come after earlier ones on the same tick, so the
+                   last one seen wins. */
+                insert_at = nsegments;
+                while (insert_at > 0 && segments[insert_at - 1].tick > tick)
+                {
+                    insert_at -= 1;
+                }
+
+                if (insert_at > 0 && segments[insert_at - 1].tick == tick)
+                {
+                    segments[insert_at - 1].tempo = event->tempo;
+                    continue;
+                }
+
+                memmove(segments + insert_at + 1, segments + insert_at, (nsegments - insert_at) * sizeof(struct smr_tempo_segment));
+                segments[insert_at].tick = tick;
+                segments[insert_at].tempo = event->tempo;
+                nsegments += 1;
+            }
+        }
+
+        for (j = 0; j < nsegments; ++j)
+        {
+            segments[j].microseconds_per_tick = (double)segments[j].tempo / tickdiv;
+            if (j > 0)
+            {
+                segments[j].microseconds = segments[j - 1].microseconds + (segments[j].tick - segments[j - 1].tick) * segments[j - 1].microseconds_per_tick;
+            }
+        }
+    }
+
+    tempo_map->nsegments = nsegments;
+    tempo_map->segments = segments;
+    tempo_map->_mem_size = size;
+    tempo_map->_allocator = *allocator;
+
+    return 0;
+}
+
+int smr_free_tempo_map(struct smr_tempo_map* tempo_map)
+{
+    if (tempo_map->_allocator.free_func)
+    {
+        tempo_map->_allocator.free_func(tempo_map->segments, tempo_map->_mem_size, tempo_map->_allocator.user);
+    }
+
+    tempo_map->segments = NULL;
+    tempo_map->nsegments = 0;
+
+    return 0;
+}
+
+double smr_tick_to_seconds(const struct smr_tempo_map* tempo_map, uint64_t tick)
+{
+    const struct smr_tempo_segment* segment;
+
+    segment = tempo_map->segments + find_tempo_segment(tempo_map, tick);
+    return (segment->microseconds + (tick - segment->tick) * segment->microseconds_per_tick) / 1000000.0;
+}
+
+uint64_t smr_seconds_to_tick(const struct smr_tempo_map* tempo_map, double seconds)
+{
+    const struct smr_tempo_segment* segment;
+    double microseconds;
+
+    if (seconds <= 0)
+    {
+        return 0;
+    }
+
+    microseconds = seconds * 1000000.0;
+    segment = tempo_map->segments + find_tempo_segment_by_time(tempo_map, microseconds);
+    return segment->tick + (uint64_t)((microseconds - segment->microseconds) / segment->microseconds_per_tick);
+}
+
+void smr_ticks_to_seconds(const struct smr_tempo_map* tempo_map, const uint64_t* ticks, double* seconds, uint64_t count)
+{
+    const struct smr_tempo_segment* segments;
+    uint32_t segment_index;
+    uint64_t segment_end;
+    uint64_t i;
+
+    segments = tempo_map->segments;
+    segment_index = 0;
+    segment_end = tempo_map->nsegments > 1 ? segments[1].tick : ~(uint64_t)0;
+
+    for (i = 0; i < count; ++i)
+    {
+        uint64_t tick;
+
+        tick = ticks[i];
+        /* Only search when the tick leaves the current segment, which for
+           sorted ticks is once per segment. */
+        if (tick < segments[segment_index].tick || tick >= segment_end)
+        {
+            segment_index = find_tempo_segment(tempo_map, tick);
+            segment_end = segment_index + 1 < tempo_map->nsegments ? segments[segment_index + 1].tick : ~(uint64_t)0;
+        }
+
+        seconds[i] = (segments[segment_index].microseconds + (tick - segments[segment_index].tick) * segments[segment_index].microseconds_per_tick) / 1000000.0;
+    }
+}
+
+static void reset_channel_states(struct smr_channel_state* channels)
+{
+    int32_t i;
+
+    memset(channels, 0, 16 * sizeof(struct smr_channel_state));
+    for (i = 0; i < 16; ++i)
+    {
+        channels[i].pitch_bend = 0x2000;
+        /* Volume, pan and expression. */
+        channels[i].controllers[7] = 100;
+        channels[i].controllers[10] = 64;
+        channels[i].controllers[11] = 127;
+    }
+}
+
+/* Gets a MIDI event of a track (or columns) as its status byte and data bytes
+   as they were in the file. Returns 0 for SysEx and meta events. */
+static int get_channel_event(const struct smr_midi_data* file_data, uint16_t track_index, uint32_t event_index, uint8_t* status_byte, uint8_t* data1, uint8_t* data2)
+{
+    const struct smr_event* event;
+
+    if (file_data->columns)
+    {
+        const struct smr_track_columns* columns;
+
+        columns = file_data->columns + track_index;
+        *status_byte = columns->status[event_index];
+        *data1 = columns->data[event_index] & 0xFF;
+        *data2 = columns->data[event_index] >> 8;
+
+        return *status_byte < 0xF0;
+    }
+
+    event = file_data->tracks[track_index].events + event_index;
+    if (event->event_type >= SMRE_sysex_single)
+    {
+        return 0;
+    }
+
+    *status_byte = (uint8_t)(event->event_type | event->channel);
+    switch (event->event_type)
+    {
+        case SMRE_midi_program_change:
+            *data1 = event->program;
+            *data2 = 0;
+            break;
+        case SMRE_midi_channel_pressure:
+            *data1 = event->pressure;
+            *data2 = 0;
+            break;
+        case SMRE_midi_pitch_bend:
+            /* pitch_bend holds the two data bytes big endian. */
+            *data1 = event->pitch_bend >> 8;
+            *data2 = event->pitch_bend & 0xFF;
+            break;
+        default:
+            *data1 = event->note;
+            *data2 = event->velocity;
+            break;
+    }
+
+    return 1;
+}
+
+/* Applies the event at entry to channels, if it changes channel state. */
+static void apply_channel_event(const struct smr_midi_data* file_data, const struct smr_timeline_entry* entry, struct smr_channel_state* channels)
+{
+    uint8_t status_byte;
+    uint8_t data1;
+    uint8_t data2;
+    struct smr_channel_state* channel;
+
+    if (!get_channel_event(file_data, entry->track_index, entry->event_index, &status_byte, &data1, &data2))
+    {
+        return;
+    }
+
+    channel = channels + (status_byte & 0x0F);
+    switch (status_byte & 0xF0)
+    {
+        case SMRE_midi_controller:
+            channel->controllers[data1 & 0x7F] = data2;
+            break;
+        case SMRE_midi_program_change:
+            channel->program = data1;
+            break;
+        case SMRE_midi_channel_pressure:
+            channel->pressure = data1;
+            break;
+        case SMRE_midi_pitch_bend:
+            channel->pitch_bend = (uint16_t)(((data2 & 0x7F) << 7) | (data1 & 0x7F));
+            break;
+        default:
+            /* Notes and everything else don't leave state behind. */
+            break;
+    }
+}
+
+int smr_build_seek_index(const struct smr_midi_data* file_data, uint32_t interval, const struct smr_allocator* allocator, struct smr_seek_index* seek_index)
+{
+    struct smr_timeline* timeline;
+    struct smr_channel_state channels[16];
+    struct smr_seek_snapshot* snapshot;
+    uint32_t* positions;
+    uint64_t max_snapshots;
+    uint64_t entry_index;
+    uint64_t next_snapshot;
+    uint32_t nsnapshots;
+    uint16_t ntracks;
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    if (interval == 0)
+    {
+        interval = 1024;
+    }
+
+    timeline = &seek_index->timeline;
+    if (smr_build_timeline(file_data, allocator, timeline) != 0)
+    {
+        return 1;
+    }
+
+    /* One at the start, then at most one per interval. The track positions
+       get one extra slot, for counting past the last snapshot. */
+    ntracks = file_data->ntracks;
+    max_snapshots = timeline->nentries / interval + 1;
+    seek_index->_mem_size = max_snapshots * sizeof(struct smr_seek_snapshot) + (max_snapshots + 1) * ntracks * sizeof(uint32_t);
+    seek_index->snapshots = (struct smr_seek_snapshot*)allocator->alloc_func(seek_index->_mem_size, allocator->user);
+    if (!seek_index->snapshots)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI seek index.\n");
+        smr_free_timeline(timeline);
+        return 1;
+    }
+
+    seek_index->track_positions = (uint32_t*)(seek_index->snapshots + max_snapshots);
+    seek_index->ntracks = ntracks;
+    seek_index->_allocator = *allocator;
+
+    reset_channel_states(channels);
+    snapshot = seek_index->snapshots;
+    snapshot->tick = 0;
+    snapshot->entry_index = 0;
+    memcpy(snapshot->channels, channels, sizeof(channels));
+    nsnapshots = 1;
+    next_snapshot = interval;
+
+    /* Events per track so far are counted in the slot of the next snapshot. */
+    positions = seek_index->track_positions;
+    memset(positions, 0, 2 * ntracks * sizeof(uint32_t));
+    positions += ntracks;
+
+    for (entry_index = 0; entry_index < timeline->nentries; ++entry_index)
+    {
+        const struct smr_timeline_entry* entry;
+
+        entry = timeline->entries + entry_index;
+
+        /* Snapshot on the first tick change at or after the interval. */
+        if (entry_index >= next_snapshot && entry[-1].tick < entry->tick)
+        {
+            snapshot = seek_index->snapshots + nsnapshots;
+            snapshot->tick = entry->tick;
+            snapshot->entry_index = entry_index;
+            memcpy(snapshot->channels, channels, sizeof(channels));
+            nsnapshots += 1;
+            next_snapshot = entry_index + interval;
+
+            memcpy(positions + ntracks, positions, ntracks * sizeof(uint32_t));
+            positions += ntracks;
+        }
+
+        apply_channel_event(file_data, entry, channels);
+        positions[entry->track_index] += 1;
+    }
+
+    seek_index->nsnapshots = nsnapshots;
+
+    return 0;
+}
+
+int smr_free_seek_index(struct smr_seek_index* seek_index)
+{
+    if (seek_index->_allocator.free_func)
+    {
+        seek_index->_allocator.free_func(seek_index->snapshots, seek_index->_mem_size, seek_index->_allocator.user);
+    }
+
+    smr_free_timeline(&seek_index->timeline);
+    seek_index->snapshots = NULL;
+    seek_index->track_positions = NULL;
+    seek_index->nsnapshots = 0;
+
+    return 0;
+}
+
+int smr_seek(const struct smr_seek_index* seek_index, const struct smr_midi_data* file_data, uint64_t tick, struct smr_channel_state* channels, uint32_t* track_positions, uint64_t* entry_index)
+{
+    const struct smr_seek_snapshot* snapshot;
+    const struct smr_timeline* timeline;
+    uint32_t low;
+    uint32_t count;
+    uint64_t index;
+
+    if (file_data->ntracks != seek_index->ntracks)
+    {
+        SMR_LOG("Seek index was built for different MIDI data.\n");
+        return 1;
+    }
+
+    /* Last snapshot at or before tick; the first one is at 0. */
+    low = 0;
+    count = seek_index->nsnapshots;
+    while (count > 1)
+    {
+        uint32_t half;
+
+        half = count / 2;
+        low = seek_index->snapshots[low + half].tick <= tick ? low + half : low;
+        count -= half;
+    }
+
+    snapshot = seek_index->snapshots + low;
+    memcpy(channels, snapshot->channels, sizeof(snapshot->channels));
+    if (track_positions)
+    {
+        memcpy(track_positions, seek_index->track_positions + (uint64_t)low * seek_index->ntracks, seek_index->ntracks * sizeof(uint32_t));
+    }
+
+    /* Replay the tail. */
+    timeline = &seek_index->timeline;
+    for (index = snapshot->entry_index; index < timeline->nentries && timeline->entries[index].tick < tick; ++index)
+    {
+        const struct smr_timeline_entry* entry;
+
+        entry = timeline->entries + index;
+        apply_channel_event(file_data, entry, channels);
+        if (track_positions)
+        {
+            track_positions[entry->track_index] = entry->event_index + 1;
+        }
+    }
+
+    if (entry_index)
+    {
+        *entry_index = index;
+    }
+
+    return 0;
+}
+
+#define SMR_NO_SPAN 0xFFFFFFFF
+
+/* Ends the pending span at span_index at tick. */
+static void end_note_span(struct smr_note_spans* spans, uint32_t span_index, uint64_t tick)
+{
+    uint64_t duration;
+
+    duration = tick - spans->starts[span_index];
+    spans->durations[span_index] = duration < 0xFFFFFFFF ? (uint32_t)duration : 0xFFFFFFFF;
+}
+
+int smr_extract_note_spans(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_note_spans* spans)
+{
+    uint32_t* pending;
+    uint64_t nspans;
+    int32_t i;
+
+    if (!file_data->tracks && !file_data->columns)
+    {
+        SMR_LOG("MIDI data has no events to read notes from.\n");
+        return 1;
+    }
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    /* Count note ons first, so the spans fit in one exact allocation. */
+    nspans = 0;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        uint32_t nevents;
+        uint32_t event_index;
+
+        nevents = get_track_nevents(file_data, i);
+        for (event_index = 0; event_index < nevents; ++event_index)
+        {
+            uint8_t status_byte;
+            uint8_t data1;
+            uint8_t data2;
+
+            if (get_channel_event(file_data, i, event_index, &status_byte, &data1, &data2))
+            {
+                nspans += (status_byte & 0xF0) == SMRE_midi_note_on && data2 > 0;
+            }
+        }
+    }
+
+    if (nspans >= SMR_NO_SPAN)
+    {
+        SMR_LOG("Too many notes to pair up.\n");
+        return 1;
+    }
+
+    spans->_mem_size = nspans * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) + 3 * sizeof(uint8_t));
+    spans->starts = (uint64_t*)allocator->alloc_func(spans->_mem_size ? spans->_mem_size : 1, allocator->user);
+    /* Heads and tails of a queue of pending spans for every channel and note. */
+    pending = (uint32_t*)allocator->alloc_func(2 * 16 * 128 * sizeof(uint32_t), allocator->user);
+    if (!spans->starts || !pending)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI note spans.\n");
+        if (spans->starts)
+        {
+            allocator->free_func(spans->starts, spans->_mem_size ? spans->_mem_size : 1, allocator->user);
+        }
+
+        if (pending)
+        {
+            allocator->free_func(pending, 2 * 16 * 128 * sizeof(uint32_t), allocator->user);
+        }
+
+        return 1;
+    }
+
+    spans->nspans = nspans;
+    spans->durations = (uint32_t*)(spans->starts + nspans);
+    spans->tracks = (uint16_t*)(spans->durations + nspans);
+    spans->notes = (uint8_t*)(spans->tracks + nspans);
+    spans->velocities = spans->notes + nspans;
+    spans->channels = spans->velocities + nspans;
+    spans->_allocator = *allocator;
+
+    nspans = 0;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        uint32_t nevents;
+        uint32_t event_index;
+        uint64_t tick;
+        int absolute_ticks;
+        int32_t key;
+
+        /* While a span is pending, its duration holds the next pending span
+           of the same key, so queues need no memory of their own. */
+        memset(pending, 0xFF, 2 * 16 * 128 * sizeof(uint32_t));
+        nevents = get_track_nevents(file_data, i);
+        absolute_ticks = file_data->columns && file_data->columns[i].absolute_ticks;
+        tick = 0;
+
+        for (event_index = 0; event_index < nevents; ++event_index)
+        {
+            uint8_t status_byte;
+            uint8_t data1;
+            uint8_t data2;
+            uint32_t span_index;
+
+            tick = absolute_ticks ? get_event_time(file_data, i, event_index) : tick + get_event_time(file_data, i, event_index);
+            if (!get_channel_event(file_data, i, event_index, &status_byte, &data1, &data2))
+            {
+                continue;
+            }
+
+            key = ((status_byte & 0x0F) << 7) | (data1 & 0x7F);
+            if ((status_byte & 0xF0) == SMRE_midi_note_on && data2 > 0)
+            {
+                span_index = (uint32_t)nspans;
+                nspans += 1;
+                spans->starts[span_index] = tick;
+                spans->durations[span_index] = SMR_NO_SPAN;
+                spans->tracks[span_index] = (uint16_t)i;
+                spans->notes[span_index] = data1;
+                spans->velocities[span_index] = data2;
+                spans->channels[span_index] = status_byte & 0x0F;
+
+                if (pending[key] == SMR_NO_SPAN)
+                {
+                    pending[key] = span_index;
+                }
+                else
+                {
+                    spans->durations[pending[2048 + key]] = span_index;
+                }
+
+                pending[2048 + key] = span_index;
+            }
+            else if ((status_byte & 0xF0) == SMRE_midi_note_off || (status_byte & 0xF0) == SMRE_midi_note_on)
+            {
+                span_index = pending[key];
+                if (span_index == SMR_NO_SPAN)
+                {
+                    /* Note off without a note on. */
+                    continue;
+                }
+
+                pending[key] = spans->durations[span_index];
+                end_note_span(spans, span_index, tick);
+            }
+        }
+
+        for (key = 0; key < 2048; ++key)
+        {
+            uint32_t span_index;
+
+            span_index = pending[key];
+            while (span_index != SMR_NO_SPAN)
+            {
+                uint32_t next;
+
+                next = spans->durations[span_index];
+                end_note_span(spans, span_index, tick);
+                span_index = next;
+            }
+        }
+    }
+
+    allocator->free_func(pending, 2 * 16 * 128 * sizeof(uint32_t), allocator->user);
+
+    return 0;
+}
+
+int smr_free_note_spans(struct smr_note_spans* spans)
+{
+    if (spans->_allocator.free_func)
+    {
+        spans->_allocator.free_func(spans->starts, spans->_mem_size ? spans->_mem_size : 1, spans->_allocator.user);
+    }
+
+    spans->starts = NULL;
+    spans->nspans = 0;
+
+    return 0;
+}
+
+/* smr_compute_stats keeps this many copies of every histogram, events taking
+   turns, so that a run of the same note doesn't wait on its own increments.
+   The copies are summed up at the end of every track. */
+#define SMR_STATS_BANKS 4
+
+struct smr_stats_banks
+{
+    uint32_t pitches[SMR_STATS_BANKS][128];
+    uint32_t velocities[SMR_STATS_BANKS][128];
+    uint32_t controllers[SMR_STATS_BANKS][128];
+    uint32_t channel_notes[SMR_STATS_BANKS][16];
+};
+
+/* What smr_compute_stats tracks while going through one track. Note ons and
+   offs go to changes as tick << 1, plus 1 for a note on. */
+struct smr_stats_track
+{
+    struct smr_stats_banks banks;
+    /* Notes sounding per channel and note, and in all. */
+    uint32_t sounding[16 * 128];
+    uint32_t nsounding;
+    uint64_t* changes;
+};
+
+/* Counts the MIDI event status_byte, data1, data2 at tick into bank. */
+static inline void count_stats_event(struct smr_stats_track* track, uint32_t bank, uint64_t tick, uint8_t status_byte, uint8_t data1, uint8_t data2)
+{
+    uint8_t status_byte_top;
+    uint32_t key;
+
+    status_byte_top = status_byte & 0xF0;
+    key = ((status_byte & 0x0F) << 7) | (data1 & 0x7F);
+    if (status_byte_top == SMRE_midi_note_on && data2 > 0)
+    {
+        track->banks.pitches[bank][data1 & 0x7F] += 1;
+        track->banks.velocities[bank][data2 & 0x7F] += 1;
+        track->banks.channel_notes[bank][status_byte & 0x0F] += 1;
+        track->sounding[key] += 1;
+        track->nsounding += 1;
+        *track->changes++ = tick << 1 | 1;
+    }
+    else if (status_byte_top == SMRE_midi_note_off || status_byte_top == SMRE_midi_note_on)
+    {
+        /* A note off without a note on doesn't count. */
+        if (track->sounding[key] > 0)
+        {
+            track->sounding[key] -= 1;
+            track->nsounding -= 1;
+            *track->changes++ = tick << 1;
+        }
+    }
+    else if (status_byte_top == SMRE_midi_controller)
+    {
+        track->banks.controllers[bank][data1 & 0x7F] += 1;
+    }
+}
+
+/* Adds the count copies of count histogram entries in banks up into totals. */
+static void add_stats_banks(const uint32_t* banks, uint32_t count, uint64_t* totals)
+{
+    uint32_t i;
+    uint32_t bank;
+
+#ifdef SMR_HAS_SSE2
+    /* The copies together can't count more than the track has events, so their
+       sum fits 32 bits, and only widens to 64 once. */
+    for (i = 0; i < count; i += 4)
+    {
+        __m128i sum;
+        __m128i total;
+
+        sum = _mm_loadu_si128((const __m128i*)(banks + i));
+        for (bank = 1; bank < SMR_STATS_BANKS; ++bank)
+        {
+            sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(banks + bank * count + i)));
+        }
+
+        total = _mm_loadu_si128((const __m128i*)(totals + i));
+        _mm_storeu_si128((__m128i*)(totals + i), _mm_add_epi64(total, _mm_unpacklo_epi32(sum, _mm_setzero_si128())));
+        total = _mm_loadu_si128((const __m128i*)(totals + i + 2));
+        _mm_storeu_si128((__m128i*)(totals + i + 2), _mm_add_epi64(total, _mm_unpackhi_epi32(sum, _mm_setzero_si128())));
+    }
+#else
+    for (i = 0; i < count; ++i)
+    {
+        for (bank = 0; bank < SMR_STATS_BANKS; ++bank)
+        {
+            totals[i] += banks[bank * count + i];
+        }
+    }
+#endif
+}
+
+/* Index of the lowest set bit of mask, which can't be 0. */
+static inline uint32_t get_lowest_bit(uint32_t mask)
+{
+#if defined(__GNUC__)
+    return (uint32_t)__builtin_ctz(mask);
+#else
+    uint32_t bit;
+
+    bit = 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        bit += 1;
+    }
+
+    return bit;
+#endif
+}
+
+/* The columns of one track for smr_compute_stats. Only note ons, note offs and
+   controllers count, and with SSE2 those are found 16 status bytes at a time,
+   so everything else costs nothing but adding up its delta time. Returns the
+   track's last tick. */
+static uint64_t count_stats_columns(const struct smr_track_columns* columns, struct smr_stats_track* track)
+{
+    uint64_t tick;
+    uint32_t event_index;
+    uint32_t added;
+
+    tick = 0;
+    event_index = 0;
+    /* Delta times before this one are in tick already. */
+    added = 0;
+
+#ifdef SMR_HAS_SSE2
+    for (; event_index + 16 <= columns->nevents; event_index += 16)
+    {
+        __m128i status;
+        __m128i top;
+        uint32_t mask;
+
+        status = _mm_loadu_si128((const __m128i*)(columns->status + event_index));
+        top = _mm_and_si128(status, _mm_set1_epi8((char)0xF0));
+        mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(top, _mm_set1_epi8((char)SMRE_midi_note_on)), _mm_cmpeq_epi8(top, _mm_set1_epi8((char)SMRE_midi_note_off))), _mm_cmpeq_epi8(top, _mm_set1_epi8((char)SMRE_midi_controller))));
+        while (mask)
+        {
+            uint32_t i;
+
+            i = event_index + get_lowest_bit(mask);
+            mask &= mask - 1;
+            if (columns->absolute_ticks)
+            {
+                tick = columns->times[i];
+            }
+            else
+            {
+                for (; added <= i; ++added)
+                {
+                    tick += columns->times[added];
+                }
+            }
+
+            count_stats_event(track, i & (SMR_STATS_BANKS - 1), tick, columns->status[i], columns->data[i] & 0xFF, columns->data[i] >> 8);
+        }
+    }
+#endif
+
+    for (; event_index < columns->nevents; ++event_index)
+    {
+        if (columns->absolute_ticks)
+        {
+            tick = columns->times[event_index];
+        }
+        else
+        {
+            for (; added <= event_index; ++added)
+            {
+                tick += columns->times[added];
+            }
+        }
+
+        if (columns->status[event_index] < 0xF0)
+        {
+            count_stats_event(track, event_index & (SMR_STATS_BANKS - 1), tick, columns->status[event_index], columns->data[event_index] & 0xFF, columns->data[event_index] >> 8);
+        }
+    }
+
+    if (columns->absolute_ticks)
+    {
+        return columns->nevents > 0 ? columns->times[columns->nevents - 1] : 0;
+    }
+
+    for (; added < columns->nevents; ++added)
+    {
+        tick += columns->times[added];
+    }
+
+    return tick;
+}
+
+/* The events of one track for smr_compute_stats. Returns the track's last
+   tick. */
+static uint64_t count_stats_events(const struct smr_track_data* track_data, struct smr_stats_track* track)
+{
+    uint64_t tick;
+    uint32_t event_index;
+
+    tick = 0;
+    for (event_index = 0; event_index < track_data->nevents; ++event_index)
+    {
+        const struct smr_event* event;
+
+        event = track_data->events + event_index;
+        tick += event->delta_time;
+        /* Note and controller events keep their data bytes in note and
+           velocity, the others don't count. */
+        if (event->event_type < SMRE_sysex_single)
+        {
+            count_stats_event(track, event_index & (SMR_STATS_BANKS - 1), tick, (uint8_t)(event->event_type | event->channel), event->note, event->velocity);
+        }
+    }
+
+    return tick;
+}
+
+/* Finds the most notes sounding at once from nchanges note changes sorted by
+   tick, only counting what sounds once a tick is over: notes that start and
+   end on the same tick never sound along with anything. */
+static void find_max_polyphony(const uint64_t* changes, uint64_t nchanges, struct smr_stats* stats)
+{
+    uint64_t tick;
+    uint64_t i;
+    int64_t nsounding;
+
+    tick = 0;
+    nsounding = 0;
+    for (i = 0; i < nchanges; ++i)
+    {
+        if (changes[i] >> 1 != tick)
+        {
+            if (nsounding > stats->max_polyphony)
+            {
+                stats->max_polyphony = (uint32_t)nsounding;
+                stats->max_polyphony_tick = tick;
+            }
+
+            tick = changes[i] >> 1;
+        }
+
+        nsounding += (int64_t)((changes[i] & 1) << 1) - 1;
+    }
+
+    if (nsounding > stats->max_polyphony)
+    {
+        stats->max_polyphony = (uint32_t)nsounding;
+        stats->max_polyphony_tick = tick;
+    }
+}
+
+/* The same for files whose ticks are few next to their changes, which then
+   needn't be sorted: each tick gets the net change in notes it makes, and a
+   running sum over the ticks gives what sounds once each one is over. deltas
+   holds duration_ticks + 1. */
+static void find_max_polyphony_dense(const uint64_t* changes, uint64_t nchanges, uint64_t duration_ticks, int32_t* deltas, struct smr_stats* stats)
+{
+    uint64_t i;
+    int64_t nsounding;
+
+    memset(deltas, 0, (duration_ticks + 1) * sizeof(int32_t));
+    for (i = 0; i < nchanges; ++i)
+    {
+        deltas[changes[i] >> 1] += (int32_t)((changes[i] & 1) << 1) - 1;
+    }
+
+    nsounding = 0;
+    for (i = 0; i <= duration_ticks; ++i)
+    {
+        nsounding += deltas[i];
+        if (nsounding > stats->max_polyphony)
+        {
+            stats->max_polyphony = (uint32_t)nsounding;
+            stats->max_polyphony_tick = i;
+        }
+    }
+}
+
+/* Merges the nruns runs of values, each sorted already on value >> shift and
+   starting at the offset runs holds for it, two at a time until one is left.
+   Equal values keep their order. scratch holds as many values as values.
+   Returns whichever of the two the result is in. */
+static uint64_t* merge_sorted_runs(uint64_t* values, uint64_t* scratch, uint64_t* runs, uint64_t nruns, uint32_t shift)
+{
+    while (nruns > 1)
+    {
+        uint64_t* swap;
+        uint64_t run_index;
+
+        for (run_index = 0; run_index < nruns; run_index += 2)
+        {
+            uint64_t left;
+            uint64_t left_end;
+            uint64_t right;
+            uint64_t right_end;
+            uint64_t out;
+
+            left = runs[run_index];
+            left_end = run_index + 1 < nruns ? runs[run_index + 1] : runs[nruns];
+            right = left_end;
+            right_end = run_index + 1 < nruns ? runs[run_index + 2] : left_end;
+            out = left;
+            while (left < left_end && right < right_end)
+            {
+                if (values[right] >> shift < values[left] >> shift)
+                {
+                    scratch[out++] = values[right++];
+                }
+                else
+                {
+                    scratch[out++] = values[left++];
+                }
+            }
+
+            memcpy(scratch + out, values + left, (left_end - left) * sizeof(uint64_t));
+            out += left_end - left;
+            memcpy(scratch + out, values + right, (right_end - right) * sizeof(uint64_t));
+            runs[run_index / 2] = runs[run_index];
+        }
+
+        runs[(nruns + 1) / 2] = runs[nruns];
+        nruns = (nruns + 1) / 2;
+        swap = values;
+        values = scratch;
+        scratch = swap;
+    }
+
+    return values;
+}
+
+int smr_compute_stats(const struct smr_midi_data* file_data, const struct smr_allocator* allocator, struct smr_stats* stats)
+{
+    struct smr_stats_track* track;
+    struct smr_tempo_map tempo_map;
+    uint64_t* changes;
+    uint64_t* runs;
+    uint64_t* scratch;
+    uint64_t num_events;
+    uint64_t nchanges;
+    uint64_t size;
+    uint64_t scratch_size;
+    int dense;
+    int32_t i;
+
+    if (!file_data->tracks && !file_data->columns)
+    {
+        SMR_LOG("MIDI data has no events to compute statistics of.\n");
+        return 1;
+    }
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    num_events = 0;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        num_events += get_track_nevents(file_data, i);
+    }
+
+    /* The per track counters, where each track's changes start, then a note
+       change per event at most. Notes a track leaves on end with it, which
+       takes a change each on top. */
+    size = sizeof(struct smr_stats_track) + (file_data->ntracks + 1 + 2 * num_events) * sizeof(uint64_t);
+    track = (struct smr_stats_track*)allocator->alloc_func(size, allocator->user);
+    if (!track)
+    {
+        SMR_LOG("Unable to allocate memory for MIDI statistics.\n");
+        return 1;
+    }
+
+    runs = (uint64_t*)(track + 1);
+    changes = runs + file_data->ntracks + 1;
+    memset(stats, 0, sizeof(*stats));
+    track->changes = changes;
+    for (i = 0; i < file_data->ntracks; ++i)
+    {
+        uint64_t end;
+
+        memset(&track->banks, 0, sizeof(track->banks));
+        memset(track->sounding, 0, sizeof(track->sounding));
+        track->nsounding = 0;
+        runs[i] = (uint64_t)(track->changes - changes);
+
+        end = file_data->columns ? count_stats_columns(file_data->columns + i, track) : count_stats_events(file_data->tracks + i, track);
+        for (; track->nsounding > 0; --track->nsounding)
+        {
+            *track->changes++ = end << 1;
+        }
+
+        if (end > stats->duration_ticks)
+        {
+            stats->duration_ticks = end;
+        }
+
+        add_stats_banks(track->banks.pitches[0], 128, stats->pitches);
+        add_stats_banks(track->banks.velocities[0], 128, stats->velocities);
+        add_stats_banks(track->banks.controllers[0], 128, stats->controllers);
+        add_stats_banks(track->banks.channel_notes[0], 16, stats->channel_notes);
+    }
+
+    /* Each track's changes are in order already, so they only need merging,
+       into as much room again. A counter per tick is cheaper still while there
+       aren't many more ticks than changes, which is how most files are. */
+    nchanges = (uint64_t)(track->changes - changes);
+    runs[file_data->ntracks] = nchanges;
+    dense = stats->duration_ticks < 4 * nchanges + 4096;
+    scratch_size = dense ? (stats->duration_ticks + 1) * sizeof(int32_t) : nchanges * sizeof(uint64_t);
+    scratch = NULL;
+    if (dense || file_data->ntracks > 1)
+    {
+        scratch = (uint64_t*)allocator->alloc_func(scratch_size, allocator->user);
+        if (!scratch)
+        {
+            SMR_LOG("Unable to allocate memory for MIDI statistics.\n");
+            allocator->free_func(track, size, allocator->user);
+            return 1;
+        }
+    }
+
+    if (dense)
+    {
+        find_max_polyphony_dense(changes, nchanges, stats->duration_ticks, (int32_t*)scratch, stats);
+    }
+    else
+    {
+        /* Only the tick counts, not whether a note starts or ends there. */
+        find_max_polyphony(merge_sorted_runs(changes, scratch, runs, file_data->ntracks, 1), nchanges, stats);
+    }
+
+    if (scratch)
+    {
+        allocator->free_func(scratch, scratch_size, allocator->user);
+    }
+    allocator->free_func(track, size, allocator->user);
+
+    for (i = 0; i < 128; ++i)
+    {
+        stats->nnotes += stats->pitches[i];
+        stats->pitch_classes[i % 12] += stats->pitches[i];
+    }
+
+    if (smr_build_tempo_map(file_data, allocator, &tempo_map) != 0)
+    {
+        return 1;
+    }
+
+    stats->duration_seconds = smr_tick_to_seconds(&tempo_map, stats->duration_ticks);
+    smr_free_tempo_map(&tempo_map);
+    for (i = 0; i < 16; ++i)
+    {
+        stats->channel_density[i] = stats->duration_seconds > 0 ? stats->channel_notes[i] / stats->duration_seconds : 0;
+    }
+
+    return 0;
+}
+
+/* The steps of a transform pipeline folded together per status byte: the
+   status byte it becomes, and the rows its data bytes are looked up in. */
+struct smr_transform_tables
+{
+    uint8_t status[256];
+    const uint8_t* data1[256];
+    const uint8_t* data2[256];
+    /* Bytes left as they are, then the notes and the velocities of each
+       channel events start out on. */
+    uint8_t rows[1 + 2 * 16][256];
+};
+
+/* A quantize step, with the channels it applies to as events start out. */
+struct smr_quantize_step
+{
+    uint32_t grid;
+    uint16_t channels;
+};
+
+/* Folds transforms into tables, and its quantize steps into steps. Since a
+   step only ever sees what the steps before it made of an event, following
+   each of the 16 channels through them is enough. */
+static void build_transform_tables(const struct smr_transform* transforms, uint32_t ntransforms, struct smr_transform_tables* tables, struct smr_quantize_step* steps)
+{
+    uint8_t channels[16];
+    uint32_t nsteps;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < 1 + 2 * 16; ++i)
+    {
+        for (j = 0; j < 256; ++j)
+        {
+            tables->rows[i][j] = (uint8_t)j;
+        }
+    }
+
+    for (i = 0; i < 16; ++i)
+    {
+        channels[i] = (uint8_t)i;
+    }
+
+    nsteps = 0;
+    for (i = 0; i < ntransforms; ++i)
+    {
+        const struct smr_transform* transform;
+        uint16_t applies_to;
+        uint32_t channel;
+
+        transform = transforms + i;
+        applies_to = transform->channels ? transform->channels : 0xFFFF;
+        if (transform->type == SMRE_transform_quantize)
+        {
+            steps[nsteps].grid = transform->grid;
+            steps[nsteps].channels = 0;
+        }
+
+        for (channel = 0; channel < 16; ++channel)
+        {
+            uint8_t* notes;
+            uint8_t* velocities;
+
+            if (!((applies_to >> channels[channel]) & 1))
+            {
+                continue;
+            }
+
+            notes = tables->rows[1 + channel];
+            velocities = tables->rows[1 + 16 + channel];
+            if (transform->type == SMRE_transform_transpose)
+            {
+                for (j = 0; j < 128; ++j)
+                {
+                    int64_t note;
+
+                    note = (int64_t)notes[j] + transform->semitones;
+                    notes[j] = (uint8_t)(note < 0 ? 0 : note > 127 ? 127 : note);
+                }
+            }
+            else if (transform->type == SMRE_transform_velocity)
+            {
+                /* 0 is a note off, and stays one. */
+                for (j = 1; j < 128; ++j)
+                {
+                    uint8_t velocity;
+
+                    velocity = transform->velocities[velocities[j]];
+                    velocities[j] = velocity < 1 ? 1 : velocity > 127 ? 127 : velocity;
+                }
+            }
+            else if (transform->type == SMRE_transform_channel_remap)
+            {
+                channels[channel] = transform->channel_map[channels[channel]] & 0x0F;
+            }
+            else
+            {
+                steps[nsteps].channels |= (uint16_t)(1 << channel);
+            }
+        }
+
+        if (transform->type == SMRE_transform_quantize)
+        {
+            nsteps += 1;
+        }
+    }
+
+    for (i = 0; i < 256; ++i)
+    {
+        uint8_t status_byte_top;
+        uint8_t channel;
+
+        status_byte_top = i & 0xF0;
+        channel = i & 0x0F;
+        tables->status[i] = (uint8_t)i;
+        tables->data1[i] = tables->rows[0];
+        tables->data2[i] = tables->rows[0];
+        if (status_byte_top < 0x80 || status_byte_top == 0xF0)
+        {
+            continue;
+        }
+
+        tables->status[i] = status_byte_top | channels[channel];
+        if (status_byte_top <= SMRE_midi_polyphonic_pressure)
+        {
+            tables->data1[i] = tables->rows[1 + channel];
+        }
+
+        if (status_byte_top == SMRE_midi_note_on)
+        {
+            tables->data2[i] = tables->rows[1 + 16 + channel];
+        }
+    }
+}
+
+/* Where the quantize steps put a note on or off at tick on channel (as it
+   started out), at most end. */
+static uint64_t quantize_tick(const struct smr_quantize_step* steps, uint32_t nsteps, uint8_t channel, uint64_t tick, uint64_t end)
+{
+    uint32_t i;
+
+    for (i = 0; i < nsteps; ++i)
+    {
+        if ((steps[i].channels >> channel) & 1)
+        {
+            tick = (tick + steps[i].grid / 2) / steps[i].grid * steps[i].grid;
+        }
+    }
+
+    return tick < end ? tick : end;
+}
+
+/* Runs tables over the events of track_data. With keys, each event's tick
+   after quantizing also goes into keys above its index. Returns 1 if that
+   put events out of order. */
+static int transform_track_events(struct smr_track_data* track_data, const struct smr_transform_tables* tables, const struct smr_quantize_step* steps, uint32_t nsteps, uint64_t end, uint64_t* keys)
+{
+    uint64_t tick;
+    uint64_t last_key;
+    uint32_t event_index;
+    int unsorted;
+
+    tick = 0;
+    last_key = 0;
+    unsorted = 0;
+    for (event_index = 0; event_index < track_data->nevents; ++event_index)
+    {
+        struct smr_event* event;
+        uint64_t new_tick;
+
+        event = track_data->events + event_index;
+        tick += event->delta_time;
+        new_tick = tick;
+        if (event->event_type < SMRE_sysex_single)
+        {
+            uint8_t status_byte;
+
+            status_byte = (uint8_t)(event->event_type | event->channel);
+            if (keys && event->event_type <= SMRE_midi_note_on)
+            {
+                new_tick = quantize_tick(steps, nsteps, event->channel, tick, end);
+            }
+
+            /* Pitch bends share these bytes, whose rows leave them alone. */
+            event->note = tables->data1[status_byte][event->note];
+            event->velocity = tables->data2[status_byte][event->velocity];
+            event->channel = tables->status[status_byte] & 0x0F;
+        }
+
+        if (keys)
+        {
+            keys[event_index] = new_tick << 32 | event_index;
+            unsorted |= keys[event_index] < last_key;
+            last_key = keys[event_index];
+        }
+    }
+
+    return unsorted;
+}
+
+/* The same over columns. */
+static int transform_track_columns(struct smr_track_columns* columns, const struct smr_transform_tables* tables, const struct smr_quantize_step* steps, uint32_t nsteps, uint64_t end, uint64_t* keys)
+{
+    const uint32_t* times;
+    uint8_t* status;
+    uint16_t* data;
+    uint64_t tick;
+    uint64_t last_key;
+    uint32_t nevents;
+    uint32_t event_index;
+    int absolute_ticks;
+    int unsorted;
+
+    /* In locals, since stores to status could alias the columns otherwise. */
+    times = columns->times;
+    status = columns->status;
+    data = columns->data;
+    nevents = columns->nevents;
+    absolute_ticks = columns->absolute_ticks;
+    if (!keys)
+    {
+        for (event_index = 0; event_index < nevents; ++event_index)
+        {
+            uint8_t status_byte;
+            uint16_t data_bytes;
+
+            status_byte = status[event_index];
+            data_bytes = data[event_index];
+            data[event_index] = (uint16_t)(tables->data1[status_byte][data_bytes & 0xFF] | tables->data2[status_byte][data_bytes >> 8] << 8);
+            status[event_index] = tables->status[status_byte];
+        }
+
+        return 0;
+    }
+
+    tick = 0;
+    last_key = 0;
+    unsorted = 0;
+    for (event_index = 0; event_index < nevents; ++event_index)
+    {
+        uint8_t status_byte;
+        uint16_t data_bytes;
+        uint64_t new_tick;
+
+        tick = absolute_ticks ? times[event_index] : tick + times[event_index];
+        status_byte = status[event_index];
+        data_bytes = data[event_index];
+        data[event_index] = (uint16_t)(tables->data1[status_byte][data_bytes & 0xFF] | tables->data2[status_byte][data_bytes >> 8] << 8);
+        status[event_index] = tables->status[status_byte];
+        new_tick = (status_byte & 0xE0) == SMRE_midi_note_off ? quantize_tick(steps, nsteps, status_byte & 0x0F, tick, end) : tick;
+        keys[event_index] = new_tick << 32 | event_index;
+        unsorted |= keys[event_index] < last_key;
+        last_key = keys[event_index];
+    }
+
+    return unsorted;
+}
+
+/* Tick of the last event of track track_index. */
+static uint64_t get_track_end_tick(const struct smr_midi_data* file_data, uint16_t track_index)
+{
+    uint64_t end;
+    uint32_t event_index;
+
+    end = 0;
+    if (file_data->columns)
+    {
+        const struct smr_track_columns* columns;
+
+        columns = file_data->columns + track_index;
+        if (columns->absolute_ticks)
+        {
+            return columns->nevents > 0 ? columns->times[columns->nevents - 1] : 0;
+        }
+
+        for (event_index = 0; event_index < columns->nevents; ++event_index)
+        {
+            end += columns->times[event_index];
+        }
+
+        return end;
+    }
+
+    for (event_index = 0; event_index < file_data->tracks[track_index].nevents; ++event_index)
+    {
+        end += file_data->tracks[track_index].events[event_index].delta_time;
+    }
+
+    return end;
+}
+
+/* Sorts nkeys keys, which mostly are in order already, by merging the runs
+   that are. runs holds nkeys + 1 offsets. Returns whichever of keys and
+   scratch the result is in. */
+static uint64_t* sort_transform_keys(uint64_t* keys, uint64_t* scratch, uint64_t* runs, uint32_t nkeys)
+{
+    uint64_t nruns;
+    uint32_t i;
+
+    runs[0] = 0;
+    nruns = 1;
+    for (i = 1; i < nkeys; ++i)
+    {
+        if (keys[i] < keys[i - 1])
+        {
+            runs[nruns++] = i;
+        }
+    }
+
+    runs[nruns] = nkeys;
+
+    return merge_sorted_runs(keys, scratch, runs, nruns, 0);
+}
+
+/* Moves the events of track_data to the order of keys if they are out of
+   order, and gives them the delta times of their new ticks. copy holds the
+   events. */
+static void reorder_track_events(struct smr_track_data* track_data, const uint64_t* keys, int unsorted, struct smr_event* copy)
+{
+    uint64_t last_tick;
+    uint32_t event_index;
+
+    if (unsorted)
+    {
+        memcpy(copy, track_data->events, track_data->nevents * sizeof(struct smr_event));
+    }
+
+    last_tick = 0;
+    for (event_index = 0; event_index < track_data->nevents; ++event_index)
+    {
+        if (unsorted)
+        {
+            track_data->events[event_index] = copy[(uint32_t)keys[event_index]];
+        }
+
+        track_data->events[event_index].delta_time = (uint32_t)((keys[event_index] >> 32) - last_tick);
+        last_tick = keys[event_index] >> 32;
+    }
+}
+
+/* The same for columns, which also gets its SysEx and meta events found
+   again. copy holds the data and status columns. */
+static void reorder_track_columns(struct smr_track_columns* columns, const uint64_t* keys, int unsorted, uint8_t* copy)
+{
+    uint16_t* data;
+    uint8_t* status;
+    uint64_t last_tick;
+    uint32_t event_index;
+    uint32_t nother;
+
+    data = (uint16_t*)copy;
+    status = copy + columns->nevents * sizeof(uint16_t);
+    if (unsorted)
+    {
+        memcpy(data, columns->data, columns->nevents * sizeof(uint16_t));
+        memcpy(status, columns->status, columns->nevents);
+    }
+
+    last_tick = 0;
+    nother = 0;
+    for (event_index = 0; event_index < columns->nevents; ++event_index)
+    {
+        uint64_t tick;
+
+        if (unsorted)
+        {
+            columns->data[event_index] = data[(uint32_t)keys[event_index]];
+            columns->status[event_index] = status[(uint32_t)keys[event_index]];
+        }
+
+        tick = keys[event_index] >> 32;
+        columns->times[event_index] = (uint32_t)(columns->absolute_ticks ? tick : tick - last_tick);
+        last_tick = tick;
+        if (columns->status[event_index] >= 0xF0)
+        {
+            columns->other_index[nother] = event_index;
+            columns->other[nother].delta_time = columns->times[event_index];
+            nother += 1;
+        }
+    }
+}
+
+int smr_apply_transforms(struct smr_midi_data* file_data, const struct smr_transform* transforms, uint32_t ntransforms, const struct smr_allocator* allocator)
+{
+    struct smr_transform_tables tables;
+    struct smr_quantize_step* steps;
+    uint64_t* scratch;
+    uint64_t* keys;
+    uint64_t* runs;
+    uint8_t* copy;
+    uint64_t copy_size;
+    uint64_t scratch_size;
+    uint32_t max_nevents;
+    uint32_t nsteps;
+    uint32_t i;
+    int32_t track_index;
+
+    if (!file_data->tracks && !file_data->columns)
+    {
+        SMR_LOG("MIDI data has no events to transform.\n");
+        return 1;
+    }
+
+    if (!allocator)
+    {
+        allocator = &default_allocator;
+    }
+
+    nsteps = 0;
+    for (i = 0; i < ntransforms; ++i)
+    {
+        if ((uint32_t)transforms[i].type > SMRE_transform_quantize)
+        {
+            SMR_LOG("Unknown transform type %d.\n", (int)transforms[i].type);
+            return 1;
+        }
+
+        if (transforms[i].type == SMRE_transform_quantize)
+        {
+            if (transforms[i].grid == 0)
+            {
+                SMR_LOG("Quantize grid can't be 0 ticks.\n");
+                return 1;
+            }
+
+            nsteps += 1;
+        }
+    }
+
+    /* Quantizing needs every event's new tick, and room to reorder them in.
+       Ticks go above the event index in 64 bits, and no track that fits in a
+       MIDI file is longer than 32 bits of ticks anyway. */
+    scratch = NULL;
+    steps = NULL;
+    scratch_size = 0;
+    max_nevents = 0;
+    if (nsteps > 0)
+    {
+        for (track_index = 0; track_index < file_data->ntracks; ++track_index)
+        {
+            if (get_track_nevents(file_data, track_index) > max_nevents)
+            {
+                max_nevents = get_track_nevents(file_data, track_index);
+            }
+        }
+
+        /* Keys and their merge scratch, the runs of keys, a copy of a track to
+           reorder from, the steps and the timeline's merge scratch. */
+        copy_size = ((uint64_t)max_nevents * sizeof(struct smr_event) + 7) & ~(uint64_t)7;
+        scratch_size = (3 * (uint64_t)max_nevents + 1) * sizeof(uint64_t) + copy_size + nsteps * sizeof(struct smr_quantize_step);
+        if (file_data->timeline.entries)
+        {
+            scratch_size += get_merge_scratch_size(file_data->ntracks);
+        }
+
+        scratch = (uint64_t*)allocator->alloc_func(scratch_size, allocator->user);
+        if (!scratch)
+        {
+            SMR_LOG("Unable to allocate memory for quantizing.\n");
+            return 1;
+        }
+
+        steps = (struct smr_quantize_step*)((uint8_t*)(scratch + 3 * (uint64_t)max_nevents + 1) + copy_size);
+    }
+
+    build_transform_tables(transforms, ntransforms, &tables, steps);
+    keys = scratch;
+    runs = scratch + 2 * (uint64_t)max_nevents;
+    copy = (uint8_t*)(runs + max_nevents + 1);
+    for (track_index = 0; track_index < file_data->ntracks; ++track_index)
+    {
+        uint64_t end;
+        uint64_t* sorted;
+        uint32_t nevents;
+        int unsorted;
+
+        nevents = get_track_nevents(file_data, track_index);
+        end = nsteps > 0 ? get_track_end_tick(file_data, (uint16_t)track_index) : 0;
+        if (end > 0xFFFFFFFF)
+        {
+            SMR_LOG("Track %d is too long to quantize.\n", track_index);
+            allocator->free_func(scratch, scratch_size, allocator->user);
+            return 1;
+        }
+
+        if (file_data->columns)
+        {
+            unsorted = transform_track_columns(file_data->columns + track_index, &tables, steps, nsteps, end, keys);
+        }
+        else
+        {
+            unsorted = transform_track_events(file_data->tracks + track_index, &tables, steps, nsteps, end, keys);
+        }
+
+        if (nsteps == 0)
+        {
+            continue;
+        }
+
+        sorted = unsorted ? sort_transform_keys(keys, keys + max_nevents, runs, nevents) : keys;
+        if (file_data->columns)
+        {
+            reorder_track_columns(file_data->columns + track_index, sorted, unsorted, copy);
+        }
+        else
+        {
+            reorder_track_events(file_data->tracks + track_index, sorted, unsorted, (struct smr_event*)copy);
+        }
+    }
+
+    if (nsteps > 0)
+    {
+        if (file_data->timeline.entries)
+        {
+            merge_timeline(file_data, file_data->timeline.entries, (uint8_t*)(steps + nsteps));
+        }
+
+        allocator->free_func(scratch, scratch_size, allocator->user);
+    }
+
+    return 0;
+}
+
+int smr_make_velocity_scale(double scale, uint8_t* velocities)
+{
+    uint32_t velocity;
+
+    if (!(scale >= 0.0))
+    {
+        SMR_LOG("Velocity scale can't be negative.\n");
+        return 1;
+    }
+
+    velocities[0] = 0;
+    for (velocity = 1; velocity < 128; ++velocity)
+    {
+        double scaled;
+
+        scaled = velocity * scale + 0.5;
+        velocities[velocity] = (uint8_t)(scaled > 127.0 ? 127 : scaled);
+    }
+
+    return 0;
+}
+
+/* Copies the payload of event, if it has one, to mem_ptr (which is advanced
+   past it) and points the event at the copy. */
+static void copy_event_payload(struct smr_event* event, uint8_t** mem_ptr)
+{
+    uint32_t payload_size;
+
+    payload_size = get_event_payload_size(event->event_type, event->length);
+    if (payload_size == 0)
+    {
+        return;
+    }
+
+    memcpy(*mem_ptr, event->data, event->length);
+    if (payload_size > event->length)
+    {
+        /* Add null terminator, borrowed text doesn't have one. */
+        (*mem_ptr)[event->length] = 0;
+    }
+
+    event->data = *mem_ptr;
+    *mem_ptr += payload_size;
+}
+
+int smr_events_to_columns(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst)
+{
+    uint32_t flags;
+    uint64_t num_events;
+    uint64_t num_other;
+    uint64_t payload_size;
+    uint8_t* mem_ptr;
+    int32_t i;
+    uint32_t event_index;
+
+    if (!src->tracks)
+    {
+        SMR_LOG("MIDI data has no tracks to convert.\n");
+        return 1;
+    }
+
+    flags = SMRE_read_columns | (options ? options->flags & SMRE_read_column_ticks : 0);
+
+    num_events = 0;
+    num_other = 0;
+    payload_size = 0;
+    for (i = 0; i < src->ntracks; ++i)
+    {
+        for (event_index = 0; event_index < src->tracks[i].nevents; ++event_index)
+        {
+            const struct smr_event* event;
+
+            event = src->tracks[i].events + event_index;
+            if (event->event_type >= SMRE_sysex_single)
+            {
+                num_other += 1;
+                payload_size += get_event_payload_size(event->event_type, event->length);
+            }
+        }
+
+        num_events += src->tracks[i].nevents;
+    }
+
+    *dst = *src;
+    memset(&dst->timeline, 0, sizeof(dst->timeline));
+    if (alloc_mem_block(dst, get_allocator(options), get_mem_block_size(flags, src->ntracks, num_events, num_other, payload_size)) != 0)
+    {
+        return 1;
+    }
+
+    mem_ptr = place_columns(dst, num_events, num_other);
+
+    for (i = 0; i < src->ntracks; ++i)
+    {
+        const struct smr_track_data* track;
+        struct smr_track_columns* columns;
+        uint32_t tick;
+
+        track = src->tracks + i;
+        columns = dst->columns + i;
+        if (i > 0)
+        {
+            place_next_columns(columns);
+        }
+
+        columns->nevents = track->nevents;
+        columns->nother = 0;
+        columns->absolute_ticks = (flags & SMRE_read_column_ticks) != 0;
+        tick = 0;
+
+        for (event_index = 0; event_index < track->nevents; ++event_index)
+        {
+            const struct smr_event* event;
+            uint32_t time;
+
+            event = track->events + event_index;
+            tick += event->delta_time;
+            time = columns->absolute_ticks ? tick : event->delta_time;
+            columns->times[event_index] = time;
+
+            switch (event->event_type)
+            {
+                case SMRE_midi_note_off:
+                case SMRE_midi_note_on:
+                case SMRE_midi_polyphonic_pressure:
+                case SMRE_midi_controller:
+                    columns->data[event_index] = event->note | (event->velocity << 8);
+                    break;
+                case SMRE_midi_program_change:
+                    columns->data[event_index] = event->program;
+                    break;
+                case SMRE_midi_channel_pressure:
+                    columns->data[event_index] = event->pressure;
+                    break;
+                case SMRE_midi_pitch_bend:
+                    /* pitch_bend holds the two data bytes big endian. */
+                    columns->data[event_index] = (event->pitch_bend >> 8) | ((event->pitch_bend & 0xFF) << 8);
+                    break;
+                default:
+                {
+                    struct smr_event* other;
+
+                    other = columns->other + columns->nother;
+                    *other = *event;
+                    other->delta_time = time;
+                    copy_event_payload(other, &mem_ptr);
+                    columns->other_index[columns->nother] = event_index;
+                    columns->nother += 1;
+                    columns->data[event_index] = 0;
+                    break;
+                }
+            }
+
+            if (event->event_type < SMRE_sysex_single)
+            {
+                columns->status[event_index] = (uint8_t)(event->event_type | event->channel);
+            }
+            else
+            {
+                columns->status[event_index] = event->event_type > 0xFF ? 0xFF : (uint8_t)event->event_type;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int smr_columns_to_events(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst)
+{
+    uint64_t num_events;
+    uint64_t payload_size;
+    uint8_t* mem_ptr;
+    struct smr_event* event_ptr;
+    int32_t i;
+    uint32_t event_index;
+
+    if (!src->columns)
+    {
+        SMR_LOG("MIDI data has no columns to convert.\n");
+        return 1;
+    }
+
+    num_events = 0;
+    payload_size = 0;
+    for (i = 0; i < src->ntracks; ++i)
+    {
+        const struct smr_track_columns* columns;
+
+        columns = src->columns + i;
+        for (event_index = 0; event_index < columns->nother; ++event_index)
+        {
+            payload_size += get_event_payload_size(columns->other[event_index].event_type, columns->other[event_index].length);
+        }
+
+        num_events += columns->nevents;
+    }
+
+    *dst = *src;
+    memset(&dst->timeline, 0, sizeof(dst->timeline));
+    if (alloc_mem_block(dst, get_allocator(options), get_mem_block_size(0, src->ntracks, num_events, 0, payload_size)) != 0)
+    {
+        return 1;
+    }
+
+    dst->columns = NULL;
+    dst->tracks = (struct smr_track_data*)dst->_mem_block;
+    event_ptr = (struct smr_event*)(dst->tracks + dst->ntracks);
+    mem_ptr = (uint8_t*)(event_ptr + num_events);
+
+    for (i = 0; i < src->ntracks; ++i)
+    {
+        const struct smr_track_columns* columns;
+        uint32_t other_index;
+        uint32_t prev_tick;
+
+        columns = src->columns + i;
+        dst->tracks[i].nevents = columns->nevents;
+        dst->tracks[i].events = event_ptr;
+        other_index = 0;
+        prev_tick = 0;
+
+        for (event_index = 0; event_index < columns->nevents; ++event_index)
+        {
+            struct smr_event* event;
+            uint8_t status_byte;
+            uint16_t data;
+
+            event = event_ptr + event_index;
+            status_byte = columns->status[event_index];
+            data = columns->data[event_index];
+
+            if (status_byte >= 0xF0)
+            {
+                *event = columns->other[other_index];
+                copy_event_payload(event, &mem_ptr);
+                other_index += 1;
+            }
+            else
+            {
+                memset(event, 0, sizeof(*event));
+                event->event_type = (enum smr_event_type)(status_byte & 0xF0);
+                event->channel = status_byte & 0x0F;
+
+                switch (event->event_type)
+                {
+                    case SMRE_midi_program_change:
+                        event->program = (uint8_t)data;
+                        break;
+                    case SMRE_midi_channel_pressure:
+                        event->pressure = (uint8_t)data;
+                        break;
+                    case SMRE_midi_pitch_bend:
+                        event->pitch_bend = (uint16_t)((data << 8) | (data >> 8));
+                        break;
+                    default:
+                        event->note = data & 0xFF;
+                        event->velocity = data >> 8;
+                        break;
+                }
+            }
+
+            if (columns->absolute_ticks)
+            {
+                event->delta_time = columns->times[event_index] - prev_tick;
+                prev_tick = columns->times[event_index];
+            }
+            else
+            {
+                event->delta_time = columns->times[event_index];
+            }
+        }
+
+        event_ptr += columns->nevents;
+    }
+
+    return 0;
+}
+
+static int check_conversion_source(const struct smr_midi_data* src)
+{
+    if (!src->tracks)
+    {
+        SMR_LOG("MIDI data has no tracks to convert.\n");
+        return 1;
+    }
+
+    if (src->format == 2)
+    {
+        SMR_LOG("The tracks of a format 2 file are separate songs, they can't be merged.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Counts the channel events of src per channel, and its other events, leaving
+   out end of track events: those get replaced. payload_size gets what the
+   other events need in a new _mem_block. */
+static void count_conversion_events(const struct smr_midi_data* src, uint64_t* channel_counts, uint64_t* num_other, uint64_t* payload_size)
+{
+    int32_t i;
+    uint32_t event_index;
+
+    memset(channel_counts, 0, 16 * sizeof(uint64_t));
+    *num_other = 0;
+    *payload_size = 0;
+    for (i = 0; i < src->ntracks; ++i)
+    {
+        for (event_index = 0; event_index < src->tracks[i].nevents; ++event_index)
+        {
+            const struct smr_event* event;
+
+            event = src->tracks[i].events + event_index;
+            if (event->event_type < SMRE_sysex_single)
+            {
+                channel_counts[event->channel] += 1;
+            }
+            else if (event->event_type != SMRE_meta_end_of_track)
+            {
+                *num_other += 1;
+                *payload_size += get_event_payload_size(event->event_type, event->length);
+            }
+        }
+    }
+}
+
+/* The timeline src was parsed with, or else one built for the conversion. It
+   is freed with smr_free_timeline either way. */
+static int get_conversion_timeline(const struct smr_midi_data* src, const struct smr_allocator* allocator, struct smr_timeline* timeline)
+{
+    if (src->timeline.entries)
+    {
+        *timeline = src->timeline;
+        return 0;
+    }
+
+    return smr_build_timeline(src, allocator, timeline);
+}
+
+/* Copies the event of entry in src to event, at a delta time from last_tick
+   (which is moved to the event's tick) and with its payload at mem_ptr. */
+static void copy_merged_event(const struct smr_midi_data* src, const struct smr_timeline_entry* entry, struct smr_event* event, uint64_t* last_tick, uint8_t** mem_ptr)
+{
+    *event = src->tracks[entry->track_index].events[entry->event_index];
+    /* Never more than the event's own delta time, which fits. */
+    event->delta_time = (uint32_t)(entry->tick - *last_tick);
+    *last_tick = entry->tick;
+    copy_event_payload(event, mem_ptr);
+}
+
+static void set_end_of_track(struct smr_event* event, uint64_t delta_time)
+{
+    memset(event, 0, sizeof(*event));
+    event->event_type = SMRE_meta_end_of_track;
+    event->delta_time = (uint32_t)delta_time;
+}
+
+int smr_to_format0(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst)
+{
+    struct smr_timeline timeline;
+    struct smr_event* event_ptr;
+    uint8_t* mem_ptr;
+    uint64_t channel_counts[16];
+    uint64_t num_events;
+    uint64_t payload_size;
+    uint64_t entry_index;
+    uint64_t last_tick;
+    uint64_t end_tick;
+    int32_t i;
+
+    if (check_conversion_source(src) != 0)
+    {
+        return 1;
+    }
+
+    count_conversion_events(src, channel_counts, &num_events, &payload_size);
+    for (i = 0; i < 16; ++i)
+    {
+        num_events += channel_counts[i];
+    }
+
+    /* Everything but the end of track events, then one to end the track. */
+    num_events += 1;
+    if (num_events > 0xFFFFFFFF)
+    {
+        SMR_LOG("Too many events for one track.\n");
+        return 1;
+    }
+
+    if (get_conversion_timeline(src, get_allocator(options), &timeline) != 0)
+    {
+        return 1;
+    }
+
+    *dst = *src;
+    memset(&dst->timeline, 0, sizeof(dst->timeline));
+    if (alloc_mem_block(dst, get_allocator(options), get_mem_block_size(0, 1, num_events, 0, payload_size)) != 0)
+    {
+        smr_free_timeline(&timeline);
+        return 1;
+    }
+
+    dst->format = 0;
+    dst->ntracks = 1;
+    dst->columns = NULL;
+    dst->tracks = (struct smr_track_data*)dst->_mem_block;
+    event_ptr = (struct smr_event*)(dst->tracks + 1);
+    mem_ptr = (uint8_t*)(event_ptr + num_events);
+    dst->tracks[0].nevents = (uint32_t)num_events;
+    dst->tracks[0].events = event_ptr;
+
+    last_tick = 0;
+    for (entry_index = 0; entry_index < timeline.nentries; ++entry_index)
+    {
+        const struct smr_timeline_entry* entry;
+
+        entry = timeline.entries + entry_index;
+        if (src->tracks[entry->track_index].events[entry->event_index].event_type != SMRE_meta_end_of_track)
+        {
+            copy_merged_event(src, entry, event_ptr++, &last_tick, &mem_ptr);
+        }
+    }
+
+    /* Where the longest track ended. */
+    end_tick = timeline.nentries > 0 ? timeline.entries[timeline.nentries - 1].tick : 0;
+    set_end_of_track(event_ptr, end_tick - last_tick);
+    smr_free_timeline(&timeline);
+
+    return 0;
+}
+
+int smr_split_by_channel(const struct smr_midi_data* src, const struct smr_read_options* options, struct smr_midi_data* dst)
+{
+    struct smr_timeline timeline;
+    /* Conductor track first, then the channels. */
+    struct smr_event* next_events[1 + 16];
+    uint64_t last_ticks[1 + 16];
+    uint8_t* mem_ptr;
+    uint64_t channel_counts[16];
+    uint64_t num_other;
+    uint64_t num_events;
+    uint64_t payload_size;
+    uint64_t entry_index;
+    uint64_t end_tick;
+    uint16_t ntracks;
+    int32_t i;
+
+    if (check_conversion_source(src) != 0)
+    {
+        return 1;
+    }
+
+    count_conversion_events(src, channel_counts, &num_other, &payload_size);
+    ntracks = 1;
+    num_events = num_other + 1;
+    for (i = 0; i < 16; ++i)
+    {
+        /* Each track also gets an end of track event. */
+        if (channel_counts[i] >= 0xFFFFFFFF || num_other >= 0xFFFFFFFF)
+        {
+            SMR_LOG("Too many events for one track.\n");
+            return 1;
+        }
+
+        if (channel_counts[i] > 0)
+        {
+            ntracks += 1;
+            num_events += channel_counts[i] + 1;
+        }
+    }
+
+    if (get_conversion_timeline(src, get_allocator(options), &timeline) != 0)
+    {
+        return 1;
+    }
+
+    *dst = *src;
+    memset(&dst->timeline, 0, sizeof(dst->timeline));
+    if (alloc_mem_block(dst, get_allocator(options), get_mem_block_size(0, ntracks, num_events, 0, payload_size)) != 0)
+    {
+        smr_free_timeline(&timeline);
+        return 1;
+    }
+
+    dst->format = 1;
+    dst->ntracks = ntracks;
+    dst->columns = NULL;
+    dst->tracks = (struct smr_track_data*)dst->_mem_block;
+    next_events[0] = (struct smr_event*)(dst->tracks + ntracks);
+    dst->tracks[0].nevents = (uint32_t)(num_other + 1);
+    dst->tracks[0].events = next_events[0];
+    ntracks = 1;
+    for (i = 0; i < 16; ++i)
+    {
+        next_events[1 + i] = NULL;
+        if (channel_counts[i] > 0)
+        {
+            dst->tracks[ntracks].nevents = (uint32_t)(channel_counts[i] + 1);
+            dst->tracks[ntracks].events = dst->tracks[ntracks - 1].events + dst->tracks[ntracks - 1].nevents;
+            next_events[1 + i] = dst->tracks[ntracks].events;
+            ntracks += 1;
+        }
+    }
+
+    mem_ptr = (uint8_t*)(dst->tracks[ntracks - 1].events + dst->tracks[ntracks - 1].nevents);
+    memset(last_ticks, 0, sizeof(last_ticks));
+    for (entry_index = 0; entry_index < timeline.nentries; ++entry_index)
+    {
+        const struct smr_timeline_entry* entry;
+        const struct smr_event* event;
+        uint32_t slot;
+
+        entry = timeline.entries + entry_index;
+        event = src->tracks[entry->track_index].events + entry->event_index;
+        if (event->event_type == SMRE_meta_end_of_track)
+        {
+            continue;
+        }
+
+        slot = event->event_type < SMRE_sysex_single ? 1 + event->channel : 0;
+        copy_merged_event(src, entry, next_events[slot]++, last_ticks + slot, &mem_ptr);
+    }
+
+    /* Every track lasts as long as the whole file did. */
+    end_tick = timeline.nentries > 0 ? timeline.entries[timeline.nentries - 1].tick : 0;
+    for (i = 0; i < 1 + 16; ++i)
+    {
+        if (next_events[i])
+        {
+            set_end_of_track(next_events[i], end_tick - last_ticks[i]);
+        }
+    }
+
+    smr_free_timeline(&timeline);
+
+    return 0;
+}
+
+int smr_read_header(uint8_t* buffer, uint64_t buffer_len, struct smr_midi_data* file_data)
+{
+    uint8_t* buffer_read;
+
+    if (buffer_len < 14)
+    {
+        SMR_LOG("MIDI file is too short to hold a header.\n");
+        return 1;
+    }
+
+    buffer_read = buffer;
+    if (read_midi_header(&buffer_read, file_data) != 0)
+    {
+        return 1;
+    }
+
+    file_data->tracks = NULL;
+    file_data->columns = NULL;
+    file_data->_mem_block = NULL;
+    file_data->_mem_size = 0;
+    memset(&file_data->_allocator, 0, sizeof(file_data->_allocator));
+
+    return 0;
+}
+
+int smr_track_cursor_init(struct smr_track_cursor* cursor, uint8_t* buffer, uint64_t buffer_len, uint16_t track_index)
+{
+    uint8_t* buffer_read;
+    uint16_t ntracks;
+    uint32_t track_chunklen;
+    int32_t i;
+
+    if (check_chunks(buffer, buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    buffer_read = buffer + 10;
+    ntracks = get_next_uint16(&buffer_read);
+    if (track_index >= ntracks)
+    {
+        SMR_LOG("MIDI file has no track %hu.\n", track_index);
+        return 1;
+    }
+
+    /* check_chunks made sure every chunk header before this one is in bounds. */
+    buffer_read = buffer + 14;
+    for (i = 0; i < track_index; ++i)
+    {
+        buffer_read += 4;
+        track_chunklen = get_next_uint32(&buffer_read);
+        buffer_read += track_chunklen;
+    }
+
+    if (compare_next_string(&buffer_read, "MTrk") != 0)
+    {
+        SMR_LOG("Did not find an expected track header.\n");
+        return 1;
+    }
+
+    track_chunklen = get_next_uint32(&buffer_read);
+    cursor->read = buffer_read;
+    cursor->end = buffer_read + track_chunklen;
+    cursor->last_status_byte = 0xFF;
+
+    return 0;
+}
+
+int smr_track_cursor_done(const struct smr_track_cursor* cursor)
+{
+    return cursor->read >= cursor->end;
+}
+
+int smr_track_cursor_next(struct smr_track_cursor* cursor, struct smr_event* event)
+{
+    if (cursor->end - cursor->read < SMR_EVENT_HEADER_BOUND && check_event_header(cursor->read, cursor->end, cursor->last_status_byte) != 0)
+    {
+        return 1;
+    }
+
+    if (read_event(&cursor->read, cursor->end, SMRE_read_borrow_payloads, &cursor->last_status_byte, event, NULL) != 0)
+    {
+        return 1;
+    }
+
+    if (cursor->read > cursor->end)
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Reads the delta time and status of the event at buffer_read, running status
+   included, and leaves buffer_read at its chunklen bytes of payload. Only the
+   event type is decoded, for stepping over events without reading them. The
+   payload isn't checked against the end of the track. */
+static inline int read_event_header(uint8_t** buffer_read, uint8_t* last_status_byte, uint32_t* delta_time, enum smr_event_type* event_type, uint32_t* chunklen)
+{
+    uint8_t status_byte;
+    uint8_t status_byte_top;
+
+    *delta_time = get_next_variable_length_int(buffer_read);
+    status_byte = get_next_uint8(buffer_read);
+
+    /* Check for running status. */
+    if (status_byte < 0x80)
+    {
+        if (*last_status_byte >= 0xF0)
+        {
+            SMR_LOG("Currently not supporting running status for non-MIDI events.");
+            return 1;
+        }
+
+        status_byte = *last_status_byte;
+        /* Back up buffer so that value can be read again. */
+        *buffer_read -= 1;
+    }
+
+    *last_status_byte = status_byte;
+
+    status_byte_top = status_byte & 0xF0;
+    if (status_byte_top >= 0x80 && status_byte_top < 0xF0)
+    {
+        /* MIDI event */
+        *event_type = (enum smr_event_type)status_byte_top;
+        /* Program change and channel pressure are the only 1 byte events. */
+        *chunklen = (status_byte_top == SMRE_midi_program_change || status_byte_top == SMRE_midi_channel_pressure) ? 1 : 2;
+    }
+    else if (status_byte == 0xF0 || status_byte == 0xF7)
+    {
+        /* SysEx event */
+        *event_type = (enum smr_event_type)status_byte;
+        *chunklen = get_next_variable_length_int(buffer_read);
+    }
+    else if (status_byte == 0xFF)
+    {
+        uint8_t meta_event_type;
+
+        meta_event_type = get_next_uint8(buffer_read);
+        *event_type = (enum smr_event_type)(meta_event_type | (status_byte << 8));
+        *chunklen = get_next_variable_length_int(buffer_read);
+    }
+    else
+    {
+        SMR_LOG("\nDo not recognize status byte %02x.\n", status_byte & 0xFF);
+        return 1;
+    }
+
+    return 0;
+}
+
+int smr_track_cursor_skip(struct smr_track_cursor* cursor, uint32_t* delta_time, enum smr_event_type* event_type)
+{
+    uint32_t event_time;
+    enum smr_event_type type;
+    uint32_t event_chunklen;
+
+    if (cursor->end - cursor->read < SMR_EVENT_HEADER_BOUND && check_event_header(cursor->read, cursor->end, cursor->last_status_byte) != 0)
+    {
+        return 1;
+    }
+
+    if (read_event_header(&cursor->read, &cursor->last_status_byte, &event_time, &type, &event_chunklen) != 0)
+    {
+        return 1;
+    }
+
+    if (cursor->read > cursor->end || event_chunklen > cursor->end - cursor->read)
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
+
+    cursor->read += event_chunklen;
+
+    if (delta_time)
+    {
+        *delta_time = event_time;
+    }
+
+    if (event_type)
+    {
+        *event_type = type;
+    }
+
+    return 0;
+}
+
+/* Tracks with tempo events smr_probe can merge into a duration in seconds. */
+#define SMR_PROBE_MAX_TEMPO_TRACKS 16
+
+/* smr_probe's walk through the tempo map, one tempo event at a time. */
+struct smr_probe_state
+{
+    uint16_t tempo_tracks[SMR_PROBE_MAX_TEMPO_TRACKS];
+    /* Can go over SMR_PROBE_MAX_TEMPO_TRACKS, the tracks past it aren't kept. */
+    uint32_t ntempo_tracks;
+    uint16_t tickdiv;
+    uint64_t tempo_tick;
+    double microseconds;
+    double microseconds_per_tick;
+};
+
+/* Moves the tempo map to tempo at tick, which can't come before the last tempo
+   added. Sums up the same way as smr_build_tempo_map, so the duration comes out
+   the same as smr_tick_to_seconds. */
+static void add_probe_tempo(struct smr_probe_state* state, uint64_t tick, uint32_t tempo)
+{
+    state->microseconds += (tick - state->tempo_tick) * state->microseconds_per_tick;
+    state->tempo_tick = tick;
+    state->microseconds_per_tick = (double)tempo / state->tickdiv;
+}
+
+/* The meta event with event_chunklen bytes at event_data for probe_track.
+   Only copyright, track name, tempo and time signature events are decoded, and
+   only the fields wanted. */
+static void probe_meta_event(enum smr_event_type event_type, uint8_t* event_data, uint32_t event_chunklen, uint64_t tick, uint16_t track_index, uint32_t fields, struct smr_probe_state* state, struct smr_probe_info* info)
+{
+    uint32_t tempo;
+
+    /* Fixed size fields are read like read_event does, whatever the declared
+       length, which check_event_header made sure is safe. */
+    switch (event_type)
+    {
+        case SMRE_meta_copyright:
+            if (tick == 0 && (fields & SMRE_probe_copyright) && !info->copyright.text)
+            {
+                info->copyright.text = (const char*)event_data;
+                info->copyright.length = event_chunklen;
+                info->found |= SMRE_probe_copyright;
+            }
+            break;
+        case SMRE_meta_track_name:
+            if (tick == 0 && (fields & SMRE_probe_track_names) && track_index < SMR_PROBE_MAX_TRACK_NAMES && !info->track_names[track_index].text)
+            {
+                info->track_names[track_index].text = (const char*)event_data;
+                info->track_names[track_index].length = event_chunklen;
+                info->found |= SMRE_probe_track_names;
+            }
+            break;
+        case SMRE_meta_tempo:
+            /* The tempo map skips tempo 0, and so does this. */
+            tempo = get_next_uint24(&event_data);
+            if (tempo == 0)
+            {
+                break;
+            }
+
+            /* Later tracks come after earlier ones on tick 0, so the last one
+               seen wins. */
+            if (tick == 0 && (fields & SMRE_probe_tempo))
+            {
+                info->tempo = tempo;
+                info->found |= SMRE_probe_tempo;
+            }
+
+            if (fields & SMRE_probe_duration)
+            {
+                /* Tracks come in order, so a new tempo track is never already
+                   in the list. Only the first one is summed up here, the rest
+                   have to be merged with it after. */
+                if (state->ntempo_tracks == 0 || (state->ntempo_tracks <= SMR_PROBE_MAX_TEMPO_TRACKS && state->tempo_tracks[state->ntempo_tracks - 1] != track_index))
+                {
+                    if (state->ntempo_tracks < SMR_PROBE_MAX_TEMPO_TRACKS)
+                    {
+                        state->tempo_tracks[state->ntempo_tracks] = track_index;
+                    }
+
+                    state->ntempo_tracks += 1;
+                }
+
+                if (state->ntempo_tracks == 1)
+                {
+                    add_probe_tempo(state, tick, tempo);
+                }
+            }
+            break;
+        case SMRE_meta_time_signature:
+            if (tick == 0 && (fields & SMRE_probe_time_signature))
+            {
+                info->nn = get_next_uint8(&event_data);
+                info->dd = get_next_uint8(&event_data);
+                info->cc = get_next_uint8(&event_data);
+                info->bb = get_next_uint8(&event_data);
+                info->found |= SMRE_probe_time_signature;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Steps over the event at buffer_read for probe_track, adding its delta time to
+   tick and counting it in nnotes if it is a note on. Its payload must end by
+   track_end. */
+static inline int probe_event(uint8_t** buffer_read, uint8_t* track_end, uint16_t track_index, uint32_t fields, uint64_t* tick, uint8_t* last_status_byte, uint64_t* nnotes, struct smr_probe_state* state, struct smr_probe_info* info)
+{
+    uint32_t delta_time;
+    enum smr_event_type event_type;
+    uint32_t event_chunklen;
+    uint8_t* event_data;
+
+    if (read_event_header(buffer_read, last_status_byte, &delta_time, &event_type, &event_chunklen) != 0)
+    {
+        return 1;
+    }
+
+    if (event_chunklen > (uint64_t)(track_end - *buffer_read))
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
+
+    *tick += delta_time;
+    event_data = *buffer_read;
+    *buffer_read += event_chunklen;
+
+    if (event_type == SMRE_midi_note_on)
+    {
+        *nnotes += event_data[1] != 0;
+    }
+    else if (event_type > 0xFF)
+    {
+        /* Meta event */
+        probe_meta_event(event_type, event_data, event_chunklen, *tick, track_index, fields, state, info);
+    }
+
+    return 0;
+}
+
+/* Walks one track (header included) for smr_probe, checking every event like
+   measure_track does. Without the note count or duration, the walk ends at
+   the first event after tick 0, and the rest of the track is jumped over. */
+static int probe_track(uint8_t** buffer_read, uint16_t track_index, uint32_t fields, struct smr_probe_state* state, struct smr_probe_info* info)
+{
+    uint32_t track_chunklen;
+    uint8_t* track_end;
+    uint8_t* checked_from;
+    uint64_t tick;
+    uint64_t nnotes;
+    uint8_t last_status_byte;
+
+    if (compare_next_string(buffer_read, "MTrk") != 0)
+    {
+        SMR_LOG("Did not find an expected track header.\n");
+        return 1;
+    }
+
+    track_chunklen = get_next_uint32(buffer_read);
+    track_end = *buffer_read + track_chunklen;
+    checked_from = track_chunklen > SMR_EVENT_HEADER_BOUND ? track_end - SMR_EVENT_HEADER_BOUND : *buffer_read;
+
+    tick = 0;
+    nnotes = 0;
+    last_status_byte = 0xFF;
+    if (!(fields & (SMRE_probe_note_count | SMRE_probe_duration)))
+    {
+        /* Stepping over the first event after tick 0 too does no harm, nothing
+           after tick 0 gets looked at. */
+        while (*buffer_read < track_end && tick == 0)
+        {
+            if (check_event_header(*buffer_read, track_end, last_status_byte) != 0 || probe_event(buffer_read, track_end, track_index, fields, &tick, &last_status_byte, &nnotes, state, info) != 0)
+            {
+                return 1;
+            }
+        }
+
+        *buffer_read = track_end;
+        return 0;
+    }
+
+    /* Far enough from the end of the track, only payload lengths can run past
+       it, so the bounds checks stay out of the loop. */
+    while (*buffer_read < checked_from)
+    {
+        if (probe_event(buffer_read, track_end, track_index, fields, &tick, &last_status_byte, &nnotes, state, info) != 0)
+        {
+            return 1;
+        }
+    }
+
+    while (*buffer_read < track_end)
+    {
+        if (check_event_header(*buffer_read, track_end, last_status_byte) != 0 || probe_event(buffer_read, track_end, track_index, fields, &tick, &last_status_byte, &nnotes, state, info) != 0)
+        {
+            return 1;
+        }
+    }
+
+    info->nnotes += nnotes;
+    if (tick > info->duration_ticks)
+    {
+        info->duration_ticks = tick;
+    }
+
+    return 0;
+}
+
+/* Steps cursor to its next nonzero tempo event, adding the delta times on the
+   way to tick. done is set once the track runs out instead. */
+static int next_probe_tempo(struct smr_track_cursor* cursor, uint64_t* tick, uint32_t* tempo, int* done)
+{
+    struct smr_event event;
+
+    while (!smr_track_cursor_done(cursor))
+    {
+        if (smr_track_cursor_next(cursor, &event) != 0)
+        {
+            return 1;
+        }
+
+        *tick += event.delta_time;
+        if (event.event_type == SMRE_meta_tempo && event.tempo != 0)
+        {
+            *tempo = event.tempo;
+            return 0;
+        }
+    }
+
+    *done = 1;
+
+    return 0;
+}
+
+/* Sums up the tempo map again from the tempo events of every track in
+   state->tempo_tracks, in order of tick, then track. */
+static int merge_probe_tempos(uint8_t* buffer, uint64_t buffer_len, struct smr_probe_state* state)
+{
+    struct smr_track_cursor cursors[SMR_PROBE_MAX_TEMPO_TRACKS];
+    uint64_t ticks[SMR_PROBE_MAX_TEMPO_TRACKS];
+    uint32_t tempos[SMR_PROBE_MAX_TEMPO_TRACKS];
+    int done[SMR_PROBE_MAX_TEMPO_TRACKS];
+    uint32_t i;
+
+    for (i = 0; i < state->ntempo_tracks; ++i)
+    {
+        ticks[i] = 0;
+        done[i] = 0;
+        if (smr_track_cursor_init(cursors + i, buffer, buffer_len, state->tempo_tracks[i]) != 0 || next_probe_tempo(cursors + i, ticks + i, tempos + i, done + i) != 0)
+        {
+            return 1;
+        }
+    }
+
+    state->tempo_tick = 0;
+    state->microseconds = 0;
+    state->microseconds_per_tick = 500000.0 / state->tickdiv;
+    for (;;)
+    {
+        uint32_t next;
+
+        /* Tracks are in order, so the first of the earliest keeps later tracks
+           winning on the same tick. */
+        next = state->ntempo_tracks;
+        for (i = 0; i < state->ntempo_tracks; ++i)
+        {
+            if (!done[i] && (next == state->ntempo_tracks || ticks[i] < ticks[next]))
+            {
+                next = i;
+            }
+        }
+
+        if (next == state->ntempo_tracks)
+        {
+            return 0;
+        }
+
+        add_probe_tempo(state, ticks[next], tempos[next]);
+        if (next_probe_tempo(cursors + next, ticks + next, tempos + next, done + next) != 0)
+        {
+            return 1;
+        }
+    }
+}
+
+int smr_probe(uint8_t* buffer, uint64_t buffer_len, uint32_t fields, struct smr_probe_info* info)
+{
+    struct smr_midi_data header;
+    struct smr_probe_state state;
+    uint8_t* buffer_read;
+    uint16_t track_index;
+
+    if (check_chunks(buffer, buffer_len) != 0 || smr_read_header(buffer, buffer_len, &header) != 0)
+    {
+        return 1;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->format = header.format;
+    info->ntracks = header.ntracks;
+    info->time_type = header.time_type;
+    info->tickdiv = header.tickdiv;
+    info->tempo = 500000;
+    info->nn = 4;
+    info->dd = 2;
+    info->cc = 24;
+    info->bb = 8;
+
+    memset(&state, 0, sizeof(state));
+    state.tickdiv = header.time_type == SMRE_metrical && header.tickdiv ? header.tickdiv : 1;
+    state.microseconds_per_tick = 500000.0 / state.tickdiv;
+
+    buffer_read = buffer + 14;
+    for (track_index = 0; track_index < header.ntracks; ++track_index)
+    {
+        /* With only text at tick 0 to find, stop once none of it can turn up
+           any more. */
+        if (!(fields & ~(SMRE_probe_copyright | SMRE_probe_track_names)) && (!(fields & SMRE_probe_copyright) || info->copyright.text) && (!(fields & SMRE_probe_track_names) || track_index >= SMR_PROBE_MAX_TRACK_NAMES))
+        {
+            break;
+        }
+
+        if (probe_track(&buffer_read, track_index, fields, &state, info) != 0)
+        {
+            return 1;
+        }
+    }
+
+    info->found |= fields & SMRE_probe_note_count;
+    if (!(fields & SMRE_probe_duration))
+    {
+        return 0;
+    }
+
+    info->found |= SMRE_probe_duration;
+    if (header.time_type == SMRE_timecode)
+    {
+        double fps;
+
+        fps = header.fps == 29 ? 29.97 : header.fps;
+        info->duration_seconds = info->duration_ticks * (1000000.0 / (fps * (header.subframe_resolution ? header.subframe_resolution : 1))) / 1000000.0;
+        return 0;
+    }
+
+    if (state.ntempo_tracks > SMR_PROBE_MAX_TEMPO_TRACKS)
+    {
+        info->duration_seconds = -1;
+        return 0;
+    }
+
+    if (state.ntempo_tracks > 1 && merge_probe_tempos(buffer, buffer_len, &state) != 0)
+    {
+        return 1;
+    }
+
+    info->duration_seconds = (state.microseconds + (info->duration_ticks - state.tempo_tick) * state.microseconds_per_tick) / 1000000.0;
+
+    return 0;
+}
+
+/* Appends [from, to) of the fed chunk to the stream buffer. */
+static int stream_buffer_bytes(struct smr_stream* stream, const uint8_t* from, const uint8_t* to)
+{
+    uint64_t needed;
+
+    needed = stream->buffer_length + (uint64_t)(to - from);
+    if (needed > stream->buffer_capacity)
+    {
+        uint64_t new_capacity;
+        uint8_t* new_buffer;
+
+        new_capacity = stream->buffer_capacity ? stream->buffer_capacity * 2 : 64;
+        while (new_capacity < needed)
+        {
+            new_capacity *= 2;
+        }
+
+        new_buffer = (uint8_t*)stream->allocator.alloc_func(new_capacity, stream->allocator.user);
+        if (!new_buffer)
+        {
+            SMR_LOG("Unable to allocate memory for MIDI stream.\n");
+            return 1;
+        }
+
+        if (stream->buffer)
+        {
+            memcpy(new_buffer, stream->buffer, stream->buffer_length);
+            stream->allocator.free_func(stream->buffer, stream->buffer_capacity, stream->allocator.user);
+        }
+
+        stream->buffer = new_buffer;
+        stream->buffer_capacity = (uint32_t)new_capacity;
+    }
+
+    memcpy(stream->buffer + stream->buffer_length, from, to - from);
+    stream->buffer_length = (uint32_t)needed;
+
+    return 0;
+}
+
+/* Moves on to the next track's header, or to the end of the file. */
+static void stream_next_track(struct smr_stream* stream)
+{
+    if (stream->track_index + 1 >= stream->header.ntracks)
+    {
+        stream->state = SMRE_stream_done;
+        return;
+    }
+
+    stream->track_index += 1;
+    stream->state = SMRE_stream_track_header;
+    stream->body_remaining = 8;
+}
+
+/* Decodes the complete, contiguous event [raw, raw_end) just like a regular
+   parse would, and hands it to the callback. Payloads are borrowed. */
+static int stream_emit_event(struct smr_stream* stream, uint8_t* raw, uint8_t* raw_end)
+{
+    struct smr_event event;
+    uint32_t event_length;
+
+    event_length = (uint32_t)(raw_end - raw);
+    if (event_length > stream->track_remaining)
+    {
+        SMR_LOG("Event runs past the end of its track.\n");
+        return 1;
+    }
+
+    /* A short meta event can declare less data than its fixed fields take. */
+    if (event_length < SMR_EVENT_HEADER_BOUND && check_event_header(raw, raw_end, stream->last_status_byte) != 0)
+    {
+        return 1;
+    }
+
+    if (read_event(&raw, raw_end, SMRE_read_borrow_payloads, &stream->last_status_byte, &event, NULL) != 0)
+    {
+        return 1;
+    }
+
+    stream->callback(&event, stream->track_index, stream->user);
+
+    stream->track_remaining -= event_length;
+    stream->state = SMRE_stream_delta_time;
+    stream->vlq_length = 0;
+
+    if (stream->track_remaining == 0)
+    {
+        stream_next_track(stream);
+    }
+
+    return 0;
+}
+
+/* Length of the event at read if all of it lies before end, 0 if it doesn't
+   (or is malformed, which the byte by byte path then reports). */
+static uint32_t peek_event_length(const uint8_t* read, const uint8_t* end, uint8_t last_status_byte)
+{
+    const uint8_t* peek;
+    uint8_t status_byte;
+    uint32_t length;
+    int32_t i;
+
+    peek = read;
+
+    /* Skip delta time. */
+    for (i = 0; ; ++i)
+    {
+        if (peek >= end || i == 4)
+        {
+            return 0;
+        }
+
+        if (!(*peek++ & 0x80))
+        {
+            break;
+        }
+    }
+
+    if (peek >= end)
+    {
+        return 0;
+    }
+
+    status_byte = *peek;
+    if (status_byte < 0x80)
+    {
+        status_byte = last_status_byte;
+    }
+    else
+    {
+        peek += 1;
+    }
+
+    if (status_byte < 0xF0)
+    {
+        length = ((status_byte & 0xF0) == SMRE_midi_program_change || (status_byte & 0xF0) == SMRE_midi_channel_pressure) ? 1 : 2;
+    }
+    else
+    {
+        if (status_byte == 0xFF)
+        {
+            /* Skip meta event type. */
+            if (peek >= end)
+            {
+                return 0;
+            }
+
+            peek += 1;
+        }
+        else if (status_byte != 0xF0 && status_byte != 0xF7)
+        {
+            return 0;
+        }
+
+        length = 0;
+        for (i = 0; ; ++i)
+        {
+            uint8_t byte;
+
+            if (peek >= end || i == 4)
+            {
+                return 0;
+            }
+
+            byte = *peek++;
+            length = (length << 7) | (byte & 0x7F);
+            if (!(byte & 0x80))
+            {
+                break;
+            }
+        }
+    }
+
+    if (length > (uint64_t)(end - peek))
+    {
+        return 0;
+    }
+
+    return (uint32_t)(peek - read) + length;
+}
+
+/* Handles the header or event whose bytes are [start, end) of the fed chunk,
+   after whatever of it was buffered from earlier chunks. */
+static int stream_complete(struct smr_stream* stream, const uint8_t* start, const uint8_t* end)
+{
+    uint8_t* raw;
+    uint8_t* raw_end;
+
+    if (stream->buffer_length > 0)
+    {
+        if (stream_buffer_bytes(stream, start, end) != 0)
+        {
+            return 1;
+        }
+
+        raw = stream->buffer;
+        raw_end = stream->buffer + stream->buffer_length;
+    }
+    else
+    {
+        raw = (uint8_t*)start;
+        raw_end = (uint8_t*)end;
+    }
+
+    stream->buffer_length = 0;
+
+    if (stream->state == SMRE_stream_header)
+    {
+        if (read_midi_header(&raw, &stream->header) != 0)
+        {
+            return 1;
+        }
+
+        stream->track_index = 0;
+        stream->state = stream->header.ntracks > 0 ? SMRE_stream_track_header : SMRE_stream_done;
+        stream->body_remaining = 8;
+    }
+    else if (stream->state == SMRE_stream_track_header)
+    {
+        if (compare_next_string(&raw, "MTrk") != 0)
+        {
+            SMR_LOG("Did not find an expected track header.\n");
+            return 1;
+        }
+
+        stream->track_remaining = get_next_uint32(&raw);
+        stream->last_status_byte = 0xFF;
+        stream->state = SMRE_stream_delta_time;
+        stream->vlq_length = 0;
+
+        if (stream->track_remaining == 0)
+        {
+            stream_next_track(stream);
+        }
+    }
+    else
+    {
+        return stream_emit_event(stream, raw, raw_end);
+    }
+
+    return 0;
+}
+
+void smr_stream_init(struct smr_stream* stream, void (*callback)(const struct smr_event* event, uint16_t track_index, void* user), void* user, const struct smr_allocator* allocator)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->callback = callback;
+    stream->user = user;
+    stream->allocator = allocator ? *allocator : default_allocator;
+    stream->state = SMRE_stream_header;
+    stream->body_remaining = 14;
+}
+
+int smr_stream_feed(struct smr_stream* stream, const uint8_t* bytes, uint64_t num_bytes)
+{
+    const uint8_t* read;
+    const uint8_t* end;
+    const uint8_t* start;
+
+    read = bytes;
+    end = bytes + num_bytes;
+    /* Start of the part of the current event that is in this chunk. */
+    start = read;
+
+    while (read < end)
+    {
+        uint8_t byte;
+
+        /* Fast path: an event that lies entirely in this chunk is decoded in
+           place, skipping the byte by byte state machine below. */
+        if (stream->state == SMRE_stream_delta_time && stream->vlq_length == 0 && stream->buffer_length == 0)
+        {
+            const uint8_t* limit;
+            uint32_t event_length;
+
+            limit = (uint64_t)(end - read) < stream->track_remaining ? end : read + stream->track_remaining;
+            event_length = peek_event_length(read, limit, stream->last_status_byte);
+            if (event_length > 0)
+            {
+                if (stream_emit_event(stream, (uint8_t*)read, (uint8_t*)read + event_length) != 0)
+                {
+                    stream->state = SMRE_stream_error;
+                    return 1;
+                }
+
+                read += event_length;
+                start = read;
+                continue;
+            }
+        }
+
+        switch (stream->state)
+        {
+            case SMRE_stream_header:
+            case SMRE_stream_track_header:
+            case SMRE_stream_body:
+            {
+                uint64_t available;
+
+                /* Bodies are taken in bulk, not byte by byte. */
+                available = end - read;
+                if (available < stream->body_remaining)
+                {
+                    stream->body_remaining -= (uint32_t)available;
+                    read = end;
+                    break;
+                }
+
+                read += stream->body_remaining;
+                stream->body_remaining = 0;
+                if (stream_complete(stream, start, read) != 0)
+                {
+                    stream->state = SMRE_stream_error;
+                    return 1;
+                }
+
+                start = read;
+                break;
+            }
+            case SMRE_stream_delta_time:
+                byte = *read++;
+                if (byte & 0x80)
+                {
+                    if (++stream->vlq_length == 4)
+                    {
+                        SMR_LOG("Delta time is longer than 4 bytes.\n");
+                        stream->state = SMRE_stream_error;
+                        return 1;
+                    }
+                }
+                else
+                {
+                    stream->state = SMRE_stream_status;
+                }
+                break;
+            case SMRE_stream_status:
+            {
+                uint8_t status_byte;
+                uint8_t status_byte_top;
+
+                status_byte = *read++;
+                stream->body_remaining = 0;
+
+                /* Check for running status. */
+                if (status_byte < 0x80)
+                {
+                    if (stream->last_status_byte >= 0xF0)
+                    {
+                        SMR_LOG("Currently not supporting running status for non-MIDI events.");
+                        stream->state = SMRE_stream_error;
+                        return 1;
+                    }
+
+                    /* That byte was the first data byte. */
+                    status_byte = stream->last_status_byte;
+                    stream->body_remaining = (uint32_t)-1;
+                }
+
+                status_byte_top = status_byte & 0xF0;
+                if (status_byte_top >= 0x80 && status_byte_top < 0xF0)
+                {
+                    /* Program change and channel pressure are the only 1 byte events. */
+                    stream->body_remaining += (status_byte_top == SMRE_midi_program_change || status_byte_top == SMRE_midi_channel_pressure) ? 1 : 2;
+                    stream->state = SMRE_stream_body;
+
+                    if (stream->body_remaining == 0)
+                    {
+                        if (stream_complete(stream, start, read) != 0)
+                        {
+                            stream->state = SMRE_stream_error;
+                            return 1;
+                        }
+
+                        start = read;
+                    }
+                }
+                else if (status_byte == 0xF0 || status_byte == 0xF7)
+                {
+                    stream->state = SMRE_stream_length;
+                    stream->vlq_value = 0;
+                    stream->vlq_length = 0;
+                }
+                else if (status_byte == 0xFF)
+                {
+                    stream->state = SMRE_stream_meta_type;
+                }
+                else
+                {
+                    SMR_LOG("\nDo not recognize status byte %02x.\n", status_byte & 0xFF);
+                    stream->state = SMRE_stream_error;
+                    return 1;
+                }
+                break;
+            }
+            case SMRE_stream_meta_type:
+                read += 1;
+                stream->state = SMRE_stream_length;
+                stream->vlq_value = 0;
+                stream->vlq_length = 0;
+                break;
+            case SMRE_stream_length:
+                byte = *read++;
+                stream->vlq_value = (stream->vlq_value << 7) | (byte & 0x7F);
+                if (byte & 0x80)
+                {
+                    if (++stream->vlq_length == 4)
+                    {
+                        SMR_LOG("Event length is longer than 4 bytes.\n");
+                        stream->state = SMRE_stream_error;
+                        return 1;
+                    }
+                    break;
+                }
+
+                /* Catch a bogus length before buffering for it. */
+                if ((uint64_t)stream->buffer_length + (read - start) + stream->vlq_value > stream->track_remaining)
+                {
+                    SMR_LOG("Event runs past the end of its track.\n");
+                    stream->state = SMRE_stream_error;
+                    return 1;
+                }
+
+                stream->state = SMRE_stream_body;
+                stream->body_remaining = stream->vlq_value;
+                if (stream->body_remaining == 0)
+                {
+                    if (stream_complete(stream, start, read) != 0)
+                    {
+                        stream->state = SMRE_stream_error;
+                        return 1;
+                    }
+
+                    start = read;
+                }
+                break;
+            case SMRE_stream_done:
+                /* Ignore anything after the last track. */
+                return 0;
+            case SMRE_stream_error:
+                return 1;
+        }
+    }
+
+    /* Hold on to the unfinished event until the rest of it is fed. */
+    if (read > start && stream->state != SMRE_stream_done)
+    {
+        if (stream_buffer_bytes(stream, start, read) != 0)
+        {
+            stream->state = SMRE_stream_error;
+            return 1;
+        }
+    }
+
+    return stream->state == SMRE_stream_error;
+}
+
+int smr_stream_finish(struct smr_stream* stream)
+{
+    if (stream->state != SMRE_stream_done)
+    {
+        SMR_LOG("MIDI stream ended before its last track.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+void smr_stream_free(struct smr_stream* stream)
+{
+    if (stream->buffer)
+    {
+        stream->allocator.free_func(stream->buffer, stream->buffer_capacity, stream->allocator.user);
+    }
+
+    stream->buffer = NULL;
+    stream->buffer_capacity = 0;
+    stream->buffer_length = 0;
+}
+
+/* Largest value a 4 byte variable length int holds. */
+#define SMR_MAX_VARIABLE_LENGTH_INT 0x0FFFFFFF
+
+/* One event as the writer sees it, whether it came from tracks or columns. */
+struct smr_written_event
+{
+    uint32_t delta_time;
+    /* Event type plus channel for MIDI events, 0xF0, 0xF7 or 0xFF otherwise. */
+    uint8_t status_byte;
+    /* MIDI events: first data byte in the low byte, second in the high byte. */
+    uint16_t data;
+    /* SysEx and meta events. */
+    const struct smr_event* event;
+};
+
+static uint32_t get_variable_length_int_size(uint32_t value)
+{
+    return 1 + (value > 0x7F) + (value > 0x3FFF) + (value > 0x1FFFFF);
+}
+
+/* Writes value without a branch per byte: the 7 bit groups are spread out into
+   the bytes of one word, continuation bits are masked in for all but the last
+   byte, and the word is stored big endian. Only the last few bytes of the
+   output are too close to end for a whole word store. */
+static void put_variable_length_int(uint8_t** write, uint8_t* end, uint32_t value)
+{
+    uint32_t size;
+    uint32_t spread;
+
+    size = get_variable_length_int_size(value);
+    spread = (value & 0x7F) | ((value << 1) & 0x7F00) | ((value << 2) & 0x7F0000) | ((value << 3) & 0x7F000000);
+    spread |= 0x80808000 & (0xFFFFFFFF >> (32 - 8 * size));
+    spread <<= 8 * (4 - size);
+    if (end - *write >= 4)
+    {
+        SMR_STORE_BE32(*write, spread);
+    }
+    else
+    {
+        uint8_t bytes[4];
+
+        SMR_STORE_BE32(bytes, spread);
+        memcpy(*write, bytes, size);
+    }
+
+    *write += size;
+}
+
+static void put_uint16(uint8_t** write, uint16_t value)
+{
+    (*write)[0] = (uint8_t)(value >> 8);
+    (*write)[1] = (uint8_t)value;
+    *write += 2;
+}
+
+static void put_uint32(uint8_t** write, uint32_t value)
+{
+    SMR_STORE_BE32(*write, value);
+    *write += 4;
+}
+
+/* Length of a meta event's data as written. */
+static uint32_t get_written_meta_length(const struct smr_event* event)
+{
+    switch (event->event_type)
+    {
+        case SMRE_meta_sequence_number:
+        case SMRE_meta_key_signature:
+            return 2;
+        case SMRE_meta_midi_channel_prefix:
+        case SMRE_meta_midi_port:
+            return 1;
+        case SMRE_meta_tempo:
+            return 3;
+        case SMRE_meta_smpte_offset:
+            return 5;
+        case SMRE_meta_time_signature:
+            return 4;
+        case SMRE_meta_text:
+        case SMRE_meta_copyright:
+        case SMRE_meta_track_name:
+        case SMRE_meta_instrument_name:
+        case SMRE_meta_lyric:
+        case SMRE_meta_marker:
+        case SMRE_meta_cue_point:
+        case SMRE_meta_program_name:
+        case SMRE_meta_device_name:
+        case SMRE_meta_sequencer_specific_event:
+            return event->length;
+        default:
+            /* End of track, and unknown meta events whose data is gone. */
+            return 0;
+    }
+}
+
+/* Length of a SysEx or meta event's data as written. */
+static uint32_t get_written_payload_length(const struct smr_written_event* written_event)
+{
+    return written_event->status_byte == 0xFF ? get_written_meta_length(written_event->event) : written_event->event->length;
+}
+
+/* Gets event event_index of track track_index. previous_time and other_index
+   carry over from the previous event of the track. */
+static void get_written_event(const struct smr_midi_data* midi_data, uint16_t track_index, uint32_t event_index, uint32_t* previous_time, uint32_t* other_index, struct smr_written_event* written_event)
+{
+    if (midi_data->columns)
+    {
+        const struct smr_track_columns* columns;
+        uint32_t time;
+
+        columns = midi_data->columns + track_index;
+        time = columns->times[event_index];
+        written_event->delta_time = columns->absolute_ticks ? time - *previous_time : time;
+        *previous_time = time;
+
+        written_event->status_byte = columns->status[event_index];
+        if (written_event->status_byte >= 0xF0)
+        {
+            written_event->event = columns->other + *other_index;
+            *other_index += 1;
+        }
+        else
+        {
+            written_event->data = columns->data[event_index];
+        }
+
+        return;
+    }
+
+    written_event->event = midi_data->tracks[track_index].events + event_index;
+    written_event->delta_time = written_event->event->delta_time;
+    if (written_event->event->event_type >= SMRE_midi_note_off && written_event->event->event_type < SMRE_sysex_single)
+    {
+        const struct smr_event* event;
+
+        event = written_event->event;
+        written_event->status_byte = (uint8_t)(event->event_type | event->channel);
+        switch (event->event_type)
+        {
+            case SMRE_midi_program_change:
+                written_event->data = event->program;
+                break;
+            case SMRE_midi_channel_pressure:
+                written_event->data = event->pressure;
+                break;
+            case SMRE_midi_pitch_bend:
+                /* Stored the way it was read, first data byte on top. */
+                written_event->data = (uint16_t)((event->pitch_bend >> 8) | (event->pitch_bend << 8));
+                break;
+            default:
+                written_event->data = (uint16_t)(event->note | (event->velocity << 8));
+                break;
+        }
+    }
+    else
+    {
+        written_event->status_byte = written_event->event->event_type >= SMRE_meta_sequence_number ? 0xFF : (uint8_t)written_event->event->event_type;
+    }
+}
+
+/* Bytes the event takes after its delta time. The status byte is left out
+   when running status allows it. */
+static uint32_t get_written_event_size(const struct smr_written_event* written_event, uint8_t last_status_byte)
+{
+    uint32_t length;
+
+    if (written_event->status_byte < 0xF0)
+    {
+        uint8_t status_byte_top;
+
+        status_byte_top = written_event->status_byte & 0xF0;
+        return (written_event->status_byte != last_status_byte) + ((status_byte_top == SMRE_midi_program_change || status_byte_top == SMRE_midi_channel_pressure) ? 1 : 2);
+    }
+
+    /* Meta events have their type byte after the status byte. */
+    length = get_written_payload_length(written_event);
+    return 1 + (written_event->status_byte == 0xFF) + get_variable_length_int_size(length) + length;
+}
+
+/* Size of the track's chunk, header included. */
+static int measure_written_track(const struct smr_midi_data* midi_data, uint16_t track_index, uint64_t* track_size)
+{
+    struct smr_written_event written_event;
+    uint32_t nevents;
+    uint32_t event_index;
+    uint32_t previous_time;
+    uint32_t other_index;
+    uint8_t last_status_byte;
+    uint64_t size;
+
+    nevents = get_track_nevents(midi_data, track_index);
+    previous_time = 0;
+    other_index = 0;
+    last_status_byte = 0xFF;
+    size = 0;
+    for (event_index = 0; event_index < nevents; ++event_index)
+    {
+        get_written_event(midi_data, track_index, event_index, &previous_time, &other_index, &written_event);
+        if (written_event.delta_time > SMR_MAX_VARIABLE_LENGTH_INT || (written_event.status_byte >= 0xF0 && get_written_payload_length(&written_event) > SMR_MAX_VARIABLE_LENGTH_INT))
+        {
+            SMR_LOG("Event %u of track %hu doesn't fit in a variable length int.\n", event_index, track_index);
+            return 1;
+        }
+
+        size += get_variable_length_int_size(written_event.delta_time) + get_written_event_size(&written_event, last_status_byte);
+        last_status_byte = written_event.status_byte;
+    }
+
+    if (size > 0xFFFFFFFF)
+    {
+        SMR_LOG("Track %hu is too large for a MIDI file.\n", track_index);
+        return 1;
+    }
+
+    *track_size = 8 + size;
+
+    return 0;
+}
+
+/* Writes the track's chunk, which smr_write_required_size has made sure fits
+   before end, the end of the whole output. */
+static void write_track(const struct smr_midi_data* midi_data, uint16_t track_index, uint8_t** write, uint8_t* end)
+{
+    struct smr_written_event written_event;
+    uint8_t* chunklen_write;
+    uint8_t* track_start;
+    uint32_t nevents;
+    uint32_t event_index;
+    uint32_t previous_time;
+    uint32_t other_index;
+    uint8_t last_status_byte;
+
+    memcpy(*write, "MTrk", 4);
+    /* The chunk length is filled in once the events are written. */
+    chunklen_write = *write + 4;
+    *write += 8;
+    track_start = *write;
+
+    nevents = get_track_nevents(midi_data, track_index);
+    previous_time = 0;
+    other_index = 0;
+    last_status_byte = 0xFF;
+    for (event_index = 0; event_index < nevents; ++event_index)
+    {
+        const struct smr_event* event;
+        uint32_t length;
+
+        get_written_event(midi_data, track_index, event_index, &previous_time, &other_index, &written_event);
+        put_variable_length_int(write, end, written_event.delta_time);
+
+        if (written_event.status_byte < 0xF0)
+        {
+            uint8_t status_byte_top;
+
+            if (written_event.status_byte != last_status_byte)
+            {
+                *(*write)++ = written_event.status_byte;
+            }
+
+            last_status_byte = written_event.status_byte;
+            status_byte_top = written_event.status_byte & 0xF0;
+            *(*write)++ = (uint8_t)written_event.data;
+            if (status_byte_top != SMRE_midi_program_change && status_byte_top != SMRE_midi_channel_pressure)
+            {
+                *(*write)++ = (uint8_t)(written_event.data >> 8);
+            }
+
+            continue;
+        }
+
+        /* SysEx and meta events cancel running status. */
+        last_status_byte = written_event.status_byte;
+        event = written_event.event;
+        length = get_written_payload_length(&written_event);
+        *(*write)++ = written_event.status_byte;
+        if (written_event.status_byte != 0xFF)
+        {
+            put_variable_length_int(write, end, length);
+            memcpy(*write, event->message, length);
+            *write += length;
+            continue;
+        }
+
+        *(*write)++ = (uint8_t)(event->event_type & 0xFF);
+        put_variable_length_int(write, end, length);
+
+        switch (event->event_type)
+        {
+            case SMRE_meta_sequence_number:
+                put_uint16(write, event->ss_ss);
+                break;
+            case SMRE_meta_text:
+            case SMRE_meta_copyright:
+            case SMRE_meta_track_name:
+            case SMRE_meta_instrument_name:
+            case SMRE_meta_lyric:
+            case SMRE_meta_marker:
+            case SMRE_meta_cue_point:
+            case SMRE_meta_program_name:
+            case SMRE_meta_device_name:
+            case SMRE_meta_sequencer_specific_event:
+                memcpy(*write, event->data, length);
+                *write += length;
+                break;
+            case SMRE_meta_midi_channel_prefix:
+                *(*write)++ = event->cc;
+                break;
+            case SMRE_meta_midi_port:
+                *(*write)++ = event->pp;
+                break;
+            case SMRE_meta_tempo:
+                *(*write)++ = (uint8_t)(event->tempo >> 16);
+                *(*write)++ = (uint8_t)(event->tempo >> 8);
+                *(*write)++ = (uint8_t)event->tempo;
+                break;
+            case SMRE_meta_smpte_offset:
+                *(*write)++ = event->hr;
+                *(*write)++ = event->mn;
+                *(*write)++ = event->se;
+                *(*write)++ = event->fr;
+                *(*write)++ = event->ff;
+                break;
+            case SMRE_meta_time_signature:
+                *(*write)++ = event->nn;
+                *(*write)++ = event->dd;
+                *(*write)++ = event->cc;
+                *(*write)++ = event->bb;
+                break;
+            case SMRE_meta_key_signature:
+                *(*write)++ = event->sf;
+                *(*write)++ = event->mi;
+                break;
+            default:
+                break;
+        }
+    }
+
+    SMR_STORE_BE32(chunklen_write, (uint32_t)(*write - track_start));
+}
+
+int smr_write_required_size(const struct smr_midi_data* midi_data, uint64_t* required_size)
+{
+    uint16_t track_index;
+    uint64_t size;
+
+    size = 14;
+    for (track_index = 0; track_index < midi_data->ntracks; ++track_index)
+    {
+        uint64_t track_size;
+
+        if (measure_written_track(midi_data, track_index, &track_size) != 0)
+        {
+            return 1;
+        }
+
+        size += track_size;
+    }
+
+    *required_size = size;
+
+    return 0;
+}
+
+int smr_write_byte_array(const struct smr_midi_data* midi_data, uint8_t* buffer, uint64_t buffer_len, uint64_t* written)
+{
+    uint8_t* write;
+    uint8_t* end;
+    uint64_t required_size;
+    uint16_t track_index;
+
+    if (smr_write_required_size(midi_data, &required_size) != 0)
+    {
+        return 1;
+    }
+
+    if (buffer_len < required_size)
+    {
+        SMR_LOG("Buffer of %lu bytes is too small for the %lu byte MIDI file.\n", (unsigned long)buffer_len, (unsigned long)required_size);
+        return 1;
+    }
+
+    write = buffer;
+    end = buffer + required_size;
+
+    memcpy(write, "MThd", 4);
+    write += 4;
+    put_uint32(&write, 6);
+    put_uint16(&write, midi_data->format);
+    put_uint16(&write, midi_data->ntracks);
+    if (midi_data->time_type == SMRE_timecode)
+    {
+        /* Back to the negative frame rate the file stores. */
+        *write++ = (uint8_t)(0 - midi_data->fps);
+        *write++ = midi_data->subframe_resolution;
+    }
+    else
+    {
+        put_uint16(&write, midi_data->tickdiv);
+    }
+
+    for (track_index = 0; track_index < midi_data->ntracks; ++track_index)
+    {
+        write_track(midi_data, track_index, &write, end);
+    }
+
+    if (written)
+    {
+        *written = required_size;
+    }
+
+    return 0;
+}
+
+/* Writes buffer out as the whole file. */
+static int save_file(const char* filename, const uint8_t* buffer, uint64_t buffer_len)
+{
+    FILE* file_ptr;
+    size_t bytes_written;
+
+    file_ptr = fopen(filename, "wb");
+    if (!file_ptr)
+    {
+        SMR_LOG("Unable to open file for writing!\n");
+        return 1;
+    }
+
+    bytes_written = fwrite(buffer, sizeof(uint8_t), buffer_len, file_ptr);
+    if (fclose(file_ptr) != 0 || bytes_written != (size_t)buffer_len)
+    {
+        SMR_LOG("Unable to write file, wrote %lu of %lu bytes!\n", (unsigned long)bytes_written, (unsigned long)buffer_len);
+        return 1;
+    }
+
+    return 0;
+}
+
+int smr_write_file(const char* filename, const struct smr_midi_data* midi_data)
+{
+    uint8_t* buffer;
+    uint64_t buffer_len;
+    int return_code;
+
+    if (smr_write_required_size(midi_data, &buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    buffer = (uint8_t*)SMR_MALLOC(buffer_len);
+    if (!buffer)
+    {
+        SMR_LOG("Unable to allocate memory for file!\n");
+        return 1;
+    }
+
+    smr_write_byte_array(midi_data, buffer, buffer_len, NULL);
+    return_code = save_file(filename, buffer, buffer_len);
+
+    SMR_FREE(buffer);
+
+    return return_code;
+}
+
+#define SMR_CACHE_VERSION 1
+/* The block starts this far into a cache, keeping it 8 byte aligned. */
+#define SMR_CACHE_HEADER_SIZE 64
+
+enum smr_cache_kind
+{
+    SMRE_cache_empty,
+    SMRE_cache_tracks,
+    SMRE_cache_columns
+};
+
+/* Exactly SMR_CACHE_HEADER_SIZE bytes, largest fields first so there is no
+   padding. Offsets are into the block. The block (padded to 8 bytes) is
+   followed by nrelocations offsets of the pointers in it. */
+struct smr_cache_header
+{
+    /* Of everything after it. */
+    uint64_t hash;
+    uint64_t mem_size;
+    uint64_t tracks_offset;
+    uint64_t timeline_offset;
+    uint64_t timeline_nentries;
+    char magic[4];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t nrelocations;
+    uint16_t format;
+    uint16_t ntracks;
+    /* tickdiv, or fps and subframe_resolution. */
+    uint16_t division;
+    uint8_t time_type;
+    uint8_t kind;
+};
+
+/* Turns pointers into _mem_block into offsets, in copy, which holds the size
+   bytes of the block. Where each pointer sits in the block goes to relocations
+   (when not NULL), which are counted either way. */
+struct smr_relocation
+{
+    uint8_t* base;
+    uint8_t* copy;
+    uint64_t size;
+    uint64_t* relocations;
+    uint64_t nrelocations;
+};
+
+/* Identifies the machine a cache was written on: only one with the same
+   pointer size, struct sizes and byte order can use it. */
+static uint32_t get_cache_layout(void)
+{
+    uint16_t one;
+
+    one = 1;
+    return (uint32_t)sizeof(void*) | (uint32_t)sizeof(struct smr_event) << 8 | (uint32_t)sizeof(struct smr_track_columns) << 16 | (uint32_t)*(uint8_t*)&one << 24;
+}
+
+/* FNV-1a over 8 byte words in four interleaved lanes, so the multiplies don't
+   wait on each other. Plenty to catch a truncated or damaged cache, though not
+   a forged one. size is a multiple of 8. */
+static uint64_t hash_cache(const uint8_t* bytes, uint64_t size)
+{
+    uint64_t lanes[4];
+    uint64_t word;
+    uint64_t i;
+
+    lanes[0] = 0xCBF29CE484222325ull;
+    lanes[1] = lanes[0] ^ 1;
+    lanes[2] = lanes[0] ^ 2;
+    lanes[3] = lanes[0] ^ 3;
+    for (i = 0; i + 32 <= size; i += 32)
+    {
+        memcpy(&word, bytes + i, 8);
+        lanes[0] = (lanes[0] ^ word) * 0x100000001B3ull;
+        memcpy(&word, bytes + i + 8, 8);
+        lanes[1] = (lanes[1] ^ word) * 0x100000001B3ull;
+        memcpy(&word, bytes + i + 16, 8);
+        lanes[2] = (lanes[2] ^ word) * 0x100000001B3ull;
+        memcpy(&word, bytes + i + 24, 8);
+        lanes[3] = (lanes[3] ^ word) * 0x100000001B3ull;
+    }
+
+    for (; i < size; i += 8)
+    {
+        memcpy(&word, bytes + i, 8);
+        lanes[0] = (lanes[0] ^ word) * 0x100000001B3ull;
+    }
+
+    return ((lanes[0] * 0x100000001B3ull ^ lanes[1]) * 0x100000001B3ull ^ lanes[2]) * 0x100000001B3ull ^ lanes[3];
+}
+
+/* Turns the pointer at field, which points at size bytes, into an offset and
+   returns where those bytes are in the copy. NULL if they aren't all inside
+   the block. */
+static void* relocate_pointer(struct smr_relocation* relocation, void* field, uint64_t size)
+{
+    uint8_t* pointer;
+    uint64_t offset;
+
+    memcpy(&pointer, field, sizeof(pointer));
+    offset = (uint64_t)(pointer - relocation->base);
+    if (pointer < relocation->base || offset > relocation->size || size > relocation->size - offset)
+    {
+        return NULL;
+    }
+
+    pointer = (uint8_t*)(uintptr_t)offset;
+    memcpy(field, &pointer, sizeof(pointer));
+
+    /* Pointers of smr_midi_data itself go in the header instead. */
+    if ((uint8_t*)field >= relocation->copy && (uint8_t*)field < relocation->copy + relocation->size)
+    {
+        if (relocation->relocations)
+        {
+            relocation->relocations[relocation->nrelocations] = (uint64_t)((uint8_t*)field - relocation->copy);
+        }
+
+        relocation->nrelocations += 1;
+    }
+
+    return relocation->copy + offset;
+}
+
+static int relocate_event_payload(struct smr_relocation* relocation, struct smr_event* event)
+{
+    switch (event->event_type)
+    {
+        case SMRE_sysex_single:
+        case SMRE_sysex_escape:
+        case SMRE_meta_sequencer_specific_event:
+            return relocate_pointer(relocation, &event->data, event->length) == NULL;
+        case SMRE_meta_text:
+        case SMRE_meta_copyright:
+        case SMRE_meta_track_name:
+        case SMRE_meta_instrument_name:
+        case SMRE_meta_lyric:
+        case SMRE_meta_marker:
+        case SMRE_meta_cue_point:
+        case SMRE_meta_program_name:
+        case SMRE_meta_device_name:
+            /* Null terminator included. */
+            return relocate_pointer(relocation, &event->text, (uint64_t)event->length + 1) == NULL;
+        default:
+            return 0;
+    }
+}
+
+/* Turns every pointer of midi_data, and of the structures it points to in the
+   copy, into an offset. */
+static int relocate_midi_data(struct smr_relocation* relocation, struct smr_midi_data* midi_data)
+{
+    uint16_t track_index;
+
+    if (midi_data->columns)
+    {
+        struct smr_track_columns* columns;
+
+        columns = (struct smr_track_columns*)relocate_pointer(relocation, &midi_data->columns, (uint64_t)midi_data->ntracks * sizeof(struct smr_track_columns));
+        if (!columns)
+        {
+            return 1;
+        }
+
+        for (track_index = 0; track_index < midi_data->ntracks; ++track_index)
+        {
+            struct smr_track_columns* track_columns;
+            struct smr_event* other;
+            uint32_t other_index;
+
+            track_columns = columns + track_index;
+            other = (struct smr_event*)relocate_pointer(relocation, &track_columns->other, (uint64_t)track_columns->nother * sizeof(struct smr_event));
+            if (!relocate_pointer(relocation, &track_columns->times, (uint64_t)track_columns->nevents * sizeof(uint32_t)) ||
+                !relocate_pointer(relocation, &track_columns->status, track_columns->nevents) ||
+                !relocate_pointer(relocation, &track_columns->data, (uint64_t)track_columns->nevents * sizeof(uint16_t)) ||
+                !relocate_pointer(relocation, &track_columns->other_index, (uint64_t)track_columns->nother * sizeof(uint32_t)) ||
+                !other)
+            {
+                return 1;
+            }
+
+            for (other_index = 0; other_index < track_columns->nother; ++other_index)
+            {
+                if (relocate_event_payload(relocation, other + other_index) != 0)
+                {
+                    return 1;
+                }
+            }
+        }
+    }
+    else if (midi_data->tracks)
+    {
+        struct smr_track_data* tracks;
+
+        tracks = (struct smr_track_data*)relocate_pointer(relocation, &midi_data->tracks, (uint64_t)midi_data->ntracks * sizeof(struct smr_track_data));
+        if (!tracks)
+        {
+            return 1;
+        }
+
+        for (track_index = 0; track_index < midi_data->ntracks; ++track_index)
+        {
+            struct smr_event* events;
+            uint32_t event_index;
+
+            events = (struct smr_event*)relocate_pointer(relocation, &tracks[track_index].events, (uint64_t)tracks[track_index].nevents * sizeof(struct smr_event));
+            if (!events)
+            {
+                return 1;
+            }
+
+            for (event_index = 0; event_index < tracks[track_index].nevents; ++event_index)
+            {
+                if (relocate_event_payload(relocation, events + event_index) != 0)
+                {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    if (midi_data->timeline.nentries > 0 && !relocate_pointer(relocation, &midi_data->timeline.entries, midi_data->timeline.nentries * sizeof(struct smr_timeline_entry)))
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Offset of the relocations in a cache. */
+static uint64_t get_cache_relocations_offset(uint64_t mem_size)
+{
+    return SMR_CACHE_HEADER_SIZE + ((mem_size + 7) & ~(uint64_t)7);
+}
+
+int smr_cache_required_size(const struct smr_midi_data* midi_data, uint64_t* required_size)
+{
+    struct smr_relocation relocation;
+    struct smr_midi_data offsets;
+    uint8_t* copy;
+
+    /* Counting the pointers means turning them into offsets, so do that on a
+       scratch copy. */
+    copy = NULL;
+    if (midi_data->_mem_size > 0)
+    {
+        copy = (uint8_t*)SMR_MALLOC(midi_data->_mem_size);
+        if (!copy)
+        {
+            SMR_LOG("Unable to allocate memory for cache!\n");
+            return 1;
+        }
+
+        memcpy(copy, midi_data->_mem_block, midi_data->_mem_size);
+    }
+
+    offsets = *midi_data;
+    memset(&relocation, 0, sizeof(relocation));
+    relocation.base = midi_data->_mem_block;
+    relocation.copy = copy;
+    relocation.size = midi_data->_mem_size;
+    if (relocate_midi_data(&relocation, &offsets) != 0)
+    {
+        SMR_LOG("Only MIDI data that lives entirely in its _mem_block can be cached.\n");
+        SMR_FREE(copy);
+        return 1;
+    }
+
+    SMR_FREE(copy);
+    *required_size = get_cache_relocations_offset(midi_data->_mem_size) + relocation.nrelocations * sizeof(uint64_t);
+
+    return 0;
+}
+
+int smr_write_cache(const struct smr_midi_data* midi_data, uint8_t* buffer, uint64_t buffer_len, uint64_t* written)
+{
+    struct smr_cache_header header;
+    struct smr_relocation relocation;
+    struct smr_midi_data offsets;
+    uint64_t required_size;
+    uint64_t relocations_offset;
+
+    if (smr_cache_required_size(midi_data, &required_size) != 0)
+    {
+        return 1;
+    }
+
+    if (buffer_len < required_size)
+    {
+        SMR_LOG("Buffer of %lu bytes is too small for the %lu byte cache.\n", (unsigned long)buffer_len, (unsigned long)required_size);
+        return 1;
+    }
+
+    relocations_offset = get_cache_relocations_offset(midi_data->_mem_size);
+    memset(buffer + SMR_CACHE_HEADER_SIZE + midi_data->_mem_size, 0, relocations_offset - SMR_CACHE_HEADER_SIZE - midi_data->_mem_size);
+    if (midi_data->_mem_size > 0)
+    {
+        memcpy(buffer + SMR_CACHE_HEADER_SIZE, midi_data->_mem_block, midi_data->_mem_size);
+    }
+
+    /* Checked by smr_cache_required_size already. */
+    offsets = *midi_data;
+    relocation.base = midi_data->_mem_block;
+    relocation.copy = buffer + SMR_CACHE_HEADER_SIZE;
+    relocation.size = midi_data->_mem_size;
+    relocation.relocations = (uint64_t*)(buffer + relocations_offset);
+    relocation.nrelocations = 0;
+    relocate_midi_data(&relocation, &offsets);
+    if (relocation.nrelocations > 0xFFFFFFFF)
+    {
+        SMR_LOG("Too many pointers to cache.\n");
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SMRC", 4);
+    header.version = SMR_CACHE_VERSION;
+    header.layout = get_cache_layout();
+    header.kind = midi_data->columns ? SMRE_cache_columns : (midi_data->tracks ? SMRE_cache_tracks : SMRE_cache_empty);
+    header.mem_size = midi_data->_mem_size;
+    header.nrelocations = (uint32_t)relocation.nrelocations;
+    header.tracks_offset = (uint64_t)(uintptr_t)(midi_data->columns ? (uint8_t*)offsets.columns : (uint8_t*)offsets.tracks);
+    header.timeline_nentries = midi_data->timeline.nentries;
+    header.timeline_offset = midi_data->timeline.nentries > 0 ? (uint64_t)(uintptr_t)offsets.timeline.entries : 0;
+    header.format = midi_data->format;
+    header.ntracks = midi_data->ntracks;
+    header.division = midi_data->tickdiv;
+    header.time_type = (uint8_t)midi_data->time_type;
+    memcpy(buffer, &header, SMR_CACHE_HEADER_SIZE);
+    header.hash = hash_cache(buffer + sizeof(header.hash), required_size - sizeof(header.hash));
+    memcpy(buffer, &header.hash, sizeof(header.hash));
+
+    if (written)
+    {
+        *written = required_size;
+    }
+
+    return 0;
+}
+
+int smr_write_cache_file(const char* filename, const struct smr_midi_data* midi_data)
+{
+    uint8_t* buffer;
+    uint64_t buffer_len;
+    int return_code;
+
+    if (smr_cache_required_size(midi_data, &buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    buffer = (uint8_t*)SMR_MALLOC(buffer_len);
+    if (!buffer)
+    {
+        SMR_LOG("Unable to allocate memory for cache!\n");
+        return 1;
+    }
+
+    return_code = smr_write_cache(midi_data, buffer, buffer_len, NULL);
+    if (return_code == 0)
+    {
+        return_code = save_file(filename, buffer, buffer_len);
+    }
+
+    SMR_FREE(buffer);
+
+    return return_code;
+}
+
+/* Pointer to the size bytes at offset of the block, NULL if they aren't all in
+   it or are misaligned. */
+static void* get_cache_pointer(uint8_t* block, uint64_t mem_size, uint64_t offset, uint64_t size, uint64_t alignment)
+{
+    if (offset > mem_size || size > mem_size - offset || (offset & (alignment - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    return block + offset;
+}
+
+/* Checks the cache and puts the pointers of its block back: one pass over the
+   relocations, however many events there are. Leaves _allocator to the
+   caller. */
+static int open_cache(uint8_t* buffer, uint64_t buffer_len, struct smr_midi_data* midi_data)
+{
+    struct smr_cache_header header;
+    uint8_t* block;
+    uint64_t relocations_offset;
+    uint64_t* relocations;
+    uint32_t relocation_index;
+
+    if (buffer_len < SMR_CACHE_HEADER_SIZE)
+    {
+        SMR_LOG("Cache is too short for its header.\n");
+        return 1;
+    }
+
+    memcpy(&header, buffer, SMR_CACHE_HEADER_SIZE);
+    if (memcmp(header.magic, "SMRC", 4) != 0 || header.version != SMR_CACHE_VERSION || header.layout != get_cache_layout())
+    {
+        SMR_LOG("Cache was written by another version of the library or for another machine.\n");
+        return 1;
+    }
+
+    if (header.mem_size > buffer_len || header.kind > SMRE_cache_columns ||
+        get_cache_relocations_offset(header.mem_size) > buffer_len ||
+        header.nrelocations > (buffer_len - get_cache_relocations_offset(header.mem_size)) / sizeof(uint64_t))
+    {
+        SMR_LOG("Cache is damaged.\n");
+        return 1;
+    }
+
+    block = buffer + SMR_CACHE_HEADER_SIZE;
+    relocations_offset = get_cache_relocations_offset(header.mem_size);
+    if (header.hash != hash_cache(buffer + sizeof(header.hash), relocations_offset - sizeof(header.hash) + header.nrelocations * sizeof(uint64_t)))
+    {
+        SMR_LOG("Cache is damaged.\n");
+        return 1;
+    }
+
+    memset(midi_data, 0, sizeof(*midi_data));
+    midi_data->format = header.format;
+    midi_data->ntracks = header.ntracks;
+    midi_data->tickdiv = header.division;
+    midi_data->time_type = header.time_type == SMRE_timecode ? SMRE_timecode : SMRE_metrical;
+    if (header.kind == SMRE_cache_columns)
+    {
+        midi_data->columns = (struct smr_track_columns*)get_cache_pointer(block, header.mem_size, header.tracks_offset, (uint64_t)header.ntracks * sizeof(struct smr_track_columns), 8);
+    }
+    else if (header.kind == SMRE_cache_tracks)
+    {
+        midi_data->tracks = (struct smr_track_data*)get_cache_pointer(block, header.mem_size, header.tracks_offset, (uint64_t)header.ntracks * sizeof(struct smr_track_data), 8);
+    }
+
+    if (header.timeline_nentries > 0)
+    {
+        midi_data->timeline.nentries = header.timeline_nentries;
+        midi_data->timeline.entries = header.timeline_nentries > header.mem_size ? NULL : (struct smr_timeline_entry*)get_cache_pointer(block, header.mem_size, header.timeline_offset, header.timeline_nentries * sizeof(struct smr_timeline_entry), 8);
+    }
+
+    if ((header.kind != SMRE_cache_empty && !midi_data->tracks && !midi_data->columns) || (header.timeline_nentries > 0 && !midi_data->timeline.entries))
+    {
+        SMR_LOG("Cache is damaged.\n");
+        return 1;
+    }
+
+    relocations = (uint64_t*)(buffer + relocations_offset);
+    for (relocation_index = 0; relocation_index < header.nrelocations; ++relocation_index)
+    {
+        uint8_t* field;
+        uintptr_t offset;
+
+        field = (uint8_t*)get_cache_pointer(block, header.mem_size, relocations[relocation_index], sizeof(void*), sizeof(void*));
+        if (!field)
+        {
+            SMR_LOG("Cache is damaged.\n");
+            return 1;
+        }
+
+        memcpy(&offset, field, sizeof(offset));
+        if (offset > header.mem_size)
+        {
+            SMR_LOG("Cache is damaged.\n");
+            return 1;
+        }
+
+        offset += (uintptr_t)block;
+        memcpy(field, &offset, sizeof(offset));
+    }
+
+    midi_data->_mem_block = block;
+    midi_data->_mem_size = header.mem_size;
+
+    return 0;
+}
+
+int smr_load_cache(uint8_t* buffer, uint64_t buffer_len, struct smr_midi_data* midi_data)
+{
+    if (((uintptr_t)buffer & 7) != 0)
+    {
+        SMR_LOG("Cache buffer must be 8 byte aligned.\n");
+        return 1;
+    }
+
+    if (open_cache(buffer, buffer_len, midi_data) != 0)
+    {
+        return 1;
+    }
+
+    memset(&midi_data->_allocator, 0, sizeof(midi_data->_allocator));
+
+    return 0;
+}
+
+#ifdef SMR_HAS_MMAP
+/* free_func of a mapped cache: the mapping starts at its header, and the
+   length is kept in user. */
+static void unmap_cache(void* ptr, size_t size, void* user)
+{
+    (void)size;
+    munmap((uint8_t*)ptr - SMR_CACHE_HEADER_SIZE, (size_t)(uintptr_t)user);
+}
+#else
+/* free_func of a cache read into memory by load_file. */
+static void free_cache(void* ptr, size_t size, void* user)
+{
+    (void)size;
+    (void)user;
+    SMR_FREE((uint8_t*)ptr - SMR_CACHE_HEADER_SIZE);
+}
+#endif
+
+int smr_load_cache_file(const char* filename, struct smr_midi_data* midi_data)
+{
+    uint8_t* buffer;
+    uint64_t buffer_len;
+#ifdef SMR_HAS_MMAP
+    int file_descriptor;
+    struct stat file_stat;
+
+    file_descriptor = open(filename, O_RDONLY);
+    if (file_descriptor < 0)
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+    if (fstat(file_descriptor, &file_stat) != 0 || file_stat.st_size < SMR_CACHE_HEADER_SIZE)
+    {
+        SMR_LOG("Unable to get file size!\n");
+        close(file_descriptor);
+        return 1;
+    }
+
+    /* Private and writable: fixing up the pointers copies only the pages that
+       hold them, and nothing goes back to the file. */
+    buffer_len = file_stat.st_size;
+    buffer = (uint8_t*)mmap(NULL, buffer_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_descriptor, 0);
+    close(file_descriptor);
+    if (buffer == (uint8_t*)MAP_FAILED)
+    {
+        SMR_LOG("Unable to map file!\n");
+        return 1;
+    }
+
+    if (open_cache(buffer, buffer_len, midi_data) != 0)
+    {
+        munmap(buffer, buffer_len);
+        return 1;
+    }
+
+    memset(&midi_data->_allocator, 0, sizeof(midi_data->_allocator));
+    midi_data->_allocator.free_func = unmap_cache;
+    midi_data->_allocator.user = (void*)(uintptr_t)buffer_len;
+#else
+    if (load_file(filename, &buffer, &buffer_len) != 0)
+    {
+        return 1;
+    }
+
+    if (open_cache(buffer, buffer_len, midi_data) != 0)
+    {
+        SMR_FREE(buffer);
+        return 1;
+    }
+
+    memset(&midi_data->_allocator, 0, sizeof(midi_data->_allocator));
+    midi_data->_allocator.free_func = free_cache;
+#endif
+
+    return 0;
+}
+
+#define SMR_FILE_CACHE_MIN_BUCKETS 64
+
+enum smr_file_cache_state
+{
+    SMRE_file_cache_loading,
+    SMRE_file_cache_ready,
+    SMRE_file_cache_failed
+};
+
+struct smr_file_cache_entry
+{
+    /* First, so that a released smr_midi_data leads back to its entry. */
+    struct smr_midi_data midi_data;
+    struct smr_file_cache_entry* next_in_bucket;
+    /* Only entries nobody holds are on the LRU list, most recent first. */
+    struct smr_file_cache_entry* lru_prev;
+    struct smr_file_cache_entry* lru_next;
+    /* Null terminated, right after the entry in the same allocation. */
+    char* path;
+    uint64_t path_hash;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t bytes;
+    uint32_t refcount;
+    enum smr_file_cache_state state;
+    /* Out of the table because its file changed or failed to parse, freed
+       once the last holder lets go. */
+    uint8_t detached;
+};
+
+struct smr_file_cache
+{
+    struct smr_read_options options;
+    struct smr_allocator allocator;
+    uint64_t byte_budget;
+    struct smr_file_cache_entry** buckets;
+    uint32_t nbuckets;
+    struct smr_file_cache_entry* lru_head;
+    struct smr_file_cache_entry* lru_tail;
+    struct smr_file_cache_stats stats;
+#ifdef SMR_ENABLE_THREADS
+    pthread_mutex_t mutex;
+    /* Broadcast whenever a parse finishes. */
+    pthread_cond_t loaded;
+#endif
+};
+
+static void lock_file_cache(struct smr_file_cache* cache)
+{
+#ifdef SMR_ENABLE_THREADS
+    pthread_mutex_lock(&cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void unlock_file_cache(struct smr_file_cache* cache)
+{
+#ifdef SMR_ENABLE_THREADS
+    pthread_mutex_unlock(&cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+/* Modification time and size, which say whether a cached parse is stale. The
+   time is in the finest units the platform gives, nanoseconds where stat has
+   them, so a rewrite within the same second still counts. */
+static int get_file_identity(const char* filename, int64_t* mtime, uint64_t* size)
+{
+#if defined(SMR_HAS_MMAP)
+    struct stat file_stat;
+
+    if (stat(filename, &file_stat) != 0)
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+#if defined(__APPLE__)
+    *mtime = (int64_t)file_stat.st_mtimespec.tv_sec * 1000000000 + file_stat.st_mtimespec.tv_nsec;
+#elif defined(st_mtime)
+    /* st_mtime is a macro for st_mtim.tv_sec where st_mtim exists. */
+    *mtime = (int64_t)file_stat.st_mtim.tv_sec * 1000000000 + file_stat.st_mtim.tv_nsec;
+#else
+    *mtime = (int64_t)file_stat.st_mtime;
+#endif
+    *size = (uint64_t)file_stat.st_size;
+#elif defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+    if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes))
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+    /* 100 nanosecond units. */
+    *mtime = (int64_t)(((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime);
+    *size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+#else
+    FILE* file_ptr;
+
+    /* Without stat, only the size says whether the file changed. */
+    file_ptr = fopen(filename, "rb");
+    if (!file_ptr)
+    {
+        SMR_LOG("Unable to open file!\n");
+        return 1;
+    }
+
+    fseek(file_ptr, 0L, SEEK_END);
+    *size = (uint64_t)ftell(file_ptr);
+    *mtime = 0;
+    fclose(file_ptr);
+#endif
+
+    return 0;
+}
+
+static uint64_t hash_path(const char* path)
+{
+    uint64_t hash;
+
+    hash = 0xCBF29CE484222325ull;
+    while (*path)
+    {
+        hash = (hash ^ (uint8_t)*path++) * 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+static struct smr_file_cache_entry** find_file_cache_bucket(struct smr_file_cache* cache, uint64_t path_hash)
+{
+    return cache->buckets + (path_hash & (cache->nbuckets - 1));
+}
+
+static struct smr_file_cache_entry* find_file_cache_entry(struct smr_file_cache* cache, const char* path, uint64_t path_hash)
+{
+    struct smr_file_cache_entry* entry;
+
+    for (entry = *find_file_cache_bucket(cache, path_hash); entry; entry = entry->next_in_bucket)
+    {
+        if (entry->path_hash == path_hash && strcmp(entry->path, path) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Doubles the buckets once there are more entries than buckets. Failing to
+   only makes the chains longer. */
+static void grow_file_cache_buckets(struct smr_file_cache* cache)
+{
+    struct smr_file_cache_entry** old_buckets;
+    uint32_t old_nbuckets;
+    uint32_t bucket_index;
+
+    old_buckets = cache->buckets;
+    old_nbuckets = cache->nbuckets;
+    cache->buckets = (struct smr_file_cache_entry**)cache->allocator.alloc_func(2 * old_nbuckets * sizeof(struct smr_file_cache_entry*), cache->allocator.user);
+    if (!cache->buckets)
+    {
+        cache->buckets = old_buckets;
+        return;
+    }
+
+    cache->nbuckets = 2 * old_nbuckets;
+    memset(cache->buckets, 0, cache->nbuckets * sizeof(struct smr_file_cache_entry*));
+    for (bucket_index = 0; bucket_index < old_nbuckets; ++bucket_index)
+    {
+        while (old_buckets[bucket_index])
+        {
+            struct smr_file_cache_entry* entry;
+            struct smr_file_cache_entry** bucket;
+
+            entry = old_buckets[bucket_index];
+            old_buckets[bucket_index] = entry->next_in_bucket;
+            bucket = find_file_cache_bucket(cache, entry->path_hash);
+            entry->next_in_bucket = *bucket;
+            *bucket = entry;
+        }
+    }
+
+    cache->allocator.free_func(old_buckets, old_nbuckets * sizeof(struct smr_file_cache_entry*), cache->allocator.user);
+}
+
+static void detach_file_cache_entry(struct smr_file_cache* cache, struct smr_file_cache_entry* entry)
+{
+    struct smr_file_cache_entry** link;
+
+    for (link = find_file_cache_bucket(cache, entry->path_hash); *link != entry; link = &(*link)->next_in_bucket)
+    {
+    }
+
+    *link = entry->next_in_bucket;
+    entry->detached = 1;
+    cache->stats.nentries -= 1;
+}
+
+static void remove_from_lru(struct smr_file_cache* cache, struct smr_file_cache_entry* entry)
+{
+    if (entry->lru_prev)
+    {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else
+    {
+        cache->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next)
+    {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else
+    {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void push_to_lru(struct smr_file_cache* cache, struct smr_file_cache_entry* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+    {
+        cache->lru_head->lru_prev = entry;
+    }
+    else
+    {
+        cache->lru_tail = entry;
+    }
+
+    cache->lru_head = entry;
+}
+
+static void free_file_cache_entry(struct smr_file_cache* cache, struct smr_file_cache_entry* entry)
+{
+    if (entry->state == SMRE_file_cache_ready)
+    {
+        smr_free_midi_data(&entry->midi_data);
+        cache->stats.bytes -= entry->bytes;
+    }
+
+    cache->allocator.free_func(entry, sizeof(struct smr_file_cache_entry) + strlen(entry->path) + 1, cache->allocator.user);
+}
+
+/* Lets go of entry, which is freed or becomes evictable if nobody else holds it. */
+static void unref_file_cache_entry(struct smr_file_cache* cache, struct smr_file_cache_entry* entry)
+{
+    entry->refcount -= 1;
+    if (entry->refcount > 0)
+    {
+        return;
+    }
+
+    if (entry->detached)
+    {
+        free_file_cache_entry(cache, entry);
+        return;
+    }
+
+    push_to_lru(cache, entry);
+}
+
+static void evict_file_cache_entries(struct smr_file_cache* cache)
+{
+    while (cache->stats.bytes > cache->byte_budget && cache->lru_tail)
+    {
+        struct smr_file_cache_entry* entry;
+
+        entry = cache->lru_tail;
+        remove_from_lru(cache, entry);
+        detach_file_cache_entry(cache, entry);
+        free_file_cache_entry(cache, entry);
+        cache->stats.evictions += 1;
+    }
+}
+
+int smr_file_cache_create(uint64_t byte_budget, const struct smr_read_options* options, struct smr_file_cache** cache)
+{
+    const struct smr_allocator* allocator;
+    struct smr_file_cache* new_cache;
+
+    allocator = get_allocator(options);
+    new_cache = (struct smr_file_cache*)allocator->alloc_func(sizeof(struct smr_file_cache), allocator->user);
+    if (!new_cache)
+    {
+        SMR_LOG("Unable to allocate memory for file cache.\n");
+        return 1;
+    }
+
+    memset(new_cache, 0, sizeof(*new_cache));
+    if (options)
+    {
+        new_cache->options = *options;
+    }
+
+    /* Shared data has to own its payloads. */
+    new_cache->options.flags &= ~(uint32_t)SMRE_read_borrow_payloads;
+    new_cache->allocator = *allocator;
+    new_cache->byte_budget = byte_budget;
+    new_cache->nbuckets = SMR_FILE_CACHE_MIN_BUCKETS;
+    new_cache->buckets = (struct smr_file_cache_entry**)allocator->alloc_func(new_cache->nbuckets * sizeof(struct smr_file_cache_entry*), allocator->user);
+    if (!new_cache->buckets)
+    {
+        SMR_LOG("Unable to allocate memory for file cache.\n");
+        allocator->free_func(new_cache, sizeof(struct smr_file_cache), allocator->user);
+        return 1;
+    }
+
+    memset(new_cache->buckets, 0, new_cache->nbuckets * sizeof(struct smr_file_cache_entry*));
+#ifdef SMR_ENABLE_THREADS
+    pthread_mutex_init(&new_cache->mutex, NULL);
+    pthread_cond_init(&new_cache->loaded, NULL);
+#endif
+
+    *cache = new_cache;
+
+    return 0;
+}
+
+int smr_file_cache_free(struct smr_file_cache* cache)
+{
+    struct smr_allocator allocator;
+    uint32_t bucket_index;
+
+    for (bucket_index = 0; bucket_index < cache->nbuckets; ++bucket_index)
+    {
+        while (cache->buckets[bucket_index])
+        {
+            struct smr_file_cache_entry* entry;
+
+            entry = cache->buckets[bucket_index];
+            cache->buckets[bucket_index] = entry->next_in_bucket;
+            free_file_cache_entry(cache, entry);
+        }
+    }
+
+#ifdef SMR_ENABLE_THREADS
+    pthread_mutex_destroy(&cache->mutex);
+    pthread_cond_destroy(&cache->loaded);
+#endif
+
+    allocator = cache->allocator;
+    allocator.free_func(cache->buckets, cache->nbuckets * sizeof(struct smr_file_cache_entry*), allocator.user);
+    allocator.free_func(cache, sizeof(struct smr_file_cache), allocator.user);
+
+    return 0;
+}
+
+int smr_file_cache_acquire(struct smr_file_cache* cache, const char* filename, const struct smr_midi_data** midi_data)
+{
+    struct smr_file_cache_entry* entry;
+    struct smr_file_cache_entry** bucket;
+    struct smr_midi_data parsed;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t path_hash;
+    size_t path_length;
+    int return_code;
+
+    if (get_file_identity(filename, &mtime, &size) != 0)
+    {
+        return 1;
+    }
+
+    path_hash = hash_path(filename);
+
+    lock_file_cache(cache);
+
+    entry = find_file_cache_entry(cache, filename, path_hash);
+    if (entry && (entry->mtime != mtime || entry->size != size))
+    {
+        /* The file changed. Whoever holds the old parse keeps it until they
+           release it. */
+        detach_file_cache_entry(cache, entry);
+        if (entry->refcount == 0)
+        {
+            remove_from_lru(cache, entry);
+            free_file_cache_entry(cache, entry);
+        }
+
+        entry = NULL;
+    }
+
+    if (entry)
+    {
+        if (entry->refcount == 0)
+        {
+            remove_from_lru(cache, entry);
+        }
+
+        entry->refcount += 1;
+
+#ifdef SMR_ENABLE_THREADS
+        while (entry->state == SMRE_file_cache_loading)
+        {
+            pthread_cond_wait(&cache->loaded, &cache->mutex);
+        }
+#endif
+
+        /* Only known once the parse waited on is done: one that failed got
+           this acquire nothing it could use. */
+        if (entry->state == SMRE_file_cache_failed)
+        {
+            cache->stats.misses += 1;
+            unref_file_cache_entry(cache, entry);
+            unlock_file_cache(cache);
+            return 1;
+        }
+
+        cache->stats.hits += 1;
+        unlock_file_cache(cache);
+        *midi_data = &entry->midi_data;
+
+        return 0;
+    }
+
+    /* Not cached: put a loading entry in the table, so that anyone else asking
+       for this file waits for this parse instead of starting their own. */
+    path_length = strlen(filename);
+    entry = (struct smr_file_cache_entry*)cache->allocator.alloc_func(sizeof(struct smr_file_cache_entry) + path_length + 1, cache->allocator.user);
+    if (!entry)
+    {
+        unlock_file_cache(cache);
+        SMR_LOG("Unable to allocate memory for file cache.\n");
+        return 1;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    entry->path = (char*)(entry + 1);
+    memcpy(entry->path, filename, path_length + 1);
+    entry->path_hash = path_hash;
+    entry->mtime = mtime;
+    entry->size = size;
+    entry->refcount = 1;
+    entry->state = SMRE_file_cache_loading;
+
+    if (cache->stats.nentries >= cache->nbuckets)
+    {
+        grow_file_cache_buckets(cache);
+    }
+
+    bucket = find_file_cache_bucket(cache, path_hash);
+    entry->next_in_bucket = *bucket;
+    *bucket = entry;
+    cache->stats.nentries += 1;
+    cache->stats.misses += 1;
+
+    unlock_file_cache(cache);
+
+    return_code = smr_read_file_mapped(filename, &cache->options, &parsed);
+
+    lock_file_cache(cache);
+
+    if (return_code != 0)
+    {
+        entry->state = SMRE_file_cache_failed;
+        if (!entry->detached)
+        {
+            detach_file_cache_entry(cache, entry);
+        }
+    }
+    else
+    {
+        entry->midi_data = parsed;
+        entry->bytes = sizeof(struct smr_file_cache_entry) + path_length + 1 + parsed._mem_size;
+        entry->state = SMRE_file_cache_ready;
+        cache->stats.bytes += entry->bytes;
+    }
+
+#ifdef SMR_ENABLE_THREADS
+    pthread_cond_broadcast(&cache->loaded);
+#endif
+
+    if (return_code != 0)
+    {
+        unref_file_cache_entry(cache, entry);
+        unlock_file_cache(cache);
+        return 1;
+    }
+
+    evict_file_cache_entries(cache);
+    unlock_file_cache(cache);
+    *midi_data = &entry->midi_data;
+
+    return 0;
+}
+
+int smr_file_cache_release(struct smr_file_cache* cache, const struct smr_midi_data* midi_data)
+{
+    struct smr_file_cache_entry* entry;
+
+    entry = (struct smr_file_cache_entry*)midi_data;
+
+    lock_file_cache(cache);
+    unref_file_cache_entry(cache, entry);
+    evict_file_cache_entries(cache);
+    unlock_file_cache(cache);
+
+    return 0;
+}
+
+void smr_file_cache_get_stats(struct smr_file_cache* cache, struct smr_file_cache_stats* stats)
+{
+    lock_file_cache(cache);
+    *stats = cache->stats;
+    unlock_file_cache(cache);
+}
+
+#define SMR_PLAYER_GENERATED 0xFFFFFFFF
+/* Per channel: reset all controllers, every controller, program, pitch bend
+   and pressure. */
+#define SMR_PLAYER_RESTORE_STEPS (1 + 128 + 3)
+
+/* Single writer only. */
+static void add_to_counter(uint64_t* counter, uint64_t value)
+{
+    SMR_ATOMIC_STORE_RELAXED(counter, SMR_ATOMIC_LOAD_RELAXED(counter) + value);
+}
+
+static void record_in_histogram(struct smr_histogram* histogram, uint64_t value)
+{
+    uint32_t bucket;
+
+    bucket = 0;
+    while (bucket < SMR_HISTOGRAM_BUCKETS - 1 && (value >> bucket) != 0)
+    {
+        ++bucket;
+    }
+
+    add_to_counter(histogram->counts + bucket, 1);
+    add_to_counter(&histogram->count, 1);
+    if (value > SMR_ATOMIC_LOAD_RELAXED(&histogram->max))
+    {
+        SMR_ATOMIC_STORE_RELAXED(&histogram->max, value);
+    }
+}
+
+static void copy_histogram(const struct smr_histogram* from, struct smr_histogram* to)
+{
+    uint32_t bucket;
+
+    for (bucket = 0; bucket < SMR_HISTOGRAM_BUCKETS; ++bucket)
+    {
+        to->counts[bucket] = SMR_ATOMIC_LOAD_RELAXED(from->counts + bucket);
+    }
+
+    to->count = SMR_ATOMIC_LOAD_RELAXED(&from->count);
+    to->max = SMR_ATOMIC_LOAD_RELAXED(&from->max);
+}
+
+/* Producer side of the ring. Returns 1 if it is full. */
+static int push_player_event(struct smr_player* player, uint64_t sample, uint16_t track_index, uint32_t event_index, uint8_t status_byte, uint8_t data1, uint8_t data2)
+{
+    struct smr_player_ring* ring;
+    struct smr_player_event* slot;
+    uint64_t now;
 
-                switch (event_type)
-                {
-                    case SMRE_meta_text:
-                    case SMRE_meta_copyright:
-                    case SMRE_meta_track_name:
-                    case SMRE_meta_instrument_name:
-                    case SMRE_meta_lyric:
-                    case SMRE_meta_marker:
-                    case SMRE_meta_cue_point:
-                    case SMRE_meta_program_name:
-                    case SMRE_meta_device_name:
-                        /* Allocating 1 extra byte for text, to add null terminator. */
-                        total_alloc_size += event_chunklen + 1;
-                        break;
-                    case SMRE_meta_sequencer_specific_event:
-                        total_alloc_size += event_chunklen;
-                        break;
-                    default:
-                        /* All other meta events don't need extra allocation space. */
-                        break;
-                }
+    ring = &player->ring;
+    if (ring->head - SMR_ATOMIC_LOAD(&ring->tail) > ring->mask)
+    {
+        add_to_counter(&player->stats.ring_full, 1);
+        return 1;
+    }
+
+    slot = ring->slots + (ring->head & ring->mask);
+    slot->sample = sample;
+    slot->offset = 0;
+    slot->event_index = event_index;
+    slot->track_index = track_index;
+    slot->bytes[0] = status_byte;
+    slot->bytes[1] = data1;
+    slot->bytes[2] = data2;
+    /* Program change and channel pressure are the only 1 byte events. */
+    slot->size = ((status_byte & 0xF0) == SMRE_midi_program_change || (status_byte & 0xF0) == SMRE_midi_channel_pressure) ? 2 : 3;
+    slot->generation = player->generation;
+
+    now = SMR_ATOMIC_LOAD(&player->audio_sample);
+    record_in_histogram(&player->stats.lead, sample > now ? sample - now : 0);
+
+    /* Publishes the slot. */
+    SMR_ATOMIC_STORE(&ring->head, ring->head + 1);
+
+    return 0;
+}
+
+/* Sample of the playback clock the song reaches seconds at. */
+static uint64_t get_player_sample(const struct smr_player* player, double seconds)
+{
+    double samples;
+
+    samples = (seconds - player->anchor_seconds) * player->sample_rate;
+    return player->anchor_sample + (samples > 0.0 ? (uint64_t)(samples + 0.5) : 0);
+}
+
+/* Song position, in seconds, at sample of the playback clock. */
+static double get_player_seconds(const struct smr_player* player, uint64_t sample)
+{
+    if (sample >= player->anchor_sample)
+    {
+        return player->anchor_seconds + (double)(sample - player->anchor_sample) / player->sample_rate;
+    }
+
+    if (sample >= player->previous_anchor_sample)
+    {
+        return player->previous_anchor_seconds + (double)(sample - player->previous_anchor_sample) / player->sample_rate;
+    }
+
+    /* Not started yet. */
+    return player->anchor_seconds;
+}
+
+/* Whether controller has to be sent to get back to value after a reset all
+   controllers, which leaves volume and pan alone. Channel mode messages and
+   (N)RPN data are skipped, they make no sense out of context. */
+static int controller_needs_restore(uint32_t controller, uint8_t value)
+{
+    if (controller >= 120 || controller == 6 || controller == 38 || (controller >= 96 && controller <= 101))
+    {
+        return 0;
+    }
+
+    if (controller == 7 || controller == 10)
+    {
+        return 1;
+    }
+
+    return value != (controller == 11 ? 127 : 0);
+}
+
+/* Queues notes off (with sustain released) on every channel and then the
+   channel state at tick, from sample on. */
+static int schedule_player_reset(struct smr_player* player, uint64_t sample, uint64_t tick, uint64_t* entry_index)
+{
+    if (smr_seek(&player->seek_index, player->midi_data, tick, player->restore_channels, NULL, entry_index) != 0)
+    {
+        return 1;
+    }
+
+    player->pending_sample = sample;
+    player->pending_notes_off = 2 * 16;
+    player->pending_restore = 16 * SMR_PLAYER_RESTORE_STEPS;
+
+    return 0;
+}
+
+/* Queues what schedule_player_reset left to do, as far as the ring allows.
+   Returns 1 if the ring filled up first. */
+static int flush_player_pending(struct smr_player* player)
+{
+    while (player->pending_notes_off > 0)
+    {
+        uint32_t message;
+        uint8_t channel;
+
+        message = 2 * 16 - player->pending_notes_off;
+        channel = (uint8_t)(message / 2);
+        /* Sustain off, then all notes off. */
+        if (push_player_event(player, player->pending_sample, 0, SMR_PLAYER_GENERATED, SMRE_midi_controller | channel, (message & 1) ? 123 : 64, 0) != 0)
+        {
+            return 1;
+        }
+
+        player->pending_notes_off -= 1;
+    }
+
+    while (player->pending_restore > 0)
+    {
+        const struct smr_channel_state* state;
+        uint32_t step;
+        uint8_t channel;
+        int full;
+
+        step = 16 * SMR_PLAYER_RESTORE_STEPS - player->pending_restore;
+        channel = (uint8_t)(step / SMR_PLAYER_RESTORE_STEPS);
+        step %= SMR_PLAYER_RESTORE_STEPS;
+        state = player->restore_channels + channel;
+
+        full = 0;
+        if (step == 0)
+        {
+            full = push_player_event(player, player->pending_sample, 0, SMR_PLAYER_GENERATED, SMRE_midi_controller | channel, 121, 0);
+        }
+        else if (step <= 128)
+        {
+            if (controller_needs_restore(step - 1, state->controllers[step - 1]))
+            {
+                full = push_player_event(player, player->pending_sample, 0, SMR_PLAYER_GENERATED, SMRE_midi_controller | channel, (uint8_t)(step - 1), state->controllers[step - 1]);
             }
-            else
+        }
+        else if (step == 129)
+        {
+            full = push_player_event(player, player->pending_sample, 0, SMR_PLAYER_GENERATED, SMRE_midi_program_change | channel, state->program, 0);
+        }
+        else if (step == 130)
+        {
+            if (state->pitch_bend != 0x2000)
             {
-                printf("\nDo not recognize status byte %0.2x.\n", status_byte & 0xFF);
-                return 1;
+                full = push_player_event(player, player->pending_sample, 0, SMR_PLAYER_GENERATED, SMRE_midi_pitch_bend | channel, state->pitch_bend & 0x7F, (uint8_t)(state->pitch_bend >> 7));
             }
+        }
+        else if (state->pressure != 0)
+        {
+            full = push_player_event(player, player->pending_sample, 0, SMR_PLAYER_GENERATED, SMRE_midi_channel_pressure | channel, state->pressure, 0);
+        }
 
-            buffer_read += event_chunklen;
-            track_num_events += 1;
+        if (full)
+        {
+            return 1;
         }
 
-        total_num_events += track_num_events;
+        player->pending_restore -= 1;
     }
 
-    total_alloc_size += total_num_events * sizeof(struct smr_event);
-    file_data->_mem_block = (uint8_t*)malloc(total_alloc_size);
-    mem_ptr = file_data->_mem_block;
+    return 0;
+}
 
-    file_data->tracks = (struct smr_track_data*)mem_ptr;
-    mem_ptr = (uint8_t*)(file_data->tracks + file_data->ntracks);
-    event_ptr = (struct smr_event*)mem_ptr;
-    mem_ptr = (uint8_t*)(event_ptr + total_num_events);
-    /* Rewind back to beginning of all track data. */
-    buffer_read = all_tracks_start;
+/* Takes back everything queued and not yet rendered. */
+static void drop_player_queue(struct smr_player* player)
+{
+    SMR_ATOMIC_STORE(&player->generation, player->generation + 1);
+    player->pending_notes_off = 0;
+    player->pending_restore = 0;
+}
 
-    for (i = 0; i < file_data->ntracks; ++i)
+int smr_player_init(struct smr_player* player, const struct smr_midi_data* midi_data, double sample_rate, double lookahead_seconds, uint32_t ring_capacity, const struct smr_allocator* allocator)
+{
+    uint64_t capacity;
+
+    memset(player, 0, sizeof(*player));
+    if (!allocator)
     {
-        struct smr_track_data track_data;
-        uint32_t track_chunklen;
-        uint8_t* track_start;
-        uint8_t last_status_byte;
+        allocator = &default_allocator;
+    }
 
-        /* Skip reading track header. */
-        buffer_read += 4;
+    if (sample_rate <= 0.0 || lookahead_seconds < 0.0)
+    {
+        SMR_LOG("Player needs a positive sample rate and lookahead.\n");
+        return 1;
+    }
 
-        track_chunklen = get_next_uint32(&buffer_read);
-        track_start = buffer_read;
-        track_data.events = event_ptr;
+    player->midi_data = midi_data;
+    player->sample_rate = sample_rate;
+    player->lookahead_samples = (uint64_t)(lookahead_seconds * sample_rate + 0.5);
+    player->allocator = *allocator;
 
-        track_data.nevents = 0;
+    capacity = 64;
+    while (capacity < ring_capacity)
+    {
+        capacity *= 2;
+    }
 
-        while (buffer_read - track_start < track_chunklen)
-        {
-            struct smr_event event;
-            uint8_t status_byte;
-            uint8_t status_byte_top;
+    player->ring.mask = capacity - 1;
+    player->ring.slots = (struct smr_player_event*)allocator->alloc_func(capacity * sizeof(struct smr_player_event), allocator->user);
+    if (!player->ring.slots)
+    {
+        SMR_LOG("Unable to allocate memory for player.\n");
+        return 1;
+    }
 
-            event.delta_time = get_next_variable_length_int(&buffer_read);
-            status_byte = get_next_uint8(&buffer_read);
+    if (smr_build_seek_index(midi_data, 0, allocator, &player->seek_index) != 0)
+    {
+        allocator->free_func(player->ring.slots, capacity * sizeof(struct smr_player_event), allocator->user);
+        return 1;
+    }
 
-            /* Check for running status. */
-            if (status_byte < 0x80)
-            {
-                status_byte = last_status_byte;
-                buffer_read -= 1;
-            }
+    if (smr_build_tempo_map(midi_data, allocator, &player->tempo_map) != 0)
+    {
+        smr_free_seek_index(&player->seek_index);
+        allocator->free_func(player->ring.slots, capacity * sizeof(struct smr_player_event), allocator->user);
+        return 1;
+    }
 
-            last_status_byte = status_byte;
+    return 0;
+}
 
-            status_byte_top = status_byte & 0xF0;
-            if (status_byte_top >= 0x80 & status_byte_top < 0xF0)
-            {
-                /* MIDI event */
-                event.event_type = (enum smr_event_type)status_byte_top;
-                /* Getting bottom nibble as channel. */
-                event.channel = status_byte & 0x0F;
+int smr_player_free(struct smr_player* player)
+{
+    if (player->ring.slots)
+    {
+        player->allocator.free_func(player->ring.slots, (player->ring.mask + 1) * sizeof(struct smr_player_event), player->allocator.user);
+        smr_free_seek_index(&player->seek_index);
+        smr_free_tempo_map(&player->tempo_map);
+    }
 
-                switch (event.event_type)
-                {
-                    case SMRE_midi_note_off:
-                    case SMRE_midi_note_on:
-                        event.note = get_next_uint8(&buffer_read);
-                        event.velocity = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_midi_polyphonic_pressure:
-                        event.note = get_next_uint8(&buffer_read);
-                        event.pressure = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_midi_controller:
-                        event.controller = get_next_uint8(&buffer_read);
-                        event.value = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_midi_program_change:
-                        event.program = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_midi_channel_pressure:
-                        event.pressure = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_midi_pitch_bend:
-                        /* TODO: Test this, I don't know that this how the pitch bend value is supposed to be read in. */
-                        event.pitch_bend = get_next_uint16(&buffer_read);
-                        break;
-                    default:
-                        /* Can't happen. */
-                        break;
-                }
-            }
-            else if (status_byte == 0xF0 || status_byte == 0xF7)
-            {
-                uint32_t message_index;
+    player->ring.slots = NULL;
 
-                /* SysEx event */
-                event.event_type = (enum smr_event_type)status_byte;
-                event.length = get_next_variable_length_int(&buffer_read);
-                event.message = (uint8_t*)mem_ptr;
+    return 0;
+}
 
-                for (message_index = 0; message_index < event.length; ++message_index)
-                {
-                    event.message[message_index] = get_next_uint8(&buffer_read);
-                }
+int smr_player_start(struct smr_player* player)
+{
+    uint64_t now;
 
-                mem_ptr += event.length;
-            }
-            else if (status_byte == 0xFF)
-            {
-                uint8_t meta_event_type;
+    if (player->playing)
+    {
+        return 0;
+    }
 
-                meta_event_type = get_next_uint8(&buffer_read);
-                event.event_type = (enum smr_event_type)(meta_event_type | (status_byte << 8));
-                event.length = get_next_variable_length_int(&buffer_read);
+    drop_player_queue(player);
+    now = SMR_ATOMIC_LOAD(&player->audio_sample);
+    player->anchor_sample = now + player->lookahead_samples;
+    player->anchor_seconds = smr_tick_to_seconds(&player->tempo_map, player->stopped_tick);
+    player->previous_anchor_sample = player->anchor_sample;
+    player->previous_anchor_seconds = player->anchor_seconds;
+    if (schedule_player_reset(player, player->anchor_sample, player->stopped_tick, &player->next_entry) != 0)
+    {
+        return 1;
+    }
 
-                switch (event.event_type)
-                {
-                    case SMRE_meta_sequence_number:
-                        event.ss_ss = get_next_uint16(&buffer_read);
-                        break;
-                    case SMRE_meta_text:
-                    case SMRE_meta_copyright:
-                    case SMRE_meta_track_name:
-                    case SMRE_meta_instrument_name:
-                    case SMRE_meta_lyric:
-                    case SMRE_meta_marker:
-                    case SMRE_meta_cue_point:
-                    case SMRE_meta_program_name:
-                    case SMRE_meta_device_name:
-                    {
-                        uint32_t text_index;
+    player->playing = 1;
+    flush_player_pending(player);
 
-                        event.text = (char*)mem_ptr;
+    return 0;
+}
 
-                        for (text_index = 0; text_index < event.length; ++text_index)
-                        {
-                            event.text[text_index] = (char)get_next_uint8(&buffer_read);
-                        }
+int smr_player_stop(struct smr_player* player)
+{
+    if (!player->playing)
+    {
+        return 0;
+    }
 
-                        /* Add null terminator. */
-                        event.text[event.length] = 0;
-                        mem_ptr += event.length + 1;
-                        break;
-                    }
-                    case SMRE_meta_midi_channel_prefix:
-                        event.cc = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_meta_midi_port:
-                        event.pp = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_meta_end_of_track:
-                        /* Empty event. */
-                        break;
-                    case SMRE_meta_tempo:
-                        event.tempo = get_next_uint24(&buffer_read);
-                        break;
-                    case SMRE_meta_smpte_offset:
-                        event.hr = get_next_uint8(&buffer_read);
-                        event.mn = get_next_uint8(&buffer_read);
-                        event.se = get_next_uint8(&buffer_read);
-                        event.fr = get_next_uint8(&buffer_read);
-                        event.ff = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_meta_time_signature:
-                        event.nn = get_next_uint8(&buffer_read);
-                        event.dd = get_next_uint8(&buffer_read);
-                        event.cc = get_next_uint8(&buffer_read);
-                        event.bb = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_meta_key_signature:
-                        event.sf = get_next_uint8(&buffer_read);
-                        event.mi = get_next_uint8(&buffer_read);
-                        break;
-                    case SMRE_meta_sequencer_specific_event:
-                    {
-                        uint32_t data_index;
+    player->stopped_tick = smr_player_get_tick(player);
+    player->playing = 0;
+    drop_player_queue(player);
 
-                        event.data = (uint8_t*)mem_ptr;
+    /* Silence right away; the channel state is restored on start. */
+    player->pending_sample = SMR_ATOMIC_LOAD(&player->audio_sample);
+    player->pending_notes_off = 2 * 16;
+    flush_player_pending(player);
 
-                        for (data_index = 0; data_index < event.length; ++data_index)
-                        {
-                            event.data[data_index] = (uint8_t) get_next_uint8(&buffer_read);
-                        }
+    return 0;
+}
 
-                        mem_ptr += event.length;
-                        break;
-                    }
-                    default:
-                        /* Can't happen. */
-                        break;
-                }
+int smr_player_seek(struct smr_player* player, uint64_t tick)
+{
+    if (!player->playing)
+    {
+        player->stopped_tick = tick;
+        return 0;
+    }
+
+    if (smr_player_stop(player) != 0)
+    {
+        return 1;
+    }
+
+    player->stopped_tick = tick;
+
+    return smr_player_start(player);
+}
+
+int smr_player_set_loop(struct smr_player* player, uint64_t start, uint64_t end)
+{
+    if (end != 0 && end <= start)
+    {
+        SMR_LOG("Loop has to end after it starts.\n");
+        return 1;
+    }
+
+    player->loop_start = start;
+    player->loop_end = end;
+
+    return 0;
+}
+
+int smr_player_update(struct smr_player* player)
+{
+    const struct smr_timeline* timeline;
+    uint64_t now;
+    uint64_t horizon;
+
+    if (flush_player_pending(player) != 0 || !player->playing)
+    {
+        return 0;
+    }
+
+    timeline = &player->seek_index.timeline;
+    now = SMR_ATOMIC_LOAD(&player->audio_sample);
+    horizon = now + player->lookahead_samples;
+    for (;;)
+    {
+        const struct smr_timeline_entry* entry;
+        uint64_t sample;
+        uint8_t status_byte;
+        uint8_t data1;
+        uint8_t data2;
+
+        entry = player->next_entry < timeline->nentries ? timeline->entries + player->next_entry : NULL;
+        if (player->loop_end != 0 && (!entry || entry->tick >= player->loop_end))
+        {
+            /* Jump back, picking up at the loop end sample with the song at
+               the loop start. A loop set behind the position jumps now. */
+            sample = get_player_sample(player, smr_tick_to_seconds(&player->tempo_map, player->loop_end));
+            if (sample > horizon)
+            {
+                break;
             }
-            else
+
+            if (sample < now)
             {
-                /* Running status */
-                printf("\nDo not recognize status byte %0.2x.\n", status_byte & 0xFF);
-                return 1;
+                sample = now;
+            }
+
+            player->previous_anchor_sample = player->anchor_sample;
+            player->previous_anchor_seconds = player->anchor_seconds;
+            player->anchor_sample = sample;
+            player->anchor_seconds = smr_tick_to_seconds(&player->tempo_map, player->loop_start);
+            if (schedule_player_reset(player, sample, player->loop_start, &player->next_entry) != 0 || flush_player_pending(player) != 0)
+            {
+                break;
             }
 
-            track_data.nevents += 1;
-            *event_ptr = event;
-            event_ptr += 1;
+            continue;
+        }
+
+        if (!entry)
+        {
+            /* Nothing left to play. */
+            break;
+        }
+
+        sample = get_player_sample(player, smr_tick_to_seconds(&player->tempo_map, entry->tick));
+        if (sample > horizon)
+        {
+            break;
+        }
+
+        /* SysEx and meta events aren't played; tempo is already in the map. */
+        if (get_channel_event(player->midi_data, entry->track_index, entry->event_index, &status_byte, &data1, &data2) &&
+            push_player_event(player, sample, entry->track_index, entry->event_index, status_byte, data1, data2) != 0)
+        {
+            break;
         }
 
-        file_data->tracks[i] = track_data;
+        player->next_entry += 1;
     }
 
     return 0;
 }
 
-int smr_read_file(const char* filename, struct smr_midi_data* file_data)
+uint64_t smr_player_get_tick(const struct smr_player* player)
 {
-    FILE* file_ptr;
-    long int file_size;
-    uint8_t* buffer;
-    int return_code;
+    if (!player->playing)
+    {
+        return player->stopped_tick;
+    }
 
-    file_ptr = fopen(filename, "rb");
-    if (!file_ptr)
+    return smr_seconds_to_tick(&player->tempo_map, get_player_seconds(player, SMR_ATOMIC_LOAD(&player->audio_sample)));
+}
+
+uint32_t smr_player_render(struct smr_player* player, uint32_t nframes, struct smr_player_event* events, uint32_t max_events)
+{
+    struct smr_player_ring* ring;
+    uint64_t start;
+    uint64_t end;
+    uint64_t tail;
+    uint64_t head;
+    uint32_t generation;
+    uint32_t nevents;
+#ifdef SMR_HAS_MONOTONIC_CLOCK
+    double now;
+#endif
+
+    ring = &player->ring;
+    start = player->audio_sample;
+    end = start + nframes;
+    generation = SMR_ATOMIC_LOAD(&player->generation);
+
+#ifdef SMR_HAS_MONOTONIC_CLOCK
+    /* Wall clock jumps and processor time would only make up jitter. */
+    now = get_time_seconds();
+    if (player->last_render_time > 0.0)
     {
-        printf("Unable to open file!\n");
-        return 1;
+        double miss;
+
+        miss = (now - player->last_render_time) - player->last_nframes / player->sample_rate;
+        record_in_histogram(&player->stats.callback_jitter, (uint64_t)((miss < 0.0 ? -miss : miss) * 1000000.0 + 0.5));
     }
 
-    /* Get file size */
-    fseek(file_ptr, 0L, SEEK_END);
-    file_size = ftell(file_ptr);
-    fseek(file_ptr, 0L, SEEK_SET);
+    player->last_render_time = now;
+    player->last_nframes = nframes;
+#endif
 
-    /* Read entire file */
-    buffer = (uint8_t*) malloc(file_size + 1);
-    fread(buffer, sizeof(uint8_t), file_size, file_ptr);
-    fclose(file_ptr);
+    tail = ring->tail;
+    head = SMR_ATOMIC_LOAD(&ring->head);
+    nevents = 0;
+    while (tail != head && nevents < max_events)
+    {
+        const struct smr_player_event* slot;
+
+        slot = ring->slots + (tail & ring->mask);
+        /* Queued before the last stop or seek. Anything newer than the
+           generation read above is kept. */
+        if ((int32_t)(slot->generation - generation) < 0)
+        {
+            add_to_counter(&player->stats.dropped, 1);
+            ++tail;
+            continue;
+        }
 
-    return_code = smr_read_byte_array(buffer, file_data);
+        if (slot->sample >= end)
+        {
+            break;
+        }
 
-    free(buffer);
+        events[nevents] = *slot;
+        events[nevents].offset = slot->sample > start ? (uint32_t)(slot->sample - start) : 0;
+        record_in_histogram(&player->stats.late, start > slot->sample ? start - slot->sample : 0);
+        ++nevents;
+        ++tail;
+    }
 
-    return return_code;
+    add_to_counter(&player->stats.rendered, nevents);
+    SMR_ATOMIC_STORE(&ring->tail, tail);
+    SMR_ATOMIC_STORE(&player->audio_sample, end);
+
+    return nevents;
 }
 
-int smr_free_midi_data(struct smr_midi_data* midi_data)
+void smr_player_get_stats(const struct smr_player* player, struct smr_player_stats* stats)
 {
-    free(midi_data->_mem_block);
-
-    return 0;
+    copy_histogram(&player->stats.lead, &stats->lead);
+    copy_histogram(&player->stats.late, &stats->late);
+    copy_histogram(&player->stats.callback_jitter, &stats->callback_jitter);
+    stats->rendered = SMR_ATOMIC_LOAD_RELAXED(&player->stats.rendered);
+    stats->dropped = SMR_ATOMIC_LOAD_RELAXED(&player->stats.dropped);
+    stats->ring_full = SMR_ATOMIC_LOAD_RELAXED(&player->stats.ring_full);
 }
 
 #endif /* SMR_IMPLEMENTATION */